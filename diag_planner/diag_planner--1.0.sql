@@ -0,0 +1,65 @@
+/* diag_planner--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION diag_planner" to load this file. \quit
+
+CREATE SCHEMA diag_planner;
+
+CREATE FUNCTION diag_planner.paths(
+OUT seq bigint,
+OUT pid int,
+OUT queryid bigint,
+OUT relids int[],
+OUT relid regclass,
+OUT jointype text,
+OUT path_type text,
+OUT startup_cost float8,
+OUT total_cost float8,
+OUT rows float8,
+OUT width int
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'paths'
+LANGUAGE C STRICT;
+
+-- Tells about the queries of all users; non-superusers who are granted it
+-- see only their own.
+REVOKE ALL ON FUNCTION diag_planner.paths() FROM PUBLIC;
+
+CREATE FUNCTION diag_planner.planning_stats(
+OUT dbid oid,
+OUT queryid bigint,
+OUT calls bigint,
+OUT total_time float8,
+OUT mean_time float8,
+OUT max_time float8,
+OUT mean_baserel_time float8,
+OUT mean_join_time float8,
+OUT mean_join_level_time float8[],
+OUT mean_mem_used bigint,
+OUT max_mem_used bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'planning_stats'
+LANGUAGE C STRICT;
+
+-- Queries are identified by the query id of pg_stat_statements, which must
+-- be loaded as well; queries without one are not tracked.
+CREATE VIEW diag_planner.planning_stats AS
+  SELECT * FROM diag_planner.planning_stats();
+
+CREATE FUNCTION diag_planner.planning_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'planning_stats_reset'
+LANGUAGE C;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION diag_planner.planning_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION diag_planner.path_tree(query text)
+RETURNS json
+AS 'MODULE_PATHNAME', 'path_tree'
+LANGUAGE C STRICT;
+
+-- Plans arbitrary SQL, so keep it away from non-superusers by default.
+REVOKE ALL ON FUNCTION diag_planner.path_tree(text) FROM PUBLIC;
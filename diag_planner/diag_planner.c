@@ -3,33 +3,214 @@
  * diag_planner.c
  *		light-weight diagnostic tool for planner
  *
+ * Candidate paths seen by the planner hooks are recorded as fixed-size
+ * binary records into a ring buffer in shared memory, and decoded only
+ * when diag_planner.paths() is called. Recording takes no lock: a writer
+ * claims a slot by bumping the ring head atomically and publishes the
+ * record by setting the slot's sequence number once it is filled in.
+ *
+ * Only planner calls selected by sampling and the query id allowlist are
+ * captured, and their records are staged locally until planning ends so
+ * that queries below the planning time and join size thresholds can be
+ * dropped. For the others the pathlist hooks only test a flag.
+ *
+ * With diag_planner.track_planning, the time spent generating base
+ * relation paths, at each join level and on the whole planner call, and
+ * the memory the planner used, are aggregated per query id in a shared
+ * hash table read through the diag_planner.planning_stats view. The
+ * phases are timed by the intervals between the pathlist hook calls. The
+ * query ids are those of pg_stat_statements, so it must be loaded too, and
+ * the least planned queries are evicted once diag_planner.max_queries are
+ * tracked.
+ *
+ * Whole path trees can also be serialized as JSON, either for a given
+ * query by diag_planner.path_tree(), or for every captured query into the
+ * server log. The trees are written at the end of planning from the
+ * planner roots seen by the hooks, in a memory context of their own that
+ * is reset for each query.
+ *
  *-------------------------------------------------------------------------
  */
 
 #include "postgres.h"
 #include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
 
+#include "access/stratnum.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "nodes/nodeFuncs.h"
 #include "nodes/nodes.h"
-#include "lib/stringinfo.h"
+#include "nodes/pg_list.h"
 #include "optimizer/plancat.h"
 #include "optimizer/planner.h"
 #include "optimizer/paths.h"
 #include "optimizer/prep.h"
 #include "parser/parsetree.h"
-#include "lib/stringinfo.h"
 #include "nodes/extensible.h"
 #include "nodes/plannodes.h"
 #include "nodes/relation.h"
-#include "utils/datum.h"
-#include "utils/rel.h"
+#include "portability/instr_time.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/json.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
 
 PG_MODULE_MAGIC;
 
+/* Range table indexes beyond this are not recorded in relids */
+#define DIAG_MAX_RELIDS		64
+
+/* Joins of more relations than this are timed as this level */
+#define DIAG_MAX_JOIN_LEVELS	16
+
+/* Eviction of planning statistics, as in pg_stat_statements */
+#define DIAG_USAGE_INIT			(1.0)	/* usage of the first entries */
+#define DIAG_USAGE_DECREASE_FACTOR	(0.99)	/* decay on each eviction */
+#define DIAG_USAGE_DEALLOC_PERCENT	5	/* % of entries to evict at once */
+
+/* One candidate path */
+typedef struct DiagPathData
+{
+	uint32		queryid;		/* Query->queryId, 0 if not computed */
+	int32		pid;			/* backend that planned the query */
+	Oid			userid;			/* user who planned the query */
+	Oid			dbid;			/* database the query was planned in */
+	uint64		relids;			/* bitmap of range table indexes */
+	Oid			relid;			/* relation for a base rel, else invalid */
+	int16		pathtype;		/* NodeTag of the plan node to produce */
+	int16		jointype;		/* JoinType, or -1 for a base rel */
+	double		startup_cost;
+	double		total_cost;
+	double		rows;
+	int32		width;
+} DiagPathData;
+
+/*
+ * A slot of the ring. seq is 0 while the slot is being written, and
+ * otherwise the position in the ring plus one of the record it holds.
+ */
+typedef struct DiagPathRecord
+{
+	pg_atomic_uint64 seq;
+	DiagPathData path;
+} DiagPathRecord;
+
+/* Parsed diag_planner.query_ids, sorted */
+typedef struct DiagQueryIdList
+{
+	int			n_ids;
+	uint32		ids[FLEXIBLE_ARRAY_MEMBER];
+} DiagQueryIdList;
+
+typedef struct DiagPlannerRing
+{
+	pg_atomic_uint64 head;		/* position of the next record to write */
+	int			size;			/* number of slots */
+	DiagPathRecord slots[FLEXIBLE_ARRAY_MEMBER];
+} DiagPlannerRing;
+
+/* Planning time of one planner call, in milliseconds */
+typedef struct DiagPlanningTimes
+{
+	double		baserel_time;	/* until base relation paths are done */
+	double		join_time[DIAG_MAX_JOIN_LEVELS - 1];	/* from level 2 */
+} DiagPlanningTimes;
+
+typedef struct DiagPlanningKey
+{
+	Oid			dbid;
+	uint32		queryid;
+} DiagPlanningKey;
+
+/* Planning statistics of a query, protected by mutex */
+typedef struct DiagPlanningEntry
+{
+	DiagPlanningKey key;		/* hash key of entry - MUST BE FIRST */
+	slock_t		mutex;
+	int64		calls;
+	double		total_time;
+	double		max_time;
+	DiagPlanningTimes times;	/* sums over all calls */
+	int64		mem_used;		/* sum over all calls */
+	int64		max_mem_used;
+	double		usage;			/* calls, decayed on each eviction */
+} DiagPlanningEntry;
+
+typedef struct DiagPlanningShared
+{
+	LWLock	   *lock;			/* protects the hash table */
+	double		cur_median_usage;	/* usage given to new entries */
+} DiagPlanningShared;
+
+/* GUC variables */
+static int	diag_buffer_size = 8192;
+static double diag_sample_rate = 1.0;
+static char *diag_query_ids = NULL;
+static int	diag_min_planning_time = -1;
+static int	diag_min_joinrels = -1;
+static bool diag_track_planning = false;
+static int	diag_max_queries = 1000;
+static bool diag_log_path_trees = false;
+static int	diag_max_path_tree_size = 1024;
+
+static DiagQueryIdList *diag_query_id_list = NULL;
+
+static DiagPlannerRing *DiagRing = NULL;
+static DiagPlanningShared *DiagPlanning = NULL;
+static HTAB *DiagPlanningHash = NULL;
+
+/*
+ * State of the current planner call. Records of captured calls are staged
+ * in pending[], from the index saved when the call started. hooks_active
+ * is set when the paths are captured, the planning is timed or the path
+ * tree is built.
+ */
+static bool hooks_active = false;
+static bool capture_paths = false;
+static bool track_current = false;
+static bool build_tree = false;
+static DiagPlanningTimes cur_times;
+static instr_time last_event;
+static int	n_joinrels = 0;
+static DiagPathData *pending = NULL;
+static int	n_pending = 0;
+static int	max_pending = 0;
+
+/*
+ * Path tree being serialized. Everything, including the planner roots
+ * collected by the hooks, lives in tree_context.
+ */
+static bool force_path_tree = false;
+static MemoryContext tree_context = NULL;
+static List *tree_roots = NIL;
+static StringInfo tree_json = NULL;
+static bool tree_truncated = false;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static planner_hook_type prev_planner_hook = NULL;
 static set_rel_pathlist_hook_type prev_set_rel_pathlist = NULL;
 static set_join_pathlist_hook_type prev_set_join_pathlist = NULL;
+static create_upper_paths_hook_type prev_create_upper_paths = NULL;
 
 void _PG_init(void);
+void _PG_fini(void);
+PlannedStmt *diag_planner(Query *parse,
+						  int cursorOptions,
+						  ParamListInfo boundParams);
 void my_set_rel_pathlist (PlannerInfo *root,
 						  RelOptInfo *rel,
 						  Index rti,
@@ -40,168 +221,1753 @@ void my_set_join_pathlist (PlannerInfo *root,
 						   RelOptInfo *innerrel,
 						   JoinType jointype,
 						   JoinPathExtraData *extra);
+void my_create_upper_paths (PlannerInfo *root,
+							UpperRelationKind stage,
+							RelOptInfo *input_rel,
+							RelOptInfo *output_rel);
+
+PG_FUNCTION_INFO_V1(paths);
+PG_FUNCTION_INFO_V1(planning_stats);
+PG_FUNCTION_INFO_V1(planning_stats_reset);
+PG_FUNCTION_INFO_V1(path_tree);
+
+static Size ring_size(void);
+static Size diag_shmemsize(void);
+static void diag_shmem_startup(void);
+static bool check_query_ids(char **newval, void **extra, GucSource source);
+static void assign_query_ids(const char *newval, void *extra);
+static int	compareQueryIds(const void *a, const void *b);
+static bool isQuerySelected(Query *parse);
+static void recordPathList(PlannerInfo *root, RelOptInfo *rel, Oid relid,
+						   int jointype);
+static void flushPending(int start);
+static void markEvent(double *elapsed);
+static void addTreeRoot(PlannerInfo *root);
+static Size memoryUsed(MemoryContext context, MemoryContextCounters *totals);
+static void storePlanningStats(Query *parse, double total_time,
+							   Size mem_used);
+static void evictPlanningEntries(void);
+static int	compareUsage(const void *a, const void *b);
+static const char *pathTypeName(int pathtype);
+static const char *joinTypeName(int jointype);
+static const char *pathNodeName(Path *path);
+static void startPathTree(void);
+static void serializePathTree(Query *parse);
+static bool treeFull(StringInfo str);
+static void outRelJson(StringInfo str, PlannerInfo *root, RelOptInfo *rel,
+					   const char *stage, bool *first);
+static void outPathListJson(StringInfo str, PlannerInfo *root, List *paths);
+static void outPathJson(StringInfo str, PlannerInfo *root, Path *path);
+static void outPathKeysJson(StringInfo str, PlannerInfo *root,
+							List *pathkeys);
+static void outRelidsJson(StringInfo str, Relids relids);
+
+void
+_PG_init(void)
+{
+	/*
+	 * The ring buffer lives in the main shared memory segment, so we must
+	 * be loaded by the postmaster.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("diag_planner.buffer_size",
+							"Number of path records kept in the ring buffer",
+							NULL,
+							&diag_buffer_size,
+							8192,
+							16,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("diag_planner.sample_rate",
+							 "Fraction of planner calls to capture",
+							 NULL,
+							 &diag_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("diag_planner.query_ids",
+							   "Comma-separated list of query ids to capture, empty for all",
+							   "Query ids are computed only when pg_stat_statements is loaded.",
+							   &diag_query_ids,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   check_query_ids,
+							   assign_query_ids,
+							   NULL);
+
+	DefineCustomIntVariable("diag_planner.min_planning_time",
+							"Capture only queries planned in at least this time, -1 to disable",
+							NULL,
+							&diag_min_planning_time,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("diag_planner.min_joinrels",
+							"Capture only queries with at least this many join relations, -1 to disable",
+							NULL,
+							&diag_min_joinrels,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("diag_planner.track_planning",
+							 "Collect planning time statistics per query",
+							 "Queries are identified by the query id computed by "
+							 "pg_stat_statements, which must be loaded as well. "
+							 "Queries without a query id are not tracked.",
+							 &diag_track_planning,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("diag_planner.max_queries",
+							"Maximum number of queries whose planning is tracked",
+							"Beyond this, the least planned queries are discarded.",
+							&diag_max_queries,
+							1000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("diag_planner.log_path_trees",
+							 "Log the path trees of captured queries as JSON",
+							 NULL,
+							 &diag_log_path_trees,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("diag_planner.max_path_tree_size",
+							"Size beyond which no more paths are added to a path tree",
+							NULL,
+							&diag_max_path_tree_size,
+							1024,
+							1,
+							MAX_KILOBYTES,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("diag_planner");
+
+	RequestAddinShmemSpace(diag_shmemsize());
+	RequestNamedLWLockTranche("diag_planner", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = diag_shmem_startup;
+
+	prev_planner_hook = planner_hook;
+	planner_hook = diag_planner;
+
+	prev_set_rel_pathlist = set_rel_pathlist_hook;
+	set_rel_pathlist_hook = my_set_rel_pathlist;
+
+	prev_set_join_pathlist = set_join_pathlist_hook;
+	set_join_pathlist_hook = my_set_join_pathlist;
+
+	prev_create_upper_paths = create_upper_paths_hook;
+	create_upper_paths_hook = my_create_upper_paths;
+}
+
+void
+_PG_fini(void)
+{
+	shmem_startup_hook = prev_shmem_startup_hook;
+	planner_hook = prev_planner_hook;
+	set_rel_pathlist_hook = prev_set_rel_pathlist;
+	set_join_pathlist_hook = prev_set_join_pathlist;
+	create_upper_paths_hook = prev_create_upper_paths;
+}
+
+static Size
+ring_size(void)
+{
+	return add_size(offsetof(DiagPlannerRing, slots),
+					mul_size(sizeof(DiagPathRecord), diag_buffer_size));
+}
+
+static Size
+diag_shmemsize(void)
+{
+	Size		size;
+
+	size = ring_size();
+	size = add_size(size, MAXALIGN(sizeof(DiagPlanningShared)));
+	size = add_size(size, hash_estimate_size(diag_max_queries,
+											 sizeof(DiagPlanningEntry)));
+
+	return size;
+}
 
 static void
-_outJoinPath(PlannerInfo *root, Path *path, StringInfo str_out)
+diag_shmem_startup(void)
 {
-	StringInfoData str;
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
 
-	initStringInfo(&str);
-	switch (path->pathtype)
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	DiagRing = ShmemInitStruct("diag_planner",
+							   ring_size(),
+							   &found);
+	if (!found)
 	{
-		case T_HashJoin:
-			appendStringInfo(&str, "hashjoin ");
-			break;
-		case T_MergeJoin:
-			appendStringInfo(&str, "mergejoin ");
-			break;
-		case T_NestLoop:
-			appendStringInfo(&str, "nestloop ");
-			break;
-		case T_Append:
-			appendStringInfo(&str, "append ");
-			break;
+		int			i;
+
+		pg_atomic_init_u64(&DiagRing->head, 0);
+		DiagRing->size = diag_buffer_size;
+		for (i = 0; i < diag_buffer_size; i++)
+			pg_atomic_init_u64(&DiagRing->slots[i].seq, 0);
 	}
+
+	DiagPlanning = ShmemInitStruct("diag_planner planning",
+								   sizeof(DiagPlanningShared),
+								   &found);
+	if (!found)
+	{
+		DiagPlanning->lock = &(GetNamedLWLockTranche("diag_planner"))->lock;
+		DiagPlanning->cur_median_usage = DIAG_USAGE_INIT;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(DiagPlanningKey);
+	info.entrysize = sizeof(DiagPlanningEntry);
+	DiagPlanningHash = ShmemInitHash("diag_planner planning hash",
+									 diag_max_queries, diag_max_queries,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
 }
 
-static char *
-_outPath(PlanerInfo *root, Path *path, Oid relid)
+static bool
+check_query_ids(char **newval, void **extra, GucSource source)
 {
-	StringInfoData str;
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *cell;
+	DiagQueryIdList *list;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
 
-	initStringInfo(&str);
-	switch (path->pathtype)
+	list = (DiagQueryIdList *) malloc(offsetof(DiagQueryIdList, ids) +
+									  sizeof(uint32) * list_length(elemlist));
+	if (list == NULL)
 	{
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+	list->n_ids = 0;
+
+	foreach (cell, elemlist)
+	{
+		char	   *id = (char *) lfirst(cell);
+		char	   *endptr;
+		unsigned long val;
+
+		errno = 0;
+		val = strtoul(id, &endptr, 10);
+		if (*id == '\0' || *id == '-' || *endptr != '\0' || errno != 0 ||
+			val > PG_UINT32_MAX)
+		{
+			GUC_check_errdetail("Invalid query id: \"%s\".", id);
+			free(list);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+		list->ids[list->n_ids++] = (uint32) val;
+	}
+
+	qsort(list->ids, list->n_ids, sizeof(uint32), compareQueryIds);
+
+	pfree(rawstring);
+	list_free(elemlist);
+
+	*extra = list;
+	return true;
+}
+
+static void
+assign_query_ids(const char *newval, void *extra)
+{
+	diag_query_id_list = (DiagQueryIdList *) extra;
+}
+
+static int
+compareQueryIds(const void *a, const void *b)
+{
+	uint32		id_a = *(const uint32 *) a;
+	uint32		id_b = *(const uint32 *) b;
+
+	if (id_a < id_b)
+		return -1;
+	if (id_a > id_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Decide whether to capture the paths of a planner call, by sampling and
+ * by the query id allowlist.
+ */
+static bool
+isQuerySelected(Query *parse)
+{
+	if (diag_sample_rate <= 0.0)
+		return false;
+
+	if (diag_query_id_list != NULL && diag_query_id_list->n_ids > 0 &&
+		bsearch(&parse->queryId, diag_query_id_list->ids,
+				diag_query_id_list->n_ids, sizeof(uint32),
+				compareQueryIds) == NULL)
+		return false;
+
+	return diag_sample_rate >= 1.0 ||
+		random() < diag_sample_rate * MAX_RANDOM_VALUE;
+}
+
+/*
+ * planner_hook
+ *
+ * Decide whether to capture this call, and at the end either publish the
+ * records staged during it or drop them. If planning is tracked, the call
+ * plans in its own memory context so that the memory it uses can be
+ * measured; the context is a child of the caller's and goes away with it.
+ */
+PlannedStmt *
+diag_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
+{
+	bool		save_hooks_active = hooks_active;
+	bool		save_capture_paths = capture_paths;
+	bool		save_track_current = track_current;
+	bool		save_build_tree = build_tree;
+	DiagPlanningTimes save_times = cur_times;
+	instr_time	save_last_event = last_event;
+	int			save_n_joinrels = n_joinrels;
+	int			start = n_pending;
+	MemoryContext oldcontext = CurrentMemoryContext;
+	MemoryContext plancontext = NULL;
+	instr_time	start_time;
+	PlannedStmt *result;
+
+	capture_paths = isQuerySelected(parse);
+	/* Queries are told apart by the query id of pg_stat_statements */
+	track_current = diag_track_planning && DiagPlanningHash != NULL &&
+		parse->queryId != 0;
+	/* Nested planner calls are not added to the tree of the outer one */
+	build_tree = !save_build_tree &&
+		(force_path_tree || (capture_paths && diag_log_path_trees));
+	hooks_active = capture_paths || track_current || build_tree;
+	n_joinrels = 0;
+	memset(&cur_times, 0, sizeof(DiagPlanningTimes));
+
+	INSTR_TIME_SET_ZERO(start_time);
+	if (hooks_active)
+		INSTR_TIME_SET_CURRENT(start_time);
+	last_event = start_time;
+
+	if (track_current)
+	{
+		plancontext = AllocSetContextCreate(CurrentMemoryContext,
+											"diag_planner",
+											ALLOCSET_DEFAULT_SIZES);
+		MemoryContextSwitchTo(plancontext);
+	}
+
+	if (build_tree)
+		startPathTree();
+
+	PG_TRY();
+	{
+		if (prev_planner_hook)
+			result = prev_planner_hook(parse, cursorOptions, boundParams);
+		else
+			result = standard_planner(parse, cursorOptions, boundParams);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		hooks_active = save_hooks_active;
+		capture_paths = save_capture_paths;
+		track_current = save_track_current;
+		build_tree = save_build_tree;
+		cur_times = save_times;
+		last_event = save_last_event;
+		n_joinrels = save_n_joinrels;
+		n_pending = start;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (hooks_active)
+	{
+		instr_time	duration;
+		double		total_time;
+		bool		triggered;
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start_time);
+		total_time = INSTR_TIME_GET_MILLISEC(duration);
+
+		if (track_current)
+		{
+			MemoryContextCounters totals;
+
+			memset(&totals, 0, sizeof(totals));
+			storePlanningStats(parse, total_time,
+							   memoryUsed(plancontext, &totals));
+		}
+
+		/* With no threshold set, every selected query is captured */
+		triggered = (diag_min_planning_time < 0 && diag_min_joinrels < 0) ||
+			(diag_min_planning_time >= 0 &&
+			 total_time >= diag_min_planning_time) ||
+			(diag_min_joinrels >= 0 && n_joinrels >= diag_min_joinrels);
+
+		if (capture_paths && triggered)
+			flushPending(start);
+
+		/* path_tree() picks up a forced tree itself */
+		if (build_tree && force_path_tree)
+			serializePathTree(parse);
+		else if (build_tree && triggered)
+		{
+			serializePathTree(parse);
+			ereport(LOG,
+					(errmsg("diag_planner path tree: %s", tree_json->data),
+					 errhidestmt(true)));
+			MemoryContextReset(tree_context);
+			tree_json = NULL;
+		}
+	}
+
+	hooks_active = save_hooks_active;
+	capture_paths = save_capture_paths;
+	track_current = save_track_current;
+	build_tree = save_build_tree;
+	cur_times = save_times;
+	last_event = save_last_event;
+	n_joinrels = save_n_joinrels;
+	n_pending = start;
+
+	return result;
+}
+
+/*
+ * Add the time since the previous planner event to *elapsed. A phase is
+ * charged with everything since the previous hook call, so the base
+ * relation time includes the preprocessing before the first path.
+ */
+static void
+markEvent(double *elapsed)
+{
+	instr_time	now;
+	instr_time	interval;
+
+	INSTR_TIME_SET_CURRENT(now);
+	interval = now;
+	INSTR_TIME_SUBTRACT(interval, last_event);
+	*elapsed += INSTR_TIME_GET_MILLISEC(interval);
+	last_event = now;
+}
+
+/* Return the total space of context and its children */
+static Size
+memoryUsed(MemoryContext context, MemoryContextCounters *totals)
+{
+	MemoryContext child;
+
+	context->methods->stats(context, 0, false, totals);
+	for (child = context->firstchild; child != NULL; child = child->nextchild)
+		memoryUsed(child, totals);
+
+	return totals->totalspace;
+}
+
+/*
+ * Add the planning statistics of the current planner call to the entry of
+ * its query, creating it if needed.
+ */
+static void
+storePlanningStats(Query *parse, double total_time, Size mem_used)
+{
+	DiagPlanningKey key;
+	DiagPlanningEntry *entry;
+	int			i;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.queryid = parse->queryId;
+
+	LWLockAcquire(DiagPlanning->lock, LW_SHARED);
+
+	entry = (DiagPlanningEntry *) hash_search(DiagPlanningHash, &key,
+											  HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		/* Need exclusive lock to make a new entry */
+		LWLockRelease(DiagPlanning->lock);
+		LWLockAcquire(DiagPlanning->lock, LW_EXCLUSIVE);
+
+		if (hash_get_num_entries(DiagPlanningHash) >= diag_max_queries)
+			evictPlanningEntries();
+
+		entry = (DiagPlanningEntry *) hash_search(DiagPlanningHash, &key,
+												  HASH_ENTER, &found);
+		if (!found)
+		{
+			memset((char *) entry + sizeof(DiagPlanningKey), 0,
+				   sizeof(DiagPlanningEntry) - sizeof(DiagPlanningKey));
+			SpinLockInit(&entry->mutex);
+			/* Not to be the first evicted before it is planned again */
+			entry->usage = DiagPlanning->cur_median_usage;
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->calls++;
+	entry->usage += 1.0;
+	entry->total_time += total_time;
+	entry->max_time = Max(entry->max_time, total_time);
+	entry->times.baserel_time += cur_times.baserel_time;
+	for (i = 0; i < DIAG_MAX_JOIN_LEVELS - 1; i++)
+		entry->times.join_time[i] += cur_times.join_time[i];
+	entry->mem_used += mem_used;
+	entry->max_mem_used = Max(entry->max_mem_used, (int64) mem_used);
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(DiagPlanning->lock);
+}
+
+/*
+ * Make room in the full hash table by discarding the least planned
+ * queries, as pg_stat_statements does. Usage decays on each eviction, so
+ * that queries no longer planned eventually go. The caller must hold the
+ * lock exclusively.
+ */
+static void
+evictPlanningEntries(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	DiagPlanningEntry **entries;
+	DiagPlanningEntry *entry;
+	int			n_entries = 0;
+	int			n_victims;
+	int			i;
+
+	entries = (DiagPlanningEntry **)
+		palloc(hash_get_num_entries(DiagPlanningHash) *
+			   sizeof(DiagPlanningEntry *));
+
+	hash_seq_init(&hash_seq, DiagPlanningHash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entries[n_entries++] = entry;
+		entry->usage *= DIAG_USAGE_DECREASE_FACTOR;
+	}
+
+	qsort(entries, n_entries, sizeof(DiagPlanningEntry *), compareUsage);
+
+	if (n_entries > 0)
+		DiagPlanning->cur_median_usage = entries[n_entries / 2]->usage;
+
+	n_victims = Max(10, n_entries * DIAG_USAGE_DEALLOC_PERCENT / 100);
+	n_victims = Min(n_victims, n_entries);
+
+	for (i = 0; i < n_victims; i++)
+		hash_search(DiagPlanningHash, &entries[i]->key, HASH_REMOVE, NULL);
+
+	pfree(entries);
+}
+
+static int
+compareUsage(const void *a, const void *b)
+{
+	double		usage_a = (*(DiagPlanningEntry *const *) a)->usage;
+	double		usage_b = (*(DiagPlanningEntry *const *) b)->usage;
+
+	if (usage_a < usage_b)
+		return -1;
+	if (usage_a > usage_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Stage a record for each path in rel's pathlist. Records beyond the size
+ * of the ring would only overwrite each other, so they are not kept.
+ */
+static void
+recordPathList(PlannerInfo *root, RelOptInfo *rel, Oid relid, int jointype)
+{
+	uint32		queryid = root->parse->queryId;
+	uint64		relids = 0;
+	ListCell   *cell;
+	int			x = -1;
+
+	while ((x = bms_next_member(rel->relids, x)) >= 0 &&
+		   x < DIAG_MAX_RELIDS)
+		relids |= UINT64CONST(1) << x;
+
+	foreach (cell, rel->pathlist)
+	{
+		Path	   *path = (Path *) lfirst(cell);
+		DiagPathData *rec;
+
+		if (n_pending >= max_pending)
+		{
+			if (max_pending >= DiagRing->size)
+				return;
+
+			if (pending == NULL)
+			{
+				max_pending = Min(64, DiagRing->size);
+				pending = (DiagPathData *)
+					MemoryContextAlloc(TopMemoryContext,
+									   sizeof(DiagPathData) * max_pending);
+			}
+			else
+			{
+				max_pending = Min(max_pending * 2, DiagRing->size);
+				pending = (DiagPathData *)
+					repalloc(pending, sizeof(DiagPathData) * max_pending);
+			}
+		}
+
+		rec = &pending[n_pending++];
+		rec->queryid = queryid;
+		rec->pid = MyProcPid;
+		rec->userid = GetUserId();
+		rec->dbid = MyDatabaseId;
+		rec->relids = relids;
+		rec->relid = relid;
+		rec->pathtype = (int16) path->pathtype;
+		rec->jointype = (int16) jointype;
+		rec->startup_cost = path->startup_cost;
+		rec->total_cost = path->total_cost;
+		rec->rows = path->rows;
+		rec->width = path->pathtarget->width;
+	}
+}
+
+/*
+ * Append the records staged from index start on to the ring.
+ *
+ * A writer that is lapped by the whole ring while it fills in a slot can
+ * leave a record mixing two paths; the buffer is sized so that this does
+ * not happen in practice, and the data is diagnostic only.
+ */
+static void
+flushPending(int start)
+{
+	int			i;
+
+	for (i = start; i < n_pending; i++)
+	{
+		uint64		pos = pg_atomic_fetch_add_u64(&DiagRing->head, 1);
+		DiagPathRecord *rec = &DiagRing->slots[pos % DiagRing->size];
+
+		pg_atomic_write_u64(&rec->seq, 0);
+		pg_write_barrier();
+
+		rec->path = pending[i];
+
+		pg_write_barrier();
+		pg_atomic_write_u64(&rec->seq, pos + 1);
+	}
+}
+
+void
+my_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel, Index rti, RangeTblEntry *rte)
+{
+	if (prev_set_rel_pathlist)
+		prev_set_rel_pathlist(root, rel, rti, rte);
+
+	if (!hooks_active)
+		return;
+
+	if (track_current)
+		markEvent(&cur_times.baserel_time);
+
+	if (build_tree)
+		addTreeRoot(root);
+
+	if (capture_paths)
+		recordPathList(root, rel,
+					   rte->rtekind == RTE_RELATION ? rte->relid : InvalidOid,
+					   -1);
+}
+
+/*
+ * Query levels without any base relation, such as SELECT 1 or the top of a
+ * UNION, never reach set_rel_pathlist_hook, but every level ends up here
+ * with UPPERREL_FINAL.
+ */
+void
+my_create_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+					  RelOptInfo *input_rel, RelOptInfo *output_rel)
+{
+	if (prev_create_upper_paths)
+		prev_create_upper_paths(root, stage, input_rel, output_rel);
+
+	if (hooks_active && build_tree)
+		addTreeRoot(root);
+}
+
+void
+my_set_join_pathlist(PlannerInfo *root, RelOptInfo *joinrel, RelOptInfo *outerrel,
+					 RelOptInfo *innerrel, JoinType jointype, JoinPathExtraData *extra)
+{
+	if (prev_set_join_pathlist)
+		prev_set_join_pathlist(root, joinrel, outerrel, innerrel, jointype,
+							   extra);
+
+	if (!hooks_active)
+		return;
+
+	/* the list only grows while joins are planned at this level */
+	n_joinrels = Max(n_joinrels, list_length(root->join_rel_list));
+
+	if (track_current)
+	{
+		int			level = bms_num_members(joinrel->relids);
+
+		markEvent(&cur_times.join_time[Min(level, DIAG_MAX_JOIN_LEVELS) - 2]);
+	}
+
+	if (capture_paths)
+		recordPathList(root, joinrel, InvalidOid, (int) jointype);
+}
+
+static const char *
+pathTypeName(int pathtype)
+{
+	switch ((NodeTag) pathtype)
+	{
+		case T_Result:
+			return "Result";
+		case T_ProjectSet:
+			return "ProjectSet";
+		case T_ModifyTable:
+			return "ModifyTable";
+		case T_Append:
+			return "Append";
+		case T_MergeAppend:
+			return "MergeAppend";
+		case T_RecursiveUnion:
+			return "RecursiveUnion";
+		case T_BitmapAnd:
+			return "BitmapAnd";
+		case T_BitmapOr:
+			return "BitmapOr";
 		case T_SeqScan:
-			appendStringInfo(&str, "sequential\t");
-			break;
+			return "SeqScan";
 		case T_SampleScan:
-			appendStringInfo(&str, "sample\t");
-			break;
+			return "SampleScan";
 		case T_IndexScan:
-			appendStringInfo(&str, "index\t");
-			break;
+			return "IndexScan";
 		case T_IndexOnlyScan:
-			appendStringInfo(&str, "indexonly\t");
-			break;
+			return "IndexOnlyScan";
 		case T_BitmapIndexScan:
-			appendStringInfo(&str, "bitmapindex\t");
-			break;
+			return "BitmapIndexScan";
 		case T_BitmapHeapScan:
-			appendStringInfo(&str, "bitmapheap\t");
-			break;
-		case T_HashJoin:
-			appendStringInfo(&str, "hashjoin ");
-			break;
+			return "BitmapHeapScan";
+		case T_TidScan:
+			return "TidScan";
+		case T_SubqueryScan:
+			return "SubqueryScan";
+		case T_FunctionScan:
+			return "FunctionScan";
+		case T_ValuesScan:
+			return "ValuesScan";
+		case T_TableFuncScan:
+			return "TableFuncScan";
+		case T_CteScan:
+			return "CteScan";
+		case T_NamedTuplestoreScan:
+			return "NamedTuplestoreScan";
+		case T_WorkTableScan:
+			return "WorkTableScan";
+		case T_ForeignScan:
+			return "ForeignScan";
+		case T_CustomScan:
+			return "CustomScan";
+		case T_NestLoop:
+			return "NestLoop";
 		case T_MergeJoin:
-			appendStringInfo(&str, "mergejoin ");
+			return "MergeJoin";
+		case T_HashJoin:
+			return "HashJoin";
+		case T_Material:
+			return "Material";
+		case T_Sort:
+			return "Sort";
+		case T_Group:
+			return "Group";
+		case T_Agg:
+			return "Agg";
+		case T_WindowAgg:
+			return "WindowAgg";
+		case T_Unique:
+			return "Unique";
+		case T_Gather:
+			return "Gather";
+		case T_GatherMerge:
+			return "GatherMerge";
+		case T_Hash:
+			return "Hash";
+		case T_SetOp:
+			return "SetOp";
+		case T_LockRows:
+			return "LockRows";
+		case T_Limit:
+			return "Limit";
+		default:
+			return "Unknown";
+	}
+}
+
+static const char *
+joinTypeName(int jointype)
+{
+	switch ((JoinType) jointype)
+	{
+		case JOIN_INNER:
+			return "Inner";
+		case JOIN_LEFT:
+			return "Left";
+		case JOIN_RIGHT:
+			return "Right";
+		case JOIN_FULL:
+			return "Full";
+		case JOIN_SEMI:
+			return "Semi";
+		case JOIN_ANTI:
+			return "Anti";
+		case JOIN_UNIQUE_OUTER:
+			return "UniqueOuter";
+		case JOIN_UNIQUE_INNER:
+			return "UniqueInner";
+		default:
+			return "Unknown";
+	}
+}
+
+static const char *
+pathNodeName(Path *path)
+{
+	switch (nodeTag(path))
+	{
+		case T_Path:
+			return "Path";
+		case T_IndexPath:
+			return "IndexPath";
+		case T_BitmapHeapPath:
+			return "BitmapHeapPath";
+		case T_BitmapAndPath:
+			return "BitmapAndPath";
+		case T_BitmapOrPath:
+			return "BitmapOrPath";
+		case T_TidPath:
+			return "TidPath";
+		case T_SubqueryScanPath:
+			return "SubqueryScanPath";
+		case T_ForeignPath:
+			return "ForeignPath";
+		case T_CustomPath:
+			return "CustomPath";
+		case T_NestPath:
+			return "NestPath";
+		case T_MergePath:
+			return "MergePath";
+		case T_HashPath:
+			return "HashPath";
+		case T_AppendPath:
+			return "AppendPath";
+		case T_MergeAppendPath:
+			return "MergeAppendPath";
+		case T_ResultPath:
+			return "ResultPath";
+		case T_MaterialPath:
+			return "MaterialPath";
+		case T_UniquePath:
+			return "UniquePath";
+		case T_GatherPath:
+			return "GatherPath";
+		case T_GatherMergePath:
+			return "GatherMergePath";
+		case T_ProjectionPath:
+			return "ProjectionPath";
+		case T_ProjectSetPath:
+			return "ProjectSetPath";
+		case T_SortPath:
+			return "SortPath";
+		case T_GroupPath:
+			return "GroupPath";
+		case T_UpperUniquePath:
+			return "UpperUniquePath";
+		case T_AggPath:
+			return "AggPath";
+		case T_GroupingSetsPath:
+			return "GroupingSetsPath";
+		case T_MinMaxAggPath:
+			return "MinMaxAggPath";
+		case T_WindowAggPath:
+			return "WindowAggPath";
+		case T_SetOpPath:
+			return "SetOpPath";
+		case T_RecursiveUnionPath:
+			return "RecursiveUnionPath";
+		case T_LockRowsPath:
+			return "LockRowsPath";
+		case T_ModifyTablePath:
+			return "ModifyTablePath";
+		case T_LimitPath:
+			return "LimitPath";
+		default:
+			return "Unknown";
+	}
+}
+
+/*
+ * Begin a new path tree, throwing away the previous one.
+ */
+static void
+startPathTree(void)
+{
+	if (tree_context == NULL)
+		tree_context = AllocSetContextCreate(TopMemoryContext,
+											 "diag_planner path tree",
+											 ALLOCSET_DEFAULT_SIZES);
+	else
+		MemoryContextReset(tree_context);
+
+	tree_roots = NIL;
+	tree_json = NULL;
+	tree_truncated = false;
+}
+
+/* Each subquery has a root of its own */
+static void
+addTreeRoot(PlannerInfo *root)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(tree_context);
+
+	tree_roots = list_append_unique_ptr(tree_roots, root);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Serialize the relations of every planner root seen during the planning
+ * of parse, with their paths and partial paths, into tree_json. Scratch
+ * allocations such as relation names go into tree_context as well.
+ */
+static void
+serializePathTree(Query *parse)
+{
+	static const char *const stages[] = {
+		"setop", "group_agg", "window", "distinct", "ordered", "final"
+	};
+	MemoryContext oldcontext = MemoryContextSwitchTo(tree_context);
+	ListCell   *cell;
+	bool		first_root = true;
+
+	tree_json = makeStringInfo();
+	appendStringInfo(tree_json, "{\"queryid\": %u, \"queries\": [",
+					 parse->queryId);
+
+	foreach (cell, tree_roots)
+	{
+		PlannerInfo *root = (PlannerInfo *) lfirst(cell);
+		ListCell   *cell2;
+		bool		first = true;
+		int			i;
+
+		if (!first_root)
+			appendStringInfoString(tree_json, ", ");
+		first_root = false;
+
+		appendStringInfo(tree_json, "{\"level\": %u, \"rels\": [",
+						 root->query_level);
+
+		for (i = 1; i < root->simple_rel_array_size; i++)
+		{
+			RelOptInfo *rel = root->simple_rel_array[i];
+
+			if (rel != NULL && rel->reloptkind != RELOPT_DEADREL)
+				outRelJson(tree_json, root, rel, NULL, &first);
+		}
+
+		foreach (cell2, root->join_rel_list)
+			outRelJson(tree_json, root, (RelOptInfo *) lfirst(cell2), NULL,
+					   &first);
+
+		for (i = 0; i <= UPPERREL_FINAL; i++)
+		{
+			foreach (cell2, root->upper_rels[i])
+				outRelJson(tree_json, root, (RelOptInfo *) lfirst(cell2),
+						   stages[i], &first);
+		}
+
+		appendStringInfoString(tree_json, "]}");
+	}
+
+	appendStringInfo(tree_json, "], \"truncated\": %s}",
+					 tree_truncated ? "true" : "false");
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Has the tree grown past diag_planner.max_path_tree_size? Then the rest
+ * of it is left out, and the tree marked as truncated.
+ */
+static bool
+treeFull(StringInfo str)
+{
+	if (str->len < diag_max_path_tree_size * 1024L)
+		return false;
+
+	tree_truncated = true;
+	return true;
+}
+
+/*
+ * Append a relation and its paths. Once the tree is full, relations are
+ * left out.
+ */
+static void
+outRelJson(StringInfo str, PlannerInfo *root, RelOptInfo *rel,
+		   const char *stage, bool *first)
+{
+	const char *kind;
+
+	if (treeFull(str))
+		return;
+
+	if (!*first)
+		appendStringInfoString(str, ", ");
+	*first = false;
+
+	switch (rel->reloptkind)
+	{
+		case RELOPT_BASEREL:
+			kind = "base";
 			break;
-		case T_NestLoop:
-			appendStringInfo(&str, "nestloop ");
+		case RELOPT_JOINREL:
+			kind = "join";
 			break;
-		case T_Append:
-			appendStringInfo(&str, "append ");
+		case RELOPT_UPPER_REL:
+			kind = "upper";
 			break;
 		default:
-			appendStringInfo(&str, "<>");
+			kind = "other";
+			break;
 	}
 
-	/* Cost */
-	appendStringInfo(&str, "%s%s\t(%.2f..%.2f)",
-					 OidIsValid(relid) ? "on " : "",
-					 OidIsValid(relid) ? get_rel_name(relid) : "",
-					 path->startup_cost, path->total_cost);
+	appendStringInfo(str, "{\"kind\": \"%s\", \"relids\": ", kind);
+	outRelidsJson(str, rel->relids);
 
-	return str.data;
-}
+	if ((rel->reloptkind == RELOPT_BASEREL ||
+		 rel->reloptkind == RELOPT_OTHER_MEMBER_REL) &&
+		rel->rtekind == RTE_RELATION)
+	{
+		RangeTblEntry *rte = planner_rt_fetch(rel->relid, root);
+		char	   *relname = get_rel_name(rte->relid);
 
-void
-_PG_init(void)
-{
+		if (relname != NULL)
+		{
+			appendStringInfoString(str, ", \"relation\": ");
+			escape_json(str, relname);
+		}
+	}
 
-	prev_set_rel_pathlist = set_rel_pathlist_hook;
-	set_rel_pathlist_hook = my_set_rel_pathlist;
+	if (stage != NULL)
+		appendStringInfo(str, ", \"stage\": \"%s\"", stage);
 
-	prev_set_join_pathlist = set_join_pathlist_hook;
-	set_join_pathlist_hook = my_set_join_pathlist;
+	appendStringInfo(str, ", \"rows\": %.0f, \"width\": %d, \"paths\": ",
+					 rel->rows,
+					 rel->reltarget != NULL ? rel->reltarget->width : 0);
+	outPathListJson(str, root, rel->pathlist);
+	appendStringInfoString(str, ", \"partial_paths\": ");
+	outPathListJson(str, root, rel->partial_pathlist);
+	appendStringInfoChar(str, '}');
 }
 
-void
-my_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel, Index rti, RangeTblEntry *rte)
+static void
+outPathListJson(StringInfo str, PlannerInfo *root, List *paths)
 {
-	ListCell		*cell;
-	elog(NOTICE, "----- SCAN PATH LIST for \"%s\" -----", get_rel_name(rte->relid));
+	ListCell   *cell;
 
-	/* Scan method */
-	foreach (cell, rel->pathlist)
+	appendStringInfoChar(str, '[');
+	foreach (cell, paths)
 	{
-		Path *path = lfirst(cell);
+		/* A single relation can have enough paths to fill the tree */
+		if (treeFull(str))
+			break;
 
-		elog(NOTICE, "SCAN : %s", _outPath(path, rte->relid));
+		if (cell != list_head(paths))
+			appendStringInfoString(str, ", ");
+		outPathJson(str, root, (Path *) lfirst(cell));
 	}
+	appendStringInfoChar(str, ']');
 }
 
-void
-my_set_join_pathlist(PlannerInfo *root, RelOptInfo *joinrel, RelOptInfo *outerrel,
-					 RelOptInfo *innerrel, JoinType jointype, JoinPathExtraData *extra)
+/*
+ * Append a path and, recursively, the paths it is built on. Once the tree
+ * is full, a path is shown as null.
+ */
+static void
+outPathJson(StringInfo str, PlannerInfo *root, Path *path)
 {
-	StringInfoData	str;
-	ListCell 		*cell;
-	int				idx = 0;
-	RangeTblEntry	*outer_rte, *inner_rte;
-	char			*jointype_str;
+	check_stack_depth();
 
-	/* Join relations */
-	idx = bms_next_member(outerrel->relids, 0);
-	outer_rte = planner_rt_fetch(idx, root);
+	if (treeFull(str))
+	{
+		appendStringInfoString(str, "null");
+		return;
+	}
 
-	idx = bms_next_member(innerrel->relids, 0);
-	inner_rte = planner_rt_fetch(idx, root);
+	appendStringInfo(str, "{\"node\": \"%s\", \"type\": \"%s\", \"relids\": ",
+					 pathNodeName(path), pathTypeName(path->pathtype));
+	outRelidsJson(str, path->parent != NULL ? path->parent->relids : NULL);
+	appendStringInfo(str,
+					 ", \"startup_cost\": %.2f, \"total_cost\": %.2f"
+					 ", \"rows\": %.0f, \"width\": %d",
+					 path->startup_cost, path->total_cost, path->rows,
+					 path->pathtarget != NULL ? path->pathtarget->width : 0);
+	appendStringInfo(str,
+					 ", \"parallel_aware\": %s, \"parallel_safe\": %s"
+					 ", \"parallel_workers\": %d",
+					 path->parallel_aware ? "true" : "false",
+					 path->parallel_safe ? "true" : "false",
+					 path->parallel_workers);
 
-	/* Join type */
-	switch (jointype)
+	if (path->param_info != NULL)
 	{
-		case JOIN_INNER:
-			jointype_str = "Inner";
+		appendStringInfoString(str, ", \"required_outer\": ");
+		outRelidsJson(str, path->param_info->ppi_req_outer);
+	}
+
+	appendStringInfoString(str, ", \"pathkeys\": ");
+	outPathKeysJson(str, root, path->pathkeys);
+
+	switch (nodeTag(path))
+	{
+		case T_IndexPath:
+			{
+				IndexPath  *ipath = (IndexPath *) path;
+				char	   *indexname = get_rel_name(ipath->indexinfo->indexoid);
+
+				if (indexname != NULL)
+				{
+					appendStringInfoString(str, ", \"index\": ");
+					escape_json(str, indexname);
+				}
+				appendStringInfo(str,
+								 ", \"backward\": %s, \"index_total_cost\": %.2f"
+								 ", \"index_selectivity\": %g",
+								 ScanDirectionIsBackward(ipath->indexscandir) ?
+								 "true" : "false",
+								 ipath->indextotalcost,
+								 ipath->indexselectivity);
+			}
 			break;
-		case JOIN_LEFT:
-			jointype_str = "Left";
+		case T_BitmapHeapPath:
+			appendStringInfoString(str, ", \"bitmapqual\": ");
+			outPathJson(str, root, ((BitmapHeapPath *) path)->bitmapqual);
 			break;
-		case JOIN_RIGHT:
-			jointype_str = "Rigth";
+		case T_BitmapAndPath:
+			appendStringInfo(str, ", \"selectivity\": %g, \"bitmapquals\": ",
+							 ((BitmapAndPath *) path)->bitmapselectivity);
+			outPathListJson(str, root, ((BitmapAndPath *) path)->bitmapquals);
 			break;
-		case JOIN_FULL:
-			jointype_str = "Full";
+		case T_BitmapOrPath:
+			appendStringInfo(str, ", \"selectivity\": %g, \"bitmapquals\": ",
+							 ((BitmapOrPath *) path)->bitmapselectivity);
+			outPathListJson(str, root, ((BitmapOrPath *) path)->bitmapquals);
 			break;
-		case JOIN_SEMI:
-			jointype_str = "Semi";
+		case T_SubqueryScanPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((SubqueryScanPath *) path)->subpath);
 			break;
-		case JOIN_ANTI:
-			jointype_str = "Anti";
+		case T_ForeignPath:
+			if (((ForeignPath *) path)->fdw_outerpath != NULL)
+			{
+				appendStringInfoString(str, ", \"fdw_outerpath\": ");
+				outPathJson(str, root, ((ForeignPath *) path)->fdw_outerpath);
+			}
 			break;
-		case JOIN_UNIQUE_OUTER:
-			jointype_str = "UniqueOuter";
+		case T_CustomPath:
+			appendStringInfoString(str, ", \"custom_name\": ");
+			escape_json(str, ((CustomPath *) path)->methods->CustomName);
+			appendStringInfoString(str, ", \"custom_paths\": ");
+			outPathListJson(str, root, ((CustomPath *) path)->custom_paths);
 			break;
-		case JOIN_UNIQUE_INNER:
-			jointype_str = "UniqueInner";
+		case T_NestPath:
+		case T_MergePath:
+		case T_HashPath:
+			{
+				JoinPath   *jpath = (JoinPath *) path;
+
+				appendStringInfo(str, ", \"jointype\": \"%s\"",
+								 joinTypeName(jpath->jointype));
+				if (IsA(path, MergePath))
+					appendStringInfo(str, ", \"materialize_inner\": %s",
+									 ((MergePath *) path)->materialize_inner ?
+									 "true" : "false");
+				if (IsA(path, HashPath))
+					appendStringInfo(str, ", \"num_batches\": %d",
+									 ((HashPath *) path)->num_batches);
+				appendStringInfoString(str, ", \"outer\": ");
+				outPathJson(str, root, jpath->outerjoinpath);
+				appendStringInfoString(str, ", \"inner\": ");
+				outPathJson(str, root, jpath->innerjoinpath);
+			}
+			break;
+		case T_AppendPath:
+			appendStringInfoString(str, ", \"subpaths\": ");
+			outPathListJson(str, root, ((AppendPath *) path)->subpaths);
+			break;
+		case T_MergeAppendPath:
+			appendStringInfo(str, ", \"limit_tuples\": %.0f, \"subpaths\": ",
+							 ((MergeAppendPath *) path)->limit_tuples);
+			outPathListJson(str, root, ((MergeAppendPath *) path)->subpaths);
+			break;
+		case T_MaterialPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((MaterialPath *) path)->subpath);
+			break;
+		case T_UniquePath:
+			{
+				UniquePath *upath = (UniquePath *) path;
+
+				appendStringInfo(str, ", \"method\": \"%s\", \"subpath\": ",
+								 upath->umethod == UNIQUE_PATH_NOOP ? "noop" :
+								 upath->umethod == UNIQUE_PATH_HASH ? "hash" :
+								 "sort");
+				outPathJson(str, root, upath->subpath);
+			}
+			break;
+		case T_GatherPath:
+			appendStringInfo(str,
+							 ", \"single_copy\": %s, \"num_workers\": %d"
+							 ", \"subpath\": ",
+							 ((GatherPath *) path)->single_copy ?
+							 "true" : "false",
+							 ((GatherPath *) path)->num_workers);
+			outPathJson(str, root, ((GatherPath *) path)->subpath);
+			break;
+		case T_GatherMergePath:
+			appendStringInfo(str, ", \"num_workers\": %d, \"subpath\": ",
+							 ((GatherMergePath *) path)->num_workers);
+			outPathJson(str, root, ((GatherMergePath *) path)->subpath);
+			break;
+		case T_ProjectionPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((ProjectionPath *) path)->subpath);
+			break;
+		case T_ProjectSetPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((ProjectSetPath *) path)->subpath);
+			break;
+		case T_SortPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((SortPath *) path)->subpath);
+			break;
+		case T_GroupPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((GroupPath *) path)->subpath);
+			break;
+		case T_UpperUniquePath:
+			appendStringInfo(str, ", \"numkeys\": %d, \"subpath\": ",
+							 ((UpperUniquePath *) path)->numkeys);
+			outPathJson(str, root, ((UpperUniquePath *) path)->subpath);
+			break;
+		case T_AggPath:
+			{
+				AggPath    *apath = (AggPath *) path;
+
+				appendStringInfo(str,
+								 ", \"strategy\": \"%s\", \"num_groups\": %.0f"
+								 ", \"subpath\": ",
+								 apath->aggstrategy == AGG_PLAIN ? "plain" :
+								 apath->aggstrategy == AGG_SORTED ? "sorted" :
+								 apath->aggstrategy == AGG_HASHED ? "hashed" :
+								 "mixed",
+								 apath->numGroups);
+				outPathJson(str, root, apath->subpath);
+			}
+			break;
+		case T_GroupingSetsPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((GroupingSetsPath *) path)->subpath);
+			break;
+		case T_WindowAggPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((WindowAggPath *) path)->subpath);
+			break;
+		case T_SetOpPath:
+			appendStringInfo(str, ", \"num_groups\": %.0f, \"subpath\": ",
+							 ((SetOpPath *) path)->numGroups);
+			outPathJson(str, root, ((SetOpPath *) path)->subpath);
+			break;
+		case T_RecursiveUnionPath:
+			appendStringInfoString(str, ", \"left\": ");
+			outPathJson(str, root, ((RecursiveUnionPath *) path)->leftpath);
+			appendStringInfoString(str, ", \"right\": ");
+			outPathJson(str, root, ((RecursiveUnionPath *) path)->rightpath);
+			break;
+		case T_LockRowsPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((LockRowsPath *) path)->subpath);
+			break;
+		case T_ModifyTablePath:
+			appendStringInfoString(str, ", \"subpaths\": ");
+			outPathListJson(str, root, ((ModifyTablePath *) path)->subpaths);
+			break;
+		case T_LimitPath:
+			appendStringInfoString(str, ", \"subpath\": ");
+			outPathJson(str, root, ((LimitPath *) path)->subpath);
+			break;
+		default:
+			/* scans with nothing more to show, and MinMaxAggPath */
 			break;
 	}
 
-	elog(NOTICE, "----- JOIN PATH LIST for \"%s\" and \"%s\" -----",
-		 get_rel_name(outer_rte->relid), get_rel_name(inner_rte->relid));
+	appendStringInfoChar(str, '}');
+}
 
-	foreach (cell, joinrel->pathlist)
+/*
+ * Append the pathkeys. A key is shown by the first member of its
+ * equivalence class when that is a column of this query level, otherwise
+ * by the type of the expression.
+ */
+static void
+outPathKeysJson(StringInfo str, PlannerInfo *root, List *pathkeys)
+{
+	ListCell   *cell;
+
+	appendStringInfoChar(str, '[');
+	foreach (cell, pathkeys)
 	{
-		Path *path = lfirst(cell);
-		JoinPath *joinpath = (JoinPath *) path;
+		PathKey    *pathkey = (PathKey *) lfirst(cell);
+		EquivalenceClass *eclass = pathkey->pk_eclass;
+		Expr	   *expr = NULL;
+
+		while (eclass->ec_merged != NULL)
+			eclass = eclass->ec_merged;
+		if (eclass->ec_members != NIL)
+			expr = ((EquivalenceMember *) linitial(eclass->ec_members))->em_expr;
 
-		initStringInfo(&str);
+		if (cell != list_head(pathkeys))
+			appendStringInfoString(str, ", ");
+		appendStringInfoString(str, "{\"expr\": ");
 
-		elog(NOTICE, "JOIN : %s %s", jointype_str, _outPath(path, InvalidOid));
+		if (expr != NULL && IsA(expr, Var) &&
+			((Var *) expr)->varlevelsup == 0 &&
+			((Var *) expr)->varno > 0 &&
+			((Var *) expr)->varno <= list_length(root->parse->rtable))
+		{
+			Var		   *var = (Var *) expr;
+			RangeTblEntry *rte = rt_fetch(var->varno, root->parse->rtable);
+			StringInfoData name;
 
-		/* Join relations */
-		elog(NOTICE, "\t |- %s", _outPath(joinpath->outerjoinpath, outer_rte->relid));
-		elog(NOTICE, "\t |- %s", _outPath(joinpath->innerjoinpath, inner_rte->relid));
+			initStringInfo(&name);
+			appendStringInfo(&name, "%s.%s", rte->eref->aliasname,
+							 get_rte_attribute_name(rte, var->varattno));
+			escape_json(str, name.data);
+		}
+		else if (expr != NULL)
+			appendStringInfo(str, "\"<expression of type %s>\"",
+							 format_type_be(exprType((Node *) expr)));
+		else
+			appendStringInfoString(str, "null");
+
+		appendStringInfo(str, ", \"desc\": %s, \"nulls_first\": %s}",
+						 pathkey->pk_strategy == BTGreaterStrategyNumber ?
+						 "true" : "false",
+						 pathkey->pk_nulls_first ? "true" : "false");
 	}
+	appendStringInfoChar(str, ']');
+}
+
+static void
+outRelidsJson(StringInfo str, Relids relids)
+{
+	int			x = -1;
+	bool		first = true;
+
+	appendStringInfoChar(str, '[');
+	while ((x = bms_next_member(relids, x)) >= 0)
+	{
+		appendStringInfo(str, first ? "%d" : ", %d", x);
+		first = false;
+	}
+	appendStringInfoChar(str, ']');
+}
+
+/*
+ * Return the path records in the ring buffer, oldest first. Records that
+ * are being written or get overwritten while we copy them are skipped.
+ *
+ * Only superusers see the records of other users and databases, as they
+ * tell about the tables and plans of those.
+ */
+Datum
+paths(PG_FUNCTION_ARGS)
+{
+#define PATHS_COLS 11
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	uint64		head;
+	uint64		pos;
+	Oid			userid = GetUserId();
+	bool		is_superuser = superuser();
+
+	if (DiagRing == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("diag_planner must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	head = pg_atomic_read_u64(&DiagRing->head);
+	pos = head > (uint64) DiagRing->size ? head - DiagRing->size : 0;
+
+	for (; pos < head; pos++)
+	{
+		DiagPathRecord *slot = &DiagRing->slots[pos % DiagRing->size];
+		DiagPathData rec;
+		Datum		relids[DIAG_MAX_RELIDS];
+		Datum		values[PATHS_COLS];
+		bool		nulls[PATHS_COLS];
+		int			n_relids = 0;
+		int			x;
+		int			j = 0;
+
+		if (pg_atomic_read_u64(&slot->seq) != pos + 1)
+			continue;
+		pg_read_barrier();
+		rec = slot->path;
+		pg_read_barrier();
+		if (pg_atomic_read_u64(&slot->seq) != pos + 1)
+			continue;
+
+		if (!is_superuser &&
+			(rec.userid != userid || rec.dbid != MyDatabaseId))
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		for (x = 0; x < DIAG_MAX_RELIDS; x++)
+		{
+			if (rec.relids & (UINT64CONST(1) << x))
+				relids[n_relids++] = Int32GetDatum(x);
+		}
+
+		values[j++] = Int64GetDatum((int64) pos);
+		values[j++] = Int32GetDatum(rec.pid);
+		values[j++] = Int64GetDatum((int64) rec.queryid);
+		values[j++] = PointerGetDatum(construct_array(relids, n_relids,
+													  INT4OID, sizeof(int32),
+													  true, 'i'));
+
+		if (OidIsValid(rec.relid))
+			values[j++] = ObjectIdGetDatum(rec.relid);
+		else
+			nulls[j++] = true;
+
+		if (rec.jointype >= 0)
+			values[j++] = CStringGetTextDatum(joinTypeName(rec.jointype));
+		else
+			nulls[j++] = true;
+
+		values[j++] = CStringGetTextDatum(pathTypeName(rec.pathtype));
+		values[j++] = Float8GetDatum(rec.startup_cost);
+		values[j++] = Float8GetDatum(rec.total_cost);
+		values[j++] = Float8GetDatum(rec.rows);
+		values[j++] = Int32GetDatum(rec.width);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the planning statistics per query. Times are in milliseconds and
+ * the phase times are means per call.
+ */
+Datum
+planning_stats(PG_FUNCTION_ARGS)
+{
+#define PLANNING_STATS_COLS 11
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	HASH_SEQ_STATUS hash_seq;
+	DiagPlanningEntry *entry;
+
+	if (DiagPlanningHash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("diag_planner must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(DiagPlanning->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, DiagPlanningHash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		DiagPlanningEntry tmp;
+		Datum		levels[DIAG_MAX_JOIN_LEVELS - 1];
+		Datum		values[PLANNING_STATS_COLS];
+		bool		nulls[PLANNING_STATS_COLS];
+		double		join_time = 0;
+		int			n_levels = 0;
+		int			i;
+		int			j = 0;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		if (tmp.calls == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		/* Trailing levels the query never reached are left out */
+		for (i = 0; i < DIAG_MAX_JOIN_LEVELS - 1; i++)
+		{
+			join_time += tmp.times.join_time[i];
+			if (tmp.times.join_time[i] > 0)
+				n_levels = i + 1;
+		}
+		for (i = 0; i < n_levels; i++)
+			levels[i] = Float8GetDatum(tmp.times.join_time[i] / tmp.calls);
+
+		values[j++] = ObjectIdGetDatum(tmp.key.dbid);
+		values[j++] = Int64GetDatum((int64) tmp.key.queryid);
+		values[j++] = Int64GetDatum(tmp.calls);
+		values[j++] = Float8GetDatum(tmp.total_time);
+		values[j++] = Float8GetDatum(tmp.total_time / tmp.calls);
+		values[j++] = Float8GetDatum(tmp.max_time);
+		values[j++] = Float8GetDatum(tmp.times.baserel_time / tmp.calls);
+		values[j++] = Float8GetDatum(join_time / tmp.calls);
+		values[j++] = PointerGetDatum(construct_array(levels, n_levels,
+													  FLOAT8OID, sizeof(float8),
+													  FLOAT8PASSBYVAL, 'd'));
+		values[j++] = Int64GetDatum(tmp.mem_used / tmp.calls);
+		values[j++] = Int64GetDatum(tmp.max_mem_used);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(DiagPlanning->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Discard all planning statistics.
+ */
+Datum
+planning_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	DiagPlanningEntry *entry;
+
+	if (DiagPlanningHash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("diag_planner must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(DiagPlanning->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, DiagPlanningHash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(DiagPlanningHash, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(DiagPlanning->lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Plan the given query and return its path tree as JSON. The query is not
+ * executed.
+ */
+Datum
+path_tree(PG_FUNCTION_ARGS)
+{
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	List	   *raw_list;
+	List	   *queries;
+	Query	   *parse;
+	PlannedStmt *stmt;
+	text	   *result;
+
+	if (DiagRing == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("diag_planner must be loaded via shared_preload_libraries")));
+
+	raw_list = pg_parse_query(query);
+	if (list_length(raw_list) != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("path_tree() requires exactly one query")));
+
+	queries = pg_analyze_and_rewrite(linitial_node(RawStmt, raw_list), query,
+									 NULL, 0, NULL);
+	if (list_length(queries) != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("path_tree() does not support queries rewritten into several queries")));
+
+	parse = linitial_node(Query, queries);
+	if (parse->commandType == CMD_UTILITY)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("utility statements have no path tree")));
+
+	/*
+	 * The tree shows row estimates and the values in quals, so require the
+	 * same privileges as running the query would. Relations in subqueries
+	 * only show up in the flattened range table, which is checked again
+	 * below once planning is done.
+	 */
+	ExecCheckRTPerms(parse->rtable, true);
+
+	force_path_tree = true;
+	PG_TRY();
+	{
+		stmt = pg_plan_query(parse, CURSOR_OPT_PARALLEL_OK, NULL);
+	}
+	PG_CATCH();
+	{
+		force_path_tree = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	force_path_tree = false;
+
+	Assert(tree_json != NULL);
+	result = cstring_to_text_with_len(tree_json->data, tree_json->len);
+
+	MemoryContextReset(tree_context);
+	tree_json = NULL;
+
+	ExecCheckRTPerms(stmt->rtable, true);
 
+	PG_RETURN_TEXT_P(result);
 }
@@ -0,0 +1,58 @@
+CREATE EXTENSION diag_planner;
+
+CREATE TABLE pt1 (a int PRIMARY KEY, b int);
+CREATE TABLE pt2 (a int, b int);
+CREATE TABLE pt3 (a int, b int);
+CREATE TABLE pt4 (a int, b int);
+
+-- The relations of a query, in the order they are planned
+SELECT q->>'level' AS level,
+       string_agg(concat_ws(' ', rel->>'kind', rel->>'relation',
+                            rel->>'relids', rel->>'stage'),
+                  ', ' ORDER BY n) AS rels,
+       bool_and(json_array_length(rel->'paths') > 0) AS have_paths
+FROM json_array_elements(diag_planner.path_tree(
+       'SELECT * FROM pt1 JOIN pt2 USING (a) ORDER BY a')->'queries') q,
+     json_array_elements(q->'rels') WITH ORDINALITY r(rel, n)
+GROUP BY 1;
+
+-- Paths nest the paths they are built on
+SELECT p->>'node' AS node, p->'subpath'->>'node' AS subnode,
+       p->'subpath'->>'type' AS subtype
+FROM json_array_elements(diag_planner.path_tree(
+       'SELECT * FROM pt2 ORDER BY b')->'queries'->0->'rels') r,
+     json_array_elements(r->'paths') p
+WHERE r->>'stage' = 'ordered';
+
+-- A tree over diag_planner.max_path_tree_size is cut short, but still valid
+SELECT t->>'truncated' AS truncated
+FROM diag_planner.path_tree('SELECT * FROM pt1, pt2, pt3, pt4') t;
+SET diag_planner.max_path_tree_size = '1kB';
+SELECT t->>'truncated' AS truncated, t::text::jsonb IS NOT NULL AS valid
+FROM diag_planner.path_tree('SELECT * FROM pt1, pt2, pt3, pt4') t;
+RESET diag_planner.max_path_tree_size;
+
+-- Queries that have no path tree
+SELECT diag_planner.path_tree('SELECT 1; SELECT 2');
+SELECT diag_planner.path_tree('VACUUM pt1');
+
+-- Privileges
+CREATE ROLE regress_diag_planner;
+GRANT USAGE ON SCHEMA diag_planner TO regress_diag_planner;
+GRANT SELECT ON pt2 TO regress_diag_planner;
+SET ROLE regress_diag_planner;
+SELECT diag_planner.path_tree('SELECT * FROM pt2');
+SELECT count(*) FROM diag_planner.paths();
+RESET ROLE;
+GRANT EXECUTE ON FUNCTION diag_planner.path_tree(text) TO regress_diag_planner;
+SET ROLE regress_diag_planner;
+SELECT diag_planner.path_tree('SELECT * FROM pt2') IS NOT NULL AS ok;
+SELECT diag_planner.path_tree('SELECT * FROM pt1');
+-- Relations in subqueries are checked once they are pulled up
+SELECT diag_planner.path_tree('SELECT * FROM pt2 WHERE a IN (SELECT a FROM pt1)');
+RESET ROLE;
+
+DROP OWNED BY regress_diag_planner;
+DROP ROLE regress_diag_planner;
+DROP TABLE pt1, pt2, pt3, pt4;
+DROP EXTENSION diag_planner;
@@ -19,9 +19,167 @@ CREATE FUNCTION pgha.join_node(
 IN name text,
 IN conninfo text,
 OUT name text,
-OUT conninfo text
+OUT conninfo text,
+OUT type "char",
+OUT epoch bigint
 )
 RETURNS SETOF record
 AS 'MODULE_PATHNAME', 'join_node'
 LANGUAGE C STRICT;
 
+CREATE FUNCTION pgha.membership_since(
+IN since bigint,
+OUT epoch bigint,
+OUT op "char",
+OUT name text,
+OUT conninfo text,
+OUT type "char"
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'membership_since'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.membership_epoch()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'membership_epoch'
+LANGUAGE C STRICT;
+
+
+CREATE FUNCTION pgha.node_stats(
+OUT name text,
+OUT consecutive_failures int,
+OUT probes bigint,
+OUT failures bigint,
+OUT last_success timestamptz,
+OUT last_connect_time float8,
+OUT connect_time_p50 float8,
+OUT connect_time_p95 float8,
+OUT connect_time_p99 float8,
+OUT last_rtt float8,
+OUT rtt_p50 float8,
+OUT rtt_p95 float8,
+OUT rtt_p99 float8,
+OUT walsender_checks bigint,
+OUT streaming bool,
+OUT sent_lsn pg_lsn,
+OUT write_lsn pg_lsn,
+OUT flush_lsn pg_lsn,
+OUT replay_lsn pg_lsn,
+OUT sync_priority int,
+OUT write_lag float8,
+OUT flush_lag float8,
+OUT replay_lag float8,
+OUT phi float8,
+OUT sync boolean
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'node_stats'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.failover_status(
+OUT failed_node text,
+OUT last_contact timestamptz,
+OUT detected timestamptz,
+OUT decided timestamptz,
+OUT promote_requested timestamptz,
+OUT promoted timestamptz,
+OUT first_write timestamptz,
+OUT after_command_done timestamptz,
+OUT after_command_status int,
+OUT detect_time float8,
+OUT decide_time float8,
+OUT promote_time float8,
+OUT first_write_time float8,
+OUT total_time float8,
+OUT elected_node text
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'failover_status'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.routing_table(
+OUT name text,
+OUT conninfo text,
+OUT type "char",
+OUT healthy bool,
+OUT replay_lag_bytes bigint,
+OUT replay_lag float8,
+OUT weight int,
+OUT generation bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'routing_table'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.wal_position(
+OUT receive_lsn pg_lsn,
+OUT replay_lsn pg_lsn,
+OUT timeline int,
+OUT replay_rate float8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'wal_position'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.degrade_status(
+OUT failed_node text,
+OUT last_contact timestamptz,
+OUT detected timestamptz,
+OUT released timestamptz,
+OUT persisted timestamptz,
+OUT released_commits int,
+OUT degradations bigint,
+OUT detect_time float8,
+OUT release_time float8,
+OUT persist_time float8,
+OUT stall_time float8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'degrade_status'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.worker_stats(
+OUT worker text,
+OUT pid int,
+OUT started timestamptz,
+OUT rounds bigint,
+OUT probes bigint,
+OUT probe_failures bigint,
+OUT walsender_checks bigint,
+OUT connects bigint,
+OUT last_round_time float8,
+OUT mean_round_time float8,
+OUT max_round_time float8,
+OUT user_cpu_time float8,
+OUT system_cpu_time float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'worker_stats'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.worker_phases(
+OUT worker text,
+OUT pid int,
+OUT phase text,
+OUT current boolean,
+OUT count bigint,
+OUT total_time float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'worker_phases'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgha.action_status(
+OUT action text,
+OUT running boolean,
+OUT pid int,
+OUT started timestamptz,
+OUT finished timestamptz,
+OUT duration float8,
+OUT exit_status int,
+OUT timed_out boolean,
+OUT runs bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'action_status'
+LANGUAGE C STRICT;
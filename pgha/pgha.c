@@ -9,17 +9,31 @@
 
 #include "postgres.h"
 
+#include <math.h>
+#include <sys/wait.h>
+
 #include "pgha.h"
 
 /* These are always necessary for a bgworker */
+#include "access/hash.h"
 #include "access/htup_details.h"
+#include "access/xact.h"
 #include "access/xlog.h"
 #include "catalog/pg_type.h"
 #include "funcapi.h"
+#include "lib/binaryheap.h"
+#include "libpq/auth.h"
+#include "libpq/pqsignal.h"
+#include "lib/stringinfo.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "postmaster/fork_process.h"
 #include "postmaster/bgworker.h"
 #include "replication/syncrep.h"
+#include "replication/walreceiver.h"
+#include "replication/walsender.h"
+#include "replication/walsender_private.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lwlock.h"
@@ -27,42 +41,268 @@
 #include "storage/shmem.h"
 #include "storage/spin.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
 #include "utils/ps_status.h"
+#include "utils/timestamp.h"
 
 /* these headers are used by this particular worker's code */
 #include "tcop/utility.h"
 #include "libpq-int.h"
 
-#define am_master() (!InRecovery)
+#define am_master() (!RecoveryInProgress())
 
 PG_MODULE_MAGIC;
 
+/*
+ * State of one in-flight heartbeat probe. All probes of a heartbeat round
+ * are driven concurrently through libpq's non-blocking API.
+ */
+typedef enum PgHaProbeState
+{
+	PGHA_PROBE_CONNECTING,
+	PGHA_PROBE_SENDING,
+	PGHA_PROBE_READING,
+	PGHA_PROBE_DONE
+} PgHaProbeState;
+
+/*
+ * The worker keeps one long-lived connection per node, so a heartbeat
+ * normally costs only a query round trip on an established session.
+ */
+typedef struct PgHaConn
+{
+	char		name[NAMEDATALEN];	/* hash key; must be first */
+	char		conninfo[MAXPGPATH];
+	PGconn		*conn;
+	int			n_failures;			/* consecutive failed reconnects */
+	TimestampTz	next_connect;		/* don't reconnect before this */
+	bool		seen;				/* still registered in this round */
+	bool		no_wal_position;	/* pgha.wal_position() failed on conn */
+
+	/* Adaptive schedule, see scheduleNextProbe() */
+	int			interval;			/* current probe interval in ms */
+	TimestampTz	next_due;			/* next heartbeat is due at */
+	int			snap_index;			/* index in snapshots of schedule_epoch */
+} PgHaConn;
+
+/* Status of a walsender, matched to a node by application_name */
+typedef struct PgHaWalSndInfo
+{
+	int			pid;
+	char		appname[NAMEDATALEN];
+	WalSndState state;
+	XLogRecPtr	sent;
+	XLogRecPtr	write;
+	XLogRecPtr	flush;
+	XLogRecPtr	apply;
+	TimeOffset	write_lag;
+	TimeOffset	flush_lag;
+	TimeOffset	apply_lag;
+	int			sync_priority;
+} PgHaWalSndInfo;
+
+/* A healthy standby eligible for synchronous replication */
+typedef struct PgHaSyncCandidate
+{
+	PgHaNode	*node;			/* in the snapshot */
+	double		latency;		/* estimated ack latency in ms */
+} PgHaSyncCandidate;
+
+/*
+ * Number of rounds in a row a standby must be faster than a synchronous
+ * one to replace it.
+ */
+#define PGHA_QUORUM_STABLE_ROUNDS	3
+
+typedef struct PgHaProbe
+{
+	PgHaNode	*node;
+	PgHaConn	*pconn;
+	PgHaProbeState state;
+	PostgresPollingStatusType poll;	/* last result of PQconnectPoll */
+	TimestampTz	deadline;
+	TimestampTz	connect_start;
+	TimestampTz	query_start;
+	int64		connect_us;		/* -1 if we didn't connect */
+	int64		rtt_us;			/* -1 if no response */
+	bool		reconnecting;	/* establishing a new connection */
+	bool		skipped;		/* backing off, no probe sent */
+	bool		ok;
+	PgHaWalPosition wal;		/* reported by the node, if updated != 0 */
+} PgHaProbe;
+
+/*
+ * Heartbeat queries. Only the first statement decides liveness, so that a
+ * node where pgha is not created in the target database is not regarded
+ * as failed; it just doesn't report its WAL position.
+ */
+#define PGHA_PROBE_QUERY		"SELECT 1"
+#define PGHA_PROBE_WAL_QUERY	"SELECT 1; SELECT * FROM pgha.wal_position()"
+#define probeQuery(pconn) \
+	((pconn)->no_wal_position ? PGHA_PROBE_QUERY : PGHA_PROBE_WAL_QUERY)
+
+/*
+ * The trigger file pg_ctl promote creates. xlog.c doesn't export its name
+ * in PG10.
+ */
+#define PGHA_PROMOTE_SIGNAL_FILE	"promote"
+
+/*
+ * Replay rates closer than this fraction are regarded equal in the
+ * election, so that standbys comparing slightly different samples still
+ * agree.
+ */
+#define PGHA_REPLAY_RATE_TOLERANCE	0.1
+
+/*
+ * Number of pgha.min_keepalives_time rounds, beyond pgha.heartbeat_timeout,
+ * that an election waits for the surviving standbys to report their WAL
+ * positions.
+ */
+#define PGHA_ELECTION_WAIT_ROUNDS	3
+
+/* Weight of a new sample in the moving average of the replay rate */
+#define PGHA_REPLAY_RATE_WEIGHT		0.2
+
 void	_PG_init(void);
 void	_PG_fini(void);
 void	PgHaMain(Datum);
+void	PgHaHeartbeatMain(Datum);
 
 PG_FUNCTION_INFO_V1(add_node);
 PG_FUNCTION_INFO_V1(del_node);
 PG_FUNCTION_INFO_V1(join_node);
+PG_FUNCTION_INFO_V1(node_stats);
+PG_FUNCTION_INFO_V1(failover_status);
+PG_FUNCTION_INFO_V1(wal_position);
+PG_FUNCTION_INFO_V1(routing_table);
+PG_FUNCTION_INFO_V1(degrade_status);
+PG_FUNCTION_INFO_V1(worker_stats);
+PG_FUNCTION_INFO_V1(worker_phases);
+PG_FUNCTION_INFO_V1(action_status);
+PG_FUNCTION_INFO_V1(membership_since);
+PG_FUNCTION_INFO_V1(membership_epoch);
 
 static void checkParameter(void);
-static void doHeartbeat(void);
-static bool checkClusterStatus(void);
-static bool addNode(const char *name, const char *conninfo, bool myself,
-					bool dup_ok);
-static bool delNode(const char *name);
-static bool execSQL(const char *conninfo, const char *sql);
+static void doHeartbeat(int shard, int n_shards);
+static bool isMonitoredNode(PgHaNode *node, int shard, int n_shards);
+static void rebuildSchedule(PgHaNode *nodes, int n_nodes, uint64 epoch,
+							int shard, int n_shards);
+static int	compareNextDue(Datum a, Datum b, void *arg);
+static int	nextProbeInterval(PgHaConn *pconn, PgHaProbe *probe);
+static bool isSlowProbe(PgHaProbe *probe);
+static void scheduleNextProbe(PgHaConn *pconn, PgHaProbe *probe,
+							  TimestampTz now);
+static long heartbeatTimeout(void);
+static int	nodeShard(const char *name, int n_shards);
+static bool checkClusterStatus(PgHaNode *failed);
+static bool addNode(const char *name, const char *conninfo, char type,
+					bool myself, bool dup_ok);
+static bool updateNode(const char *name, const char *conninfo, char type);
+static bool delNode(const char *name, bool missing_ok);
+static void logMembershipChange(char op, PgHaNode *node);
+static void saveRegistryAndUnlock(void);
+static bool registryLoaded(void);
+static void writeFileAtomic(const char *path, char *buf, Size len,
+							bool durable);
+static void loadRegistry(void);
+static PgHaNode *snapshotNodes(int *n_nodes, uint64 *epoch);
+static PgHaNode *copyLiveNodes(int *n_nodes);
+static bool snapshotMembershipSince(uint64 since, uint64 *epoch,
+									PgHaNode **nodes, int *n_nodes,
+									PgHaMembershipChange *changes,
+									int *n_changes);
+static PgHaNode *acquireNode(PgHaNode *copy);
+static void releaseNode(PgHaNode *node);
+static void updateNodeHealth(PgHaProbe *probe);
+static bool parseLSN(const char *str, XLogRecPtr *lsn);
+static void parseWalPosition(PgHaProbe *probe, PGresult *res);
+static void getMyWalPosition(PgHaWalPosition *pos);
+static TimestampTz electionStart(void);
+static int	collectWalSenders(PgHaWalSndInfo *walsnds);
+static bool updateNodeFromWalSender(PgHaNode *copy, PgHaWalSndInfo *info,
+									int interval,
+									bool check_alive);
+static void recordArrival(PgHaNode *node, TimestampTz now, bool sample,
+						  int interval);
+static double computePhi(PgHaArrivalWindow *arrivals, TimestampTz now);
+static TimestampTz arrivalDistribution(PgHaArrivalWindow *arrivals,
+									   double *mean, double *stddev);
+static double phiOfDeviation(double y);
+static TimestampTz suspicionTime(PgHaArrivalWindow *arrivals);
+static double getNodePhi(PgHaNode *copy, TimestampTz now);
+static void histAdd(PgHaLatencyHist *hist, int64 usecs);
+static double histPercentile(PgHaLatencyHist *hist, double fraction);
+
+/* node slots in the dynamic shared area */
+static dsa_area *getArea(void);
+static PgHaNode *getSlot(int slotno);
+static int	*getLiveSlots(void);
+static void growRegistry(void);
+static void shrinkRegistry(void);
+static void rebuildFreeList(void);
+static uint32 indexHash(const char *name);
+static int	indexLookup(const char *name, int *bucket);
+static void indexInsert(const char *name, int slotno);
+static void indexDelete(int bucket);
+
+/* heartbeat probes */
+static PgHaConn *getPooledConn(PgHaNode *node);
+static void closePooledConn(PgHaConn *pconn);
+static void cleanupConnPool(void);
+static void startProbe(PgHaProbe *probe, PgHaNode *node, PgHaConn *pconn);
+static void connectProbe(PgHaProbe *probe);
+static void advanceProbe(PgHaProbe *probe);
+static void failProbe(PgHaProbe *probe);
+static void finishProbe(PgHaProbe *probe, bool ok);
+static uint32 probeWaitEvents(PgHaProbe *probe);
+static PgHaPhase probePhase(PgHaProbe *probe);
+static void waitForProbes(PgHaProbe *probes, int n_probes);
 
 /* master */
 static bool	PgHaMasterLoop(void);
-static void changeToAsync(void);
+static void changeToAsync(PgHaNode *failed);
+static int	releaseSyncRepWaiters(void);
+static bool persistSyncStandbyNames(const char *value);
+static void finishDegrade(void);
+static void manageSyncQuorum(void);
+static double getSyncLatency(PgHaNode *copy, TimestampTz now);
+static int	compareSyncCandidates(const void *a, const void *b);
+static int	compareNodeNames(const void *a, const void *b);
+static char *buildSyncStandbyNames(PgHaNode **sync, int n_sync);
+static void setNodeSync(const char *name, bool is_sync);
+static void publishRoutingTable(void);
+static PgHaRoute *buildRoutes(PgHaNode *nodes, int n_nodes);
+static void writeRoutingFile(PgHaRoute *routes, int n_routes,
+							 uint64 generation);
 
 /* slave */
 static bool	PgHaStandbyLoop(void);
+static bool joinCluster(void);
+static PGconn *connectMaster(void);
+static PGresult *execMaster(PGconn *conn, const char *query, int n_params,
+							 const char *const *params);
+static bool syncMembership(void);
+static PgHaNode *getMasterNode(PgHaNode *nodes, int n_nodes);
+static bool decideFailover(PgHaNode *master);
+static void measureReplayRate(void);
+static PgHaNode *electStandby(PgHaNode *nodes, int n_nodes, TimestampTz since);
+static int	compareWalPositions(PgHaNode *a, PgHaNode *b);
+static bool promoteMyself(PgHaNode *master);
+static void recordFailoverPhase(TimestampTz *phase);
+static void startAction(PgHaActionKind kind, const char *command);
+static void superviseActions(void);
+static void finishAction(PgHaActionKind kind, int status, TimestampTz now);
+static long actionTimeout(long timeout);
 
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ClientAuthentication_hook_type prev_client_auth_hook = NULL;
 static void pgha_shmem_startup(void);
 static Size pgha_shmemsize(void);
+static Size pgha_ctlsize(void);
 static bool check_pgha_node_name(char **newval, void **extra, GucSource source);
 static bool check_pgha_conninfo(char **newval, void **extra, GucSource source);
 static int	get_hanode_count(void);
@@ -70,6 +310,19 @@ static int	get_hanode_count(void);
 /* Function for signal handler */
 static void pgha_sigterm(SIGNAL_ARGS);
 static void pgha_sighup(SIGNAL_ARGS);
+static void pgha_sigchld(SIGNAL_ARGS);
+
+static void initWorkerStats(int workerno);
+static void clearWorkerStats(int code, Datum arg);
+static void reportWorkerStats(TimestampTz start, int n_probes,
+							  int n_failures, int n_walsender_checks);
+static void wakeWorkers(void);
+static void wakeMainWorker(void);
+static TimestampTz nextSuspicion(void);
+static void setPhase(PgHaPhase phase);
+static text *workerName(int workerno);
+static void pgha_client_auth(Port *port, int status);
+static void pgha_walsender_exit(int code, Datum arg);
 
 /* debug fucns */
 static void debug_show(void);
@@ -79,17 +332,96 @@ sig_atomic_t got_sighup = false;
 sig_atomic_t got_sigterm = false;
 
 /* GUC variables */
-int	pgha_keepalives_time;
+int	pgha_keepalives_time;		/* in seconds, unlike the other intervals */
+int	pgha_min_keepalives_time;
+int	pgha_max_keepalives_time;
 int	pgha_retry_count;
+int	pgha_heartbeat_timeout;
+int	pgha_max_reconnect_interval;
+double	pgha_phi_threshold;
+int	pgha_phi_min_std_deviation;
 int pgha_max_nodes;
+int	pgha_heartbeat_workers;
+int	pgha_sync_quorum;
+double	pgha_sync_quorum_hysteresis;
 char *pgha_node_name;
 char *pgha_my_conninfo;
 char *pgha_after_command;
+char *pgha_after_degrade_command;
+int	pgha_action_timeout;
+int	pgha_routing_max_lag;
+char *pgha_master_conninfo;
+
+/* pgha.keepalives_time in milliseconds */
+#define PGHA_KEEPALIVES_MS	(pgha_keepalives_time * 1000)
 
 bool	in_syncrep = false;
 
+/* Degraded, but synchronous_standby_names = '' isn't persisted yet */
+static bool degrade_pending = false;
+
 PgHaCtlData *PgHaCtl = NULL;
-PgHaNode *MyHa = NULL;
+
+/* The area holding the node slots, attached on first use */
+static dsa_area *PgHaArea = NULL;
+
+/* Stats of this worker, and connection attempts in the current round */
+static PgHaWorkerStats *MyWorkerStats = NULL;
+static int	round_connects = 0;
+
+/* Action processes run by the main worker, 0 if not running */
+static pid_t action_pids[PGHA_NUM_ACTIONS];
+static TimestampTz action_deadlines[PGHA_NUM_ACTIONS];
+static bool action_killed[PGHA_NUM_ACTIONS];
+
+/* Names of PgHaActionKind */
+static const char *const PgHaActionNames[PGHA_NUM_ACTIONS] = {
+	"after promote",
+	"after degrade"
+};
+
+/* Names of PgHaPhase, as shown in pg_stat_activity */
+static const char *const PgHaPhaseNames[PGHA_NUM_PHASES] = {
+	"idle",
+	"reloading config",
+	"collecting",
+	"connecting",
+	"tls handshake",
+	"sending",
+	"waiting for result",
+	"recording",
+	"checking cluster",
+	"syncing membership",
+	"reconfiguring replication",
+	"promoting",
+	"publishing routes"
+};
+
+/* True while loading the registry file, not to write it back */
+static bool registry_loading = false;
+
+/* Connections to other nodes, used only by the worker */
+static HTAB *PgHaConnPool = NULL;
+
+/*
+ * Nodes this worker sends heartbeats to, ordered by the next due time, and
+ * the membership epoch and role it was built for.
+ */
+static binaryheap *PgHaSchedule = NULL;
+static uint64 schedule_epoch = 0;
+static bool schedule_as_master = false;
+
+/*
+ * Start of the election the schedule was adjusted for, and whether one is
+ * in progress in the current round.
+ */
+static TimestampTz schedule_election = 0;
+static bool round_electing = false;
+static TimestampTz next_heartbeat = 0;
+
+/* Connection to the master and the membership epoch a standby synced to */
+static PGconn *MasterConn = NULL;
+static uint64 membership_epoch = 0;
 
 
 /*
@@ -102,18 +434,32 @@ void
 _PG_init(void)
 {
 	BackgroundWorker worker;
+	int	i;
 
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
 	/* get the configuration */
 	DefineCustomIntVariable("pgha.max_ha_nodes",
-							"The maximim number of nodes",
+							"The maximim number of nodes, 0 for no limit",
 							NULL,
 							&pgha_max_nodes,
-							10,
 							0,
-							INT_MAX,
+							0,
+							PGHA_CHUNK_NODES * PGHA_MAX_CHUNKS,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgha.heartbeat_workers",
+							"Number of workers sending heartbeats, 0 for the main worker to do it",
+							NULL,
+							&pgha_heartbeat_workers,
+							0,
+							0,
+							64,
 							PGC_POSTMASTER,
 							0,
 							NULL,
@@ -126,9 +472,35 @@ _PG_init(void)
 							&pgha_keepalives_time,
 							5,
 							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgha.min_keepalives_time",
+							"Heartbeat interval for a node that has missed a heartbeat",
+							NULL,
+							&pgha_min_keepalives_time,
+							1000,
+							10,
 							INT_MAX,
 							PGC_SIGHUP,
-							0,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgha.max_keepalives_time",
+							"Heartbeat interval a stable node backs off to",
+							NULL,
+							&pgha_max_keepalives_time,
+							10000,
+							10,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
 							NULL,
 							NULL,
 							NULL);
@@ -146,6 +518,84 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomRealVariable("pgha.phi_threshold",
+							 "Suspicion level at which a node is regarded as failed",
+							 NULL,
+							 &pgha_phi_threshold,
+							 8.0,
+							 0.1,
+							 100.0,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pgha.phi_min_std_deviation",
+							"Minimum standard deviation of heartbeat intervals assumed by the failure detector",
+							NULL,
+							&pgha_phi_min_std_deviation,
+							100,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgha.heartbeat_timeout",
+							"Maximum time to wait for a heartbeat response from each node",
+							NULL,
+							&pgha_heartbeat_timeout,
+							3000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgha.max_reconnect_interval",
+							"Maximum time between reconnection attempts to a failed node",
+							NULL,
+							&pgha_max_reconnect_interval,
+							60,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgha.sync_quorum",
+							"Number of fastest standbys to keep as synchronous standbys",
+							"Zero leaves synchronous_standby_names to the administrator.",
+							&pgha_sync_quorum,
+							0,
+							0,
+							64,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pgha.sync_quorum_hysteresis",
+							 "Fraction by which a standby must be faster to replace a synchronous standby",
+							 NULL,
+							 &pgha_sync_quorum_hysteresis,
+							 0.2,
+							 0.0,
+							 1.0,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomStringVariable("pgha.my_conninfo",
 							   "My connection information used for ALTER SYSTEM",
 							   NULL,
@@ -168,6 +618,17 @@ _PG_init(void)
 							   NULL,
 							   NULL);
 
+	DefineCustomStringVariable("pgha.master_conninfo",
+							   "Connection information used by a standby to join the master",
+							   NULL,
+							   &pgha_master_conninfo,
+							   NULL,
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
 	DefineCustomStringVariable("pgha.after_command",
 							   "Shell command that will be called after promoted",
 							   NULL,
@@ -179,15 +640,55 @@ _PG_init(void)
 							   NULL,
 							   NULL);
 
+	DefineCustomStringVariable("pgha.after_degrade_command",
+							   "Shell command that will be called after degraded to asynchronous replication",
+							   NULL,
+							   &pgha_after_degrade_command,
+							   NULL,
+							   PGC_SIGHUP,
+							   GUC_NOT_IN_SAMPLE,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pgha.action_timeout",
+							"Time after which an after command is killed",
+							"Zero lets it run indefinitely.",
+							&pgha_action_timeout,
+							60,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgha.routing_max_lag",
+							"Replay lag beyond which no reads are routed to a standby",
+							NULL,
+							&pgha_routing_max_lag,
+							16384,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
 	/* Install hook */
     prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = pgha_shmem_startup;
+	prev_client_auth_hook = ClientAuthentication_hook;
+	ClientAuthentication_hook = pgha_client_auth;
 
 	/* request additional sharedresource */
 	RequestAddinShmemSpace(pgha_shmemsize());
-	RequestNamedLWLockTranche("pgha", 1);
+	RequestNamedLWLockTranche("pgha", 2);
 
 	/* set up common data for all our workers */
+	memset(&worker, 0, sizeof(worker));
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
 		BGWORKER_BACKEND_DATABASE_CONNECTION;
 	worker.bgw_start_time = BgWorkerStart_ConsistentState;
@@ -199,12 +700,28 @@ _PG_init(void)
 	/* Now fill in worker-specific data, and do the actual registrations */
 	worker.bgw_main_arg = Int32GetDatum(1);
 	RegisterBackgroundWorker(&worker);
+
+	/*
+	 * Heartbeat workers, each of which is in charge of a hash partition of
+	 * the nodes. They are restarted since a node left unmonitored would soon
+	 * be regarded as failed.
+	 */
+	for (i = 0; i < pgha_heartbeat_workers; i++)
+	{
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_restart_time = 1;
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "PgHaHeartbeatMain");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pgha heartbeat %d", i);
+		worker.bgw_main_arg = Int32GetDatum(i);
+		RegisterBackgroundWorker(&worker);
+	}
 }
 
 void _PG_fini(void)
 {
 	/* Uninstall hook */
     shmem_startup_hook = prev_shmem_startup_hook;
+	ClientAuthentication_hook = prev_client_auth_hook;
 }
 
 static void
@@ -217,23 +734,65 @@ pgha_shmem_startup(void)
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 	PgHaCtl = ShmemInitStruct("pgha",
-							  pgha_shmemsize(),
+							  pgha_ctlsize(),
 							  &found);
 	if (!found)
 	{
+		dsa_area *area;
 		int i;
 
-		PgHaCtl->lock = &(GetNamedLWLockTranche("pgha"))->lock;
+		PgHaCtl->lock = &(GetNamedLWLockTranche("pgha"))[0].lock;
+		PgHaCtl->file_lock = &(GetNamedLWLockTranche("pgha"))[1].lock;
+		PgHaCtl->next_node_id = 1;
+		PgHaCtl->registry_loaded = false;
 		PgHaCtl->n_nodes = 0;
-		
-		/* Initialize spin lock of each nodes */
-		for (i = 0; i < pgha_max_nodes; i++)
-		{
-			PgHaNode *n = &PgHaCtl->nodes[i];
+		PgHaCtl->changes = (PgHaMembershipChange *)
+			((char *) PgHaCtl + MAXALIGN(sizeof(PgHaCtlData)));
+		PgHaCtl->workers = (PgHaWorkerStats *)
+			((char *) PgHaCtl->changes +
+			 MAXALIGN(mul_size(sizeof(PgHaMembershipChange),
+							   PGHA_MEMBERSHIP_LOG_SIZE)));
+		memset(PgHaCtl->workers, 0,
+			   sizeof(PgHaWorkerStats) * (pgha_heartbeat_workers + 1));
+		PgHaCtl->area = (char *) PgHaCtl->workers +
+			MAXALIGN(mul_size(sizeof(PgHaWorkerStats),
+							  pgha_heartbeat_workers + 1));
 
-			n->in_use = false;
-			SpinLockInit(&n->mutex);
-		}
+		/*
+		 * Start the epoch from the current time so that epochs keep growing
+		 * across restarts, and a standby that synced to an older incarnation
+		 * is told to resync.
+		 */
+		PgHaCtl->epoch = PgHaCtl->first_epoch = (uint64) GetCurrentTimestamp();
+		
+		/*
+		 * No node slots until the first node registers. Only the control
+		 * part of the area lives here; the chunks are allocated in dynamic
+		 * shared memory segments by whichever process adds a node, and the
+		 * others map them on demand.
+		 */
+		PgHaCtl->free_head = -1;
+		PgHaCtl->n_chunks = 0;
+		PgHaCtl->live_capacity = 0;
+		PgHaCtl->index_size = 0;
+		PgHaCtl->live_slots = InvalidDsaPointer;
+		PgHaCtl->index = InvalidDsaPointer;
+		PgHaCtl->routes = InvalidDsaPointer;
+		PgHaCtl->n_routes = 0;
+		PgHaCtl->routes_generation = 0;
+		PgHaCtl->area_tranche = LWLockNewTrancheId();
+		area = dsa_create_in_place(PgHaCtl->area, dsa_minimum_size(),
+								   PgHaCtl->area_tranche, NULL);
+		dsa_detach(area);
+
+		SpinLockInit(&PgHaCtl->mutex);
+		memset(&PgHaCtl->failover, 0, sizeof(PgHaFailoverStatus));
+		PgHaCtl->failover.after_command_status = -1;
+		memset(&PgHaCtl->replay, 0, sizeof(PgHaReplayRate));
+		memset(&PgHaCtl->degrade, 0, sizeof(PgHaDegradeStatus));
+		memset(PgHaCtl->actions, 0, sizeof(PgHaCtl->actions));
+		for (i = 0; i < PGHA_NUM_ACTIONS; i++)
+			PgHaCtl->actions[i].exit_status = -1;
 	}
 
 	LWLockRelease(AddinShmemInitLock);
@@ -269,6 +828,21 @@ pgha_sighup(SIGNAL_ARGS)
 		SetLatch(&MyProc->procLatch);
 }
 
+/*
+ * Signal handler for SIGCHLD
+ *		Wake up the main loop to reap an action process.
+ */
+static void
+pgha_sigchld(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
 /*
  * Entry point for pgha.
  */
@@ -283,6 +857,7 @@ PgHaMain(Datum main_arg)
 	/* Establish signal handlers before unblocking signals */
 	pqsignal(SIGHUP, pgha_sighup);
 	pqsignal(SIGTERM, pgha_sigterm);
+	pqsignal(SIGCHLD, pgha_sigchld);
 
 	/* We're now ready to receive signals */
 	BackgroundWorkerUnblockSignals();
@@ -290,9 +865,32 @@ PgHaMain(Datum main_arg)
 	/* Connect to our database */
 	BackgroundWorkerInitializeConnection("postgres", NULL);
 
-	/* Register my info first */
-	addNode(pgha_node_name, pgha_my_conninfo, true, false);
-	MyHa = &PgHaCtl->nodes[0];
+	/*
+	 * Restore the nodes saved by the previous incarnation. The postmaster
+	 * cannot allocate the node slots, so this is done by the first run of
+	 * the main worker rather than at shared memory initialization. The
+	 * heartbeat workers don't start sending heartbeats until it is done.
+	 */
+	if (!registryLoaded())
+	{
+		loadRegistry();
+
+		LWLockAcquire(PgHaCtl->lock, LW_EXCLUSIVE);
+		PgHaCtl->registry_loaded = true;
+		LWLockRelease(PgHaCtl->lock);
+
+		wakeWorkers();
+	}
+
+	/*
+	 * Register my info first. I might be already registered from the
+	 * registry file, possibly with an old role.
+	 */
+	if (!updateNode(pgha_node_name, pgha_my_conninfo, am_master() ? 'm' : 's'))
+		addNode(pgha_node_name, pgha_my_conninfo, am_master() ? 'm' : 's',
+				true, false);
+
+	initWorkerStats(pgha_heartbeat_workers);
 
 	if (am_master())
 	{
@@ -306,6 +904,58 @@ PgHaMain(Datum main_arg)
 	proc_exit(ret);
 }
 
+/*
+ * Entry point for heartbeat workers. A heartbeat worker sends heartbeats
+ * to its share of the nodes and records the results in shared memory,
+ * from which the main worker judges the cluster status.
+ */
+void
+PgHaHeartbeatMain(Datum main_arg)
+{
+	int		shard = DatumGetInt32(main_arg);
+
+	/* Establish signal handlers before unblocking signals */
+	pqsignal(SIGHUP, pgha_sighup);
+	pqsignal(SIGTERM, pgha_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	ereport(LOG, (errmsg("pgha : heartbeat worker %d started", shard)));
+
+	initWorkerStats(shard);
+
+	while (!got_sigterm)
+	{
+		int		rc;
+
+		setPhase(PGHA_PHASE_IDLE);
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   heartbeatTimeout(), PG_WAIT_EXTENSION);
+		ResetLatch(&MyProc->procLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		/* If got SIGHUP, reload the configuration file */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			setPhase(PGHA_PHASE_RELOAD);
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/* Don't regard the nodes being restored as missing */
+		if (registryLoaded() && get_hanode_count() > 1)
+			doHeartbeat(shard, pgha_heartbeat_workers);
+	}
+
+	proc_exit(0);
+}
+
 /* Check the mandatory parameteres */
 static void
 checkParameter()
@@ -318,6 +968,10 @@ checkParameter()
 
 	if (pgha_node_name == NULL || pgha_node_name[0] == '\0')
 		ereport(ERROR, (errmsg("pgha.node_name must be specified.")));
+
+	if (!am_master() &&
+		(pgha_master_conninfo == NULL || pgha_master_conninfo[0] == '\0'))
+		ereport(ERROR, (errmsg("pgha.master_conninfo must be specified on standby.")));
 }
 
 static Size
@@ -325,8 +979,27 @@ pgha_shmemsize(void)
 {
 	Size size;
 
+	size = pgha_ctlsize();
+
+	return size;
+}
+
+/*
+ * Size of PgHaCtlData including the membership change log, the worker stats
+ * and the in-place part of the area. The node slots are not included as
+ * they are in dynamic shared memory.
+ */
+static Size
+pgha_ctlsize(void)
+{
+	Size size;
+
 	size = MAXALIGN(sizeof(PgHaCtlData));
-	size = add_size(size, sizeof(PgHaNode) * pgha_max_nodes);
+	size = add_size(size, MAXALIGN(mul_size(sizeof(PgHaMembershipChange),
+											PGHA_MEMBERSHIP_LOG_SIZE)));
+	size = add_size(size, MAXALIGN(mul_size(sizeof(PgHaWorkerStats),
+											pgha_heartbeat_workers + 1)));
+	size = add_size(size, dsa_minimum_size());
 
 	return size;
 }
@@ -362,363 +1035,5115 @@ check_pgha_conninfo(char **newval, void **extra, GucSource source)
 }
 
 static bool
-addNode(const char *name, const char *conninfo, bool myself,
+addNode(const char *name, const char *conninfo, char type, bool myself,
 		bool dup_ok)
 {
-	int i;
 	PgHaNode *new_node;
+	int	   *live_slots;
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (strlen(name) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errmsg("node name \"%s\" is too long", name)));
+	if (strlen(conninfo) >= MAXPGPATH)
+		ereport(ERROR,
+				(errmsg("conninfo of node \"%s\" is too long", name)));
 
 	LWLockAcquire(PgHaCtl->lock, LW_EXCLUSIVE);
 
 	/* Check uniques */
-	for (i = 0; i < pgha_max_nodes; i++)
+	if (indexLookup(name, NULL) >= 0)
 	{
-		PgHaNode *node = &PgHaCtl->nodes[i];
-
-		if (node->in_use && strcmp(node->name, name) == 0)
+		if (!dup_ok)
 		{
-			if (!dup_ok)
-			{
-				/* return false if there is a duplication */
-				ereport(ERROR, (errmsg("duplicate node name \"%s\"", name)));
-				return false;
-			}
-			else
-				/* Since we accept a duplication, return true and do nothing */
-				return true;
+			/* return false if there is a duplication */
+			ereport(ERROR, (errmsg("duplicate node name \"%s\"", name)));
+			return false;
 		}
+
+		/* Since we accept a duplication, return true and do nothing */
+		LWLockRelease(PgHaCtl->lock);
+		return true;
 	}
 
-	new_node = &PgHaCtl->nodes[PgHaCtl->n_nodes];
+	if (pgha_max_nodes > 0 && PgHaCtl->n_nodes >= pgha_max_nodes)
+		ereport(ERROR,
+				(errmsg("could not add node \"%s\"", name),
+				 errdetail("The number of nodes reached pgha.max_ha_nodes (%d).",
+						   pgha_max_nodes)));
+
+	/* This allocates everything needed, so nothing fails after this */
+	if (PgHaCtl->free_head < 0)
+		growRegistry();
 
-	strcpy(new_node->name, name);
-	strcpy(new_node->conninfo, conninfo);
+	new_node = getSlot(PgHaCtl->free_head);
+	PgHaCtl->free_head = new_node->next_free;
+
+	SpinLockAcquire(&new_node->mutex);
+	strlcpy(new_node->name, name, NAMEDATALEN);
+	strlcpy(new_node->conninfo, conninfo, MAXPGPATH);
+	new_node->node_id = PgHaCtl->next_node_id++;
 	new_node->in_use = true;
 	new_node->myself = myself;
-	new_node->type = am_master() ? 'm' : 's';
+	new_node->type = type;
 	new_node->is_sync = false;
 	new_node->retry_count = 0;
-
-	PgHaCtl->n_nodes++;
-
-	LWLockRelease(PgHaCtl->lock);
-
-	debug_show();
+	/* Suspected if not heard from in a while, but nothing is sampled yet */
+	memset(&new_node->arrivals, 0, sizeof(PgHaArrivalWindow));
+	new_node->arrivals.monitored = now;
+	memset(&new_node->stats, 0, sizeof(PgHaNodeStats));
+	new_node->stats.last_connect_us = -1;
+	new_node->stats.last_rtt_us = -1;
+	memset(&new_node->repl, 0, sizeof(PgHaReplStatus));
+	memset(&new_node->wal, 0, sizeof(PgHaWalPosition));
+	new_node->next_free = -1;
+	new_node->live_index = PgHaCtl->n_nodes;
+	SpinLockRelease(&new_node->mutex);
+
+	live_slots = getLiveSlots();
+	live_slots[PgHaCtl->n_nodes++] = new_node->slotno;
+	indexInsert(name, new_node->slotno);
+
+	logMembershipChange('a', new_node);
+
+	saveRegistryAndUnlock();
+
+	if (!registry_loading)
+	{
+		/* Start monitoring the new node right away */
+		wakeWorkers();
+		debug_show();
+	}
 	
 	return true;
 }
 
 static bool
-delNode(const char *name)
+delNode(const char *name, bool missing_ok)
 {
-	int i;
-	PgHaNode *node = NULL;
-	bool found = false;
+	PgHaNode *node;
+	int	   *live_slots;
+	int		slotno;
+	int		bucket;
+	int		last;
+	int		prev;
+	int		next;
 
 	LWLockAcquire(PgHaCtl->lock, LW_EXCLUSIVE);
 
-	for (i = 0; i < pgha_max_nodes; i++)
-	{
-		node = &PgHaCtl->nodes[i];
-
-		if (node->in_use && strcmp(node->name, name) == 0)
-		{
-			found = true;
-			break;
-		}
-	}
-
-	if (!found)
+	slotno = indexLookup(name, &bucket);
+	if (slotno < 0)
 	{
-		ereport(ERROR, (errmsg("didn't find given name node \"%s\"", name)));
 		LWLockRelease(PgHaCtl->lock);
+		if (!missing_ok)
+			ereport(ERROR, (errmsg("didn't find given name node \"%s\"", name)));
 		return false;
 	}
 
-	/* Move tail node to deleting node position */
-	memcpy(node, &PgHaCtl->nodes[PgHaCtl->n_nodes], sizeof(PgHaNode));
-	memset(&PgHaCtl->nodes[PgHaCtl->n_nodes], 0 , sizeof(PgHaNode));
+	node = getSlot(slotno);
+
+	/*
+	 * Release the slot to the free list. Nodes are never moved so that a
+	 * reader holding a snapshot can still find its slot by slotno; only the
+	 * dense live_slots array is compacted.
+	 */
+	logMembershipChange('d', node);
+
+	live_slots = getLiveSlots();
+	last = live_slots[PgHaCtl->n_nodes - 1];
+	live_slots[node->live_index] = last;
+	getSlot(last)->live_index = node->live_index;
 	PgHaCtl->n_nodes--;
 
-	LWLockRelease(PgHaCtl->lock);
+	/* Keep the free list in slot number order; see rebuildFreeList() */
+	prev = -1;
+	next = PgHaCtl->free_head;
+	while (next >= 0 && next < slotno)
+	{
+		prev = next;
+		next = getSlot(next)->next_free;
+	}
+
+	SpinLockAcquire(&node->mutex);
+	node->in_use = false;
+	node->node_id = 0;
+	node->live_index = -1;
+	node->next_free = next;
+	SpinLockRelease(&node->mutex);
+
+	if (prev < 0)
+		PgHaCtl->free_head = slotno;
+	else
+		getSlot(prev)->next_free = slotno;
+
+	indexDelete(bucket);
+
+	/* Give back the trailing chunks no longer used */
+	shrinkRegistry();
+
+	saveRegistryAndUnlock();
 
+	wakeWorkers();
 	debug_show();
 
 	return true;
 }
 
-static void
-debug_show(void)
+/*
+ * Change the conninfo, unless NULL, and the type of the given node. Returns
+ * false if it is not registered.
+ */
+static bool
+updateNode(const char *name, const char *conninfo, char type)
 {
-	int i;
+	PgHaNode *node;
+	int		slotno;
 
-	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+	if (conninfo != NULL && strlen(conninfo) >= MAXPGPATH)
+		ereport(ERROR,
+				(errmsg("conninfo of node \"%s\" is too long", name)));
 
-	for (i = 0; i < pgha_max_nodes; i++)
+	LWLockAcquire(PgHaCtl->lock, LW_EXCLUSIVE);
+
+	slotno = indexLookup(name, NULL);
+	if (slotno < 0)
 	{
-		PgHaNode *n = &PgHaCtl->nodes[i];
+		LWLockRelease(PgHaCtl->lock);
+		return false;
+	}
 
-		if (!n->in_use)
-			continue;
+	node = getSlot(slotno);
 
-		elog(WARNING, "[%d] name = \"%s\", conn = \"%s\", type = \'%c\'",
-			 i, n->name, n->conninfo, n->type);
+	/* Nothing to do if unchanged, not to bump the epoch */
+	if (node->type == type &&
+		(conninfo == NULL || strcmp(node->conninfo, conninfo) == 0))
+	{
+		LWLockRelease(PgHaCtl->lock);
+		return true;
 	}
 
-	LWLockRelease(PgHaCtl->lock);
+	SpinLockAcquire(&node->mutex);
+	if (conninfo != NULL)
+		strlcpy(node->conninfo, conninfo, MAXPGPATH);
+	node->type = type;
+	SpinLockRelease(&node->mutex);
+
+	logMembershipChange('a', node);
+
+	saveRegistryAndUnlock();
+
+	wakeWorkers();
+
+	return true;
 }
 
-Datum
-add_node(PG_FUNCTION_ARGS)
+/*
+ * Append a membership change of the given node to the log. The caller must
+ * hold PgHaCtl->lock exclusively.
+ */
+static void
+logMembershipChange(char op, PgHaNode *node)
 {
-	text *name = PG_GETARG_TEXT_P(0);
-	text *conninfo = PG_GETARG_TEXT_P(1);
-	bool ret;
+	PgHaMembershipChange *change;
 
-	ret = addNode(text_to_cstring(name), text_to_cstring(conninfo), false,
-				  false);
+	PgHaCtl->epoch++;
 
-	PG_RETURN_BOOL(ret);
+	change = &PgHaCtl->changes[PgHaCtl->epoch % PGHA_MEMBERSHIP_LOG_SIZE];
+	change->epoch = PgHaCtl->epoch;
+	change->op = op;
+	change->type = node->type;
+	strlcpy(change->name, node->name, NAMEDATALEN);
+	strlcpy(change->conninfo, node->conninfo, MAXPGPATH);
 }
 
-Datum
-del_node(PG_FUNCTION_ARGS)
+/* Has the main worker restored the registry file? */
+static bool
+registryLoaded(void)
 {
-	text *name = PG_GETARG_TEXT_P(0);
-	bool ret;
+	bool	loaded;
 
-	ret = delNode(text_to_cstring(name));
+	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+	loaded = PgHaCtl->registry_loaded;
+	LWLockRelease(PgHaCtl->lock);
 
-	PG_RETURN_BOOL(ret);
+	return loaded;
 }
 
-Datum
-join_node(PG_FUNCTION_ARGS)
+/*
+ * Write the registered nodes to the registry file, and release
+ * PgHaCtl->lock, which the caller must hold exclusively.
+ *
+ * The nodes are serialized under the lock, but the file is written after
+ * releasing it so that readers don't wait for the disk. PgHaCtl->file_lock
+ * is taken before the release, so that files are written in the order of
+ * the changes.
+ *
+ * The membership change is already visible in shared memory, so a failure
+ * is reported only as a warning; the next change rewrites the whole file.
+ */
+static void
+saveRegistryAndUnlock(void)
 {
-#define RETURN_COLS 2
+	PgHaRegistryHeader *hdr;
+	PgHaRegistryEntry *entries;
+	pg_crc32c crc;
+	char	*buf;
+	int	   *live_slots;
+	Size	len;
+	int		i;
+
+	if (registry_loading)
+	{
+		LWLockRelease(PgHaCtl->lock);
+		return;
+	}
 
-	text *name = PG_GETARG_TEXT_P(0);
-	text *conninfo = PG_GETARG_TEXT_P(1);
-	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc	tupdesc;
-	MemoryContext oldcontext;
-	Tuplestorestate *tupstore;
-	int i;
+	len = sizeof(PgHaRegistryHeader) +
+		sizeof(PgHaRegistryEntry) * PgHaCtl->n_nodes;
+	buf = palloc0(len);
+	hdr = (PgHaRegistryHeader *) buf;
+	entries = (PgHaRegistryEntry *) (buf + sizeof(PgHaRegistryHeader));
 
-	if (!am_master())
-		ereport(ERROR, (errmsg("join_node can be executed only on master node")));
+	hdr->magic = PGHA_REGISTRY_MAGIC;
+	hdr->version = PGHA_REGISTRY_VERSION;
+	hdr->entry_size = sizeof(PgHaRegistryEntry);
+	hdr->n_entries = PgHaCtl->n_nodes;
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
-		rsinfo->expectedDesc == NULL)
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not allowed in this context")));
+	live_slots = getLiveSlots();
+	for (i = 0; i < PgHaCtl->n_nodes; i++)
+	{
+		PgHaNode *node = getSlot(live_slots[i]);
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+		strlcpy(entries[i].name, node->name, NAMEDATALEN);
+		strlcpy(entries[i].conninfo, node->conninfo, MAXPGPATH);
+		entries[i].type = node->type;
+	}
 
-	/* Build tuplestore to hold the result rows */
-	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	LWLockAcquire(PgHaCtl->file_lock, LW_EXCLUSIVE);
+	LWLockRelease(PgHaCtl->lock);
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	/* Compute the CRC while hdr->crc is still zero */
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, buf, len);
+	FIN_CRC32C(crc);
+	hdr->crc = crc;
 
-	/*
-	 * Aadd a given node. Since re-started node might try to join again
-	 * this adding node ignore a duplication.
-	 */
-	addNode(text_to_cstring(name), text_to_cstring(conninfo), false, true);
-	
-	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
-	
-	for (i = 0; i < pgha_max_nodes; i++)
+	writeFileAtomic(PGHA_REGISTRY_FILE, buf, len, true);
+
+	LWLockRelease(PgHaCtl->file_lock);
+
+	pfree(buf);
+}
+
+/*
+ * Write a file to a temporary file and rename it, not to leave a torn
+ * file. If durable, the file is fsync'd so that it survives a crash.
+ * Failures are reported as warnings.
+ */
+static void
+writeFileAtomic(const char *path, char *buf, Size len, bool durable)
+{
+	char	tmppath[MAXPGPATH];
+	int		fd;
+
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+	fd = OpenTransientFile(tmppath,
+						   O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+						   S_IRUSR | S_IWUSR);
+	if (fd < 0)
 	{
-		PgHaNode *node = &PgHaCtl->nodes[i];
-		Datum		values[RETURN_COLS];
-		bool		nulls[RETURN_COLS];
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+		return;
+	}
 
-		if (!node->in_use)
-			continue;
-		
-		values[0] = CStringGetTextDatum(node->name);
-		values[1] = CStringGetTextDatum(node->conninfo);
+	errno = 0;
+	if (write(fd, buf, len) != len)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+		CloseTransientFile(fd);
+		return;
+	}
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	if (durable && pg_fsync(fd) != 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmppath)));
+		CloseTransientFile(fd);
+		return;
 	}
-	
-	LWLockRelease(PgHaCtl->lock);
-	tuplestore_donestoring(tupstore);
-	MemoryContextSwitchTo(oldcontext);
 
-	return (Datum) 0;
+	CloseTransientFile(fd);
+
+	if (durable)
+		(void) durable_rename(tmppath, path, WARNING);
+	else if (rename(tmppath, path) != 0)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\" to \"%s\": %m",
+						tmppath, path)));
 }
 
-static
-bool PgHaMasterLoop(void)
+/*
+ * Reload the registry file saved by the previous incarnation, if any.
+ * Called by the main worker once after shared memory initialization.
+ *
+ * The file is mapped rather than read since it can span many nodes and is
+ * consumed once. An invalid file is ignored, in which case nodes register
+ * themselves again.
+ */
+static void
+loadRegistry(void)
 {
-	ereport(LOG, (errmsg("pgha : entered master mode")));
+	PgHaRegistryHeader *hdr;
+	PgHaRegistryEntry *entries;
+	struct stat st;
+	char	*map;
+	pg_crc32c crc;
+	pg_crc32c saved_crc;
+	uint32	n_loaded = 0;
+	uint32	i;
+	int		fd;
+
+	fd = OpenTransientFile(PGHA_REGISTRY_FILE, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m",
+							PGHA_REGISTRY_FILE)));
+		return;
+	}
 
-	while (!got_sigterm)
+	if (fstat(fd, &st) < 0)
 	{
-		int		rc;
-		int		n_nodes;
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m",
+						PGHA_REGISTRY_FILE)));
+		CloseTransientFile(fd);
+		return;
+	}
 
-		/*
-		 * Background workers mustn't call usleep() or any direct equivalent:
-		 * instead, they may wait on their process latch, which sleeps as
-		 * necessary, but is awakened if postmaster dies.  That way the
-		 * background process goes away immediately in an emergency.
-		 */
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pgha_keepalives_time * 1000L, PG_WAIT_EXTENSION);
-		ResetLatch(&MyProc->procLatch);
+	if (st.st_size < sizeof(PgHaRegistryHeader))
+	{
+		ereport(LOG,
+				(errmsg("ignoring invalid pgha registry file \"%s\"",
+						PGHA_REGISTRY_FILE)));
+		CloseTransientFile(fd);
+		return;
+	}
 
-		/* Emergency bailout if postmaster has died */
-		if (rc & WL_POSTMASTER_DEATH)
-			return false;
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	CloseTransientFile(fd);
 
-		/* If got SIGHUP, reload the configuration file */
-		if (got_sighup)
+	if (map == MAP_FAILED)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m",
+						PGHA_REGISTRY_FILE)));
+		return;
+	}
+
+	hdr = (PgHaRegistryHeader *) map;
+	entries = (PgHaRegistryEntry *) (map + sizeof(PgHaRegistryHeader));
+
+	/* The mapping is private, so we can zero crc to compute it */
+	saved_crc = hdr->crc;
+	hdr->crc = 0;
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, map, st.st_size);
+	FIN_CRC32C(crc);
+
+	if (hdr->magic != PGHA_REGISTRY_MAGIC ||
+		hdr->version != PGHA_REGISTRY_VERSION ||
+		hdr->entry_size != sizeof(PgHaRegistryEntry) ||
+		st.st_size != sizeof(PgHaRegistryHeader) +
+		(off_t) hdr->n_entries * sizeof(PgHaRegistryEntry) ||
+		!EQ_CRC32C(crc, saved_crc))
+	{
+		ereport(LOG,
+				(errmsg("ignoring invalid pgha registry file \"%s\"",
+						PGHA_REGISTRY_FILE)));
+		munmap(map, st.st_size);
+		return;
+	}
+
+	registry_loading = true;
+
+	for (i = 0; i < hdr->n_entries; i++)
+	{
+		PgHaRegistryEntry *e = &entries[i];
+		bool	myself;
+
+		if (pgha_max_nodes > 0 && PgHaCtl->n_nodes >= pgha_max_nodes)
 		{
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
+			ereport(LOG,
+					(errmsg("could not restore %u nodes from pgha registry file",
+							hdr->n_entries - i),
+					 errhint("Increase pgha.max_ha_nodes.")));
+			break;
 		}
 
-		/* get number of registered nodes. Always more than 1. */
-		n_nodes = get_hanode_count();
+		/* Shouldn't happen as the CRC matched, but be sure */
+		if (memchr(e->name, '\0', NAMEDATALEN) == NULL ||
+			memchr(e->conninfo, '\0', MAXPGPATH) == NULL)
+			continue;
 
-		if (n_nodes > 1)
-		{
-			/* heartbeat to all nodes */
-			doHeartbeat();
+		/* Decide which is myself again, as pgha.node_name may be changed */
+		myself = (pgha_node_name != NULL &&
+				  strcmp(e->name, pgha_node_name) == 0);
 
-			/*
-			 * Check current cluster status if any of retry count
-			 * exceeded threshold.
-			 */
-			if (in_syncrep && !checkClusterStatus())
-				changeToAsync();
-		}
+		if (addNode(e->name, e->conninfo, e->type, myself, true))
+			n_loaded++;
 	}
 
-	return true;
-}
+	registry_loading = false;
 
-static bool
-PgHaStandbyLoop(void)
-{
-	return true;
+	munmap(map, st.st_size);
+
+	ereport(LOG,
+			(errmsg("pgha: restored %u nodes from registry file", n_loaded)));
 }
 
-static void
-doHeartbeat(void)
+/*
+ * Return the area holding the node slots, attaching it on first use in this
+ * process.
+ */
+static dsa_area *
+getArea(void)
 {
-	int i;
-
-	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
-
-	for (i = 0; i < pgha_max_nodes; i++)
+	if (PgHaArea == NULL)
 	{
-		PgHaNode *node = &PgHaCtl->nodes[i];
-		bool	ret;
-
-		if (!node->in_use || node->myself)
-			continue;
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
 
-		/* If I'm a slave, not interested in ping to other slaves */
-		if (!am_master() && node->type == 's')
-			continue;
-			
-		/* I'm master server, so ingnore myself */
-		if (!node->in_use || node->myself)
-			continue;
+		LWLockRegisterTranche(PgHaCtl->area_tranche, "pgha registry");
+		PgHaArea = dsa_attach_in_place(PgHaCtl->area, NULL);
 
-		/* Send ping */
-		ret = execSQL(node->conninfo, "SELECT 1");
+		/* Keep the segments mapped beyond the current resource owner */
+		dsa_pin_mapping(PgHaArea);
 
-		SpinLockAcquire(&node->mutex);
-		if (!ret)
-			node->retry_count++;
-		else
-			node->retry_count = 0;
-		SpinLockRelease(&node->mutex);
+		MemoryContextSwitchTo(oldcontext);
 	}
 
-	LWLockRelease(PgHaCtl->lock);
+	return PgHaArea;
 }
 
-static void
-changeToAsync(void)
+/*
+ * Return the slot of the given number, or NULL if its chunk has been freed.
+ * The caller must hold PgHaCtl->lock.
+ */
+static PgHaNode *
+getSlot(int slotno)
 {
-	int ret;
+	int		chunkno = slotno / PGHA_CHUNK_NODES;
+	PgHaNode *chunk;
 
-	ereport(LOG, (errmsg("pgha: changes replication mode to asynchronous replication")));
+	if (chunkno >= PgHaCtl->n_chunks)
+		return NULL;
 
-	if (!execSQL(pgha_my_conninfo, "ALTER SYSTEM SET synchronous_standby_names TO ''"))
-		ereport(ERROR, (errmsg("pgha: fialed to change replication mode")));
+	chunk = (PgHaNode *) dsa_get_address(getArea(), PgHaCtl->chunks[chunkno]);
 
-	if ((ret = kill(PostmasterPid, SIGHUP)) != 0)
-		ereport(ERROR, (errmsg("pgha: failed to send SIGHUP to postmaster")));
+	return &chunk[slotno % PGHA_CHUNK_NODES];
 }
 
-static bool
-checkClusterStatus(void)
+/* Return live_slots. The caller must hold PgHaCtl->lock */
+static int *
+getLiveSlots(void)
 {
-	return true;
+	return (int *) dsa_get_address(getArea(), PgHaCtl->live_slots);
 }
 
-static int
-get_hanode_count(void)
+/*
+ * Add a chunk of free slots, and make room for them in live_slots and the
+ * index. The caller must hold PgHaCtl->lock exclusively.
+ *
+ * Everything is allocated before anything is changed, so that an error
+ * leaves the registry intact.
+ */
+static void
+growRegistry(void)
 {
-	int count;
+	dsa_area   *area = getArea();
+	int			n_chunks = PgHaCtl->n_chunks;
+	int			capacity = (n_chunks + 1) * PGHA_CHUNK_NODES;
+	int			index_size;
+	dsa_pointer	chunk_dp;
+	dsa_pointer	slots_dp = InvalidDsaPointer;
+	dsa_pointer	index_dp = InvalidDsaPointer;
+	PgHaNode   *chunk;
+	int			i;
+
+	Assert(LWLockHeldByMeInMode(PgHaCtl->lock, LW_EXCLUSIVE));
+	Assert(PgHaCtl->free_head < 0);
+
+	if (n_chunks >= PGHA_MAX_CHUNKS)
+		ereport(ERROR,
+				(errmsg("too many pgha nodes"),
+				 errdetail("At most %d nodes can be registered.",
+						   PGHA_CHUNK_NODES * PGHA_MAX_CHUNKS)));
+
+	/* Keep the index at most half full */
+	index_size = Max(PgHaCtl->index_size, PGHA_CHUNK_NODES * 2);
+	while (index_size < capacity * 2)
+		index_size *= 2;
+
+	chunk_dp = dsa_allocate_extended(area,
+									 sizeof(PgHaNode) * PGHA_CHUNK_NODES,
+									 DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
+	if (DsaPointerIsValid(chunk_dp) && PgHaCtl->live_capacity < capacity)
+		slots_dp = dsa_allocate_extended(area, sizeof(int) * capacity,
+										 DSA_ALLOC_NO_OOM);
+	if (DsaPointerIsValid(chunk_dp) && index_size != PgHaCtl->index_size)
+		index_dp = dsa_allocate_extended(area, sizeof(int) * index_size,
+										 DSA_ALLOC_NO_OOM);
+
+	if (!DsaPointerIsValid(chunk_dp) ||
+		(PgHaCtl->live_capacity < capacity && !DsaPointerIsValid(slots_dp)) ||
+		(index_size != PgHaCtl->index_size && !DsaPointerIsValid(index_dp)))
+	{
+		if (DsaPointerIsValid(chunk_dp))
+			dsa_free(area, chunk_dp);
+		if (DsaPointerIsValid(slots_dp))
+			dsa_free(area, slots_dp);
+		if (DsaPointerIsValid(index_dp))
+			dsa_free(area, index_dp);
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of dynamic shared memory"),
+				 errdetail("Failed to allocate slots for %d pgha nodes.",
+						   capacity)));
+	}
 
-	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
-	count = PgHaCtl->n_nodes;
-	LWLockRelease(PgHaCtl->lock);
+	/* Chain the new slots to the free list, the lowest number first */
+	chunk = (PgHaNode *) dsa_get_address(area, chunk_dp);
+	for (i = PGHA_CHUNK_NODES - 1; i >= 0; i--)
+	{
+		PgHaNode *n = &chunk[i];
+
+		n->slotno = n_chunks * PGHA_CHUNK_NODES + i;
+		n->in_use = false;
+		n->live_index = -1;
+		n->next_free = PgHaCtl->free_head;
+		SpinLockInit(&n->mutex);
+		PgHaCtl->free_head = n->slotno;
+	}
+	PgHaCtl->chunks[n_chunks] = chunk_dp;
+	PgHaCtl->n_chunks++;
+
+	if (DsaPointerIsValid(slots_dp))
+	{
+		int	   *slots = (int *) dsa_get_address(area, slots_dp);
+
+		if (PgHaCtl->n_nodes > 0)
+			memcpy(slots, getLiveSlots(), sizeof(int) * PgHaCtl->n_nodes);
+		if (DsaPointerIsValid(PgHaCtl->live_slots))
+			dsa_free(area, PgHaCtl->live_slots);
+		PgHaCtl->live_slots = slots_dp;
+		PgHaCtl->live_capacity = capacity;
+	}
 
-	return count;
+	if (DsaPointerIsValid(index_dp))
+	{
+		int	   *buckets = (int *) dsa_get_address(area, index_dp);
+		int	   *live_slots = getLiveSlots();
+
+		for (i = 0; i < index_size; i++)
+			buckets[i] = -1;
+		if (DsaPointerIsValid(PgHaCtl->index))
+			dsa_free(area, PgHaCtl->index);
+		PgHaCtl->index = index_dp;
+		PgHaCtl->index_size = index_size;
+
+		for (i = 0; i < PgHaCtl->n_nodes; i++)
+			indexInsert(getSlot(live_slots[i])->name, live_slots[i]);
+	}
 }
 
-bool
-execSQL(const char *conninfo, const char *sql)
+/*
+ * Free the trailing chunks that have no node in use, as long as the rest
+ * keep half a chunk of free slots, not to allocate and free a chunk over
+ * and over at the boundary. The caller must hold PgHaCtl->lock exclusively.
+ *
+ * live_slots and the index keep their size, as they are small compared to
+ * the slots.
+ */
+static void
+shrinkRegistry(void)
 {
-	PGconn		*con;
-	PGresult 	*res;
+	bool	shrunk = false;
 
-	/* Try to connect to primary server */
-	if ((con = PQconnectdb(conninfo)) == NULL)
+	Assert(LWLockHeldByMeInMode(PgHaCtl->lock, LW_EXCLUSIVE));
+
+	while (PgHaCtl->n_chunks > 1 &&
+		   PgHaCtl->n_nodes + PGHA_CHUNK_NODES / 2 <=
+		   (PgHaCtl->n_chunks - 1) * PGHA_CHUNK_NODES)
 	{
-		ereport(LOG,
-				(errmsg("could not establish conenction to server : \"%s\"",
-					conninfo)));
+		int			last = PgHaCtl->n_chunks - 1;
+		PgHaNode   *chunk = getSlot(last * PGHA_CHUNK_NODES);
+		int			i;
 
-		PQfinish(con);
-		return false;
+		for (i = 0; i < PGHA_CHUNK_NODES; i++)
+		{
+			if (chunk[i].in_use)
+				break;
+		}
+		if (i < PGHA_CHUNK_NODES)
+			break;
+
+		PgHaCtl->n_chunks--;
+		dsa_free(getArea(), PgHaCtl->chunks[last]);
+		PgHaCtl->chunks[last] = InvalidDsaPointer;
+		shrunk = true;
 	}
 
-	res = PQexec(con, sql);
+	/* Forget the freed slots */
+	if (shrunk)
+		rebuildFreeList();
+}
+
+/*
+ * Chain all free slots in slot number order. Taking the lowest free slot
+ * first packs the nodes into the first chunks, so that the last ones get
+ * empty as nodes leave.
+ */
+static void
+rebuildFreeList(void)
+{
+	int		slotno;
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK &&
-		PQresultStatus(res) != PGRES_COMMAND_OK)
+	PgHaCtl->free_head = -1;
+	for (slotno = PgHaCtl->n_chunks * PGHA_CHUNK_NODES - 1; slotno >= 0;
+		 slotno--)
 	{
-		/* Failed to ping to master server, report the number of retrying */
-		ereport(LOG,
-				(errmsg("could not get tuple from server : \"%s\"",
-					conninfo)));
+		PgHaNode *node = getSlot(slotno);
 
-		PQfinish(con);
-		return false;
+		if (node->in_use)
+			continue;
+
+		node->next_free = PgHaCtl->free_head;
+		PgHaCtl->free_head = slotno;
 	}
+}
 
-	PQfinish(con);
-	return true;
+static uint32
+indexHash(const char *name)
+{
+	return DatumGetUInt32(hash_any((const unsigned char *) name,
+								   strlen(name)));
+}
+
+/*
+ * Return the slot number of the named node, or -1 if not registered. The
+ * bucket holding it is returned in *bucket unless NULL. The caller must
+ * hold PgHaCtl->lock.
+ *
+ * The index is an open addressing table with linear probing, which is kept
+ * at most half full by growRegistry().
+ */
+static int
+indexLookup(const char *name, int *bucket)
+{
+	int	   *buckets;
+	uint32	mask;
+	uint32	i;
+
+	if (PgHaCtl->index_size == 0)
+		return -1;
+
+	buckets = (int *) dsa_get_address(getArea(), PgHaCtl->index);
+	mask = PgHaCtl->index_size - 1;
+
+	for (i = indexHash(name) & mask; buckets[i] >= 0; i = (i + 1) & mask)
+	{
+		if (strcmp(getSlot(buckets[i])->name, name) == 0)
+		{
+			if (bucket != NULL)
+				*bucket = i;
+			return buckets[i];
+		}
+	}
+
+	return -1;
+}
+
+/* Add a node to the index; the caller must hold the lock exclusively */
+static void
+indexInsert(const char *name, int slotno)
+{
+	int	   *buckets = (int *) dsa_get_address(getArea(), PgHaCtl->index);
+	uint32	mask = PgHaCtl->index_size - 1;
+	uint32	i;
+
+	for (i = indexHash(name) & mask; buckets[i] >= 0; i = (i + 1) & mask)
+		;
+
+	buckets[i] = slotno;
+}
+
+/*
+ * Remove the entry in the given bucket from the index. Instead of leaving a
+ * tombstone, the following entries are shifted back so that every entry
+ * stays reachable from its home bucket. The caller must hold the lock
+ * exclusively.
+ */
+static void
+indexDelete(int bucket)
+{
+	int	   *buckets = (int *) dsa_get_address(getArea(), PgHaCtl->index);
+	uint32	mask = PgHaCtl->index_size - 1;
+	uint32	hole = bucket;
+	uint32	i = bucket;
+
+	for (;;)
+	{
+		uint32	home;
+
+		i = (i + 1) & mask;
+		if (buckets[i] < 0)
+			break;
+
+		/* The entry can't move before its home, cyclically in (hole, i] */
+		home = indexHash(getSlot(buckets[i])->name) & mask;
+		if (hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+			continue;
+
+		buckets[hole] = buckets[i];
+		hole = i;
+	}
+
+	buckets[hole] = -1;
+}
+
+/*
+ * Return a palloc'd copy of the registered nodes, and the number of them in
+ * *n_nodes. The membership epoch of the copy is returned in *epoch unless
+ * NULL.
+ *
+ * The lock is held only while copying, so the caller can use the copy for
+ * network I/O without blocking addNode()/delNode().
+ *
+ * This used to be a lock-free seqlock read, but since the slots live in a
+ * DSA a reader racing with delNode() could follow a stale chunk pointer
+ * into a segment that is already freed, and dsa_get_address() errors out
+ * or maps garbage there; a retry can't undo that. Readers therefore take
+ * the lock in shared mode, which only waits for membership changes; those
+ * are rare and no longer do file I/O under the lock.
+ */
+static PgHaNode *
+snapshotNodes(int *n_nodes, uint64 *epoch)
+{
+	PgHaNode *nodes;
+
+	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+
+	if (epoch != NULL)
+		*epoch = PgHaCtl->epoch;
+	nodes = copyLiveNodes(n_nodes);
+
+	LWLockRelease(PgHaCtl->lock);
+
+	return nodes;
+}
+
+/* Workhorse of snapshots; the caller must hold PgHaCtl->lock */
+static PgHaNode *
+copyLiveNodes(int *n_nodes)
+{
+	PgHaNode *nodes;
+	int	   *live_slots;
+	int		i;
+
+	/* Allocate at least one, not to palloc zero bytes */
+	nodes = (PgHaNode *) palloc(sizeof(PgHaNode) *
+								Max(PgHaCtl->n_nodes, 1));
+	*n_nodes = 0;
+
+	if (PgHaCtl->n_nodes == 0)
+		return nodes;
+
+	/* Only visit the live slots */
+	live_slots = getLiveSlots();
+	for (i = 0; i < PgHaCtl->n_nodes; i++)
+	{
+		PgHaNode *node = getSlot(live_slots[i]);
+
+		/* Health fields may be being updated */
+		SpinLockAcquire(&node->mutex);
+		memcpy(&nodes[*n_nodes], node, sizeof(PgHaNode));
+		SpinLockRelease(&node->mutex);
+
+		/* The copy took the mutex in its held state */
+		SpinLockInit(&nodes[(*n_nodes)++].mutex);
+	}
+
+	return nodes;
+}
+
+/*
+ * Copy the membership changes made after the given epoch to changes, which
+ * must have room for PGHA_MEMBERSHIP_LOG_SIZE entries. If they are no
+ * longer in the log, or the epoch is from the future, i.e. from another
+ * incarnation, return a palloc'd copy of all nodes in *nodes instead and
+ * return true.
+ */
+static bool
+snapshotMembershipSince(uint64 since, uint64 *epoch,
+						PgHaNode **nodes, int *n_nodes,
+						PgHaMembershipChange *changes, int *n_changes)
+{
+	uint64	oldest;
+	bool	reset;
+
+	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+
+	*epoch = PgHaCtl->epoch;
+	*nodes = NULL;
+	*n_nodes = 0;
+	*n_changes = 0;
+
+	/* Changes after this epoch are in the log */
+	oldest = Max(PgHaCtl->first_epoch,
+				 *epoch >= PGHA_MEMBERSHIP_LOG_SIZE ?
+				 *epoch - PGHA_MEMBERSHIP_LOG_SIZE : 0);
+
+	reset = (since < oldest || since > *epoch);
+
+	if (reset)
+		*nodes = copyLiveNodes(n_nodes);
+	else
+	{
+		uint64	e;
+
+		for (e = since + 1; e <= *epoch; e++)
+			memcpy(&changes[(*n_changes)++],
+				   &PgHaCtl->changes[e % PGHA_MEMBERSHIP_LOG_SIZE],
+				   sizeof(PgHaMembershipChange));
+	}
+
+	LWLockRelease(PgHaCtl->lock);
+
+	return reset;
+}
+
+/*
+ * Return the slot of a node we took a snapshot of with its mutex held, or
+ * NULL if the node has been removed meanwhile. PgHaCtl->lock is held in
+ * shared mode until releaseNode(), so that the chunk is not freed under us.
+ */
+static PgHaNode *
+acquireNode(PgHaNode *copy)
+{
+	PgHaNode *node;
+
+	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+
+	node = getSlot(copy->slotno);
+	if (node != NULL)
+	{
+		SpinLockAcquire(&node->mutex);
+		if (node->in_use && node->node_id == copy->node_id)
+			return node;
+		SpinLockRelease(&node->mutex);
+	}
+
+	LWLockRelease(PgHaCtl->lock);
+
+	return NULL;
+}
+
+static void
+releaseNode(PgHaNode *node)
+{
+	SpinLockRelease(&node->mutex);
+	LWLockRelease(PgHaCtl->lock);
+}
+
+/*
+ * Record the heartbeat result of a node we took a snapshot of, unless it
+ * has been removed meanwhile.
+ */
+static void
+updateNodeHealth(PgHaProbe *probe)
+{
+	PgHaNode *node;
+	TimestampTz now = GetCurrentTimestamp();
+	bool	sample = false;
+
+	if (probe->ok)
+		sample = getNodePhi(probe->node, now) < pgha_phi_threshold;
+
+	if ((node = acquireNode(probe->node)) != NULL)
+	{
+		PgHaNodeStats *stats = &node->stats;
+
+		stats->n_probes++;
+
+		if (probe->connect_us >= 0)
+		{
+			stats->last_connect_us = probe->connect_us;
+			histAdd(&stats->connect_hist, probe->connect_us);
+		}
+
+		if (!probe->ok)
+		{
+			node->retry_count++;
+			stats->n_failures++;
+		}
+		else
+		{
+			node->retry_count = 0;
+			recordArrival(node, now, sample, probe->pconn->interval);
+			stats->last_success = now;
+			stats->last_rtt_us = probe->rtt_us;
+			histAdd(&stats->rtt_hist, probe->rtt_us);
+
+			if (probe->wal.updated != 0)
+				node->wal = probe->wal;
+			else if (probe->pconn->no_wal_position)
+				node->wal.unavailable = true;
+		}
+
+		releaseNode(node);
+	}
+}
+
+/* Parse an LSN in the text form of pg_lsn */
+static bool
+parseLSN(const char *str, XLogRecPtr *lsn)
+{
+	uint32	hi;
+	uint32	lo;
+
+	if (sscanf(str, "%X/%X", &hi, &lo) != 2)
+		return false;
+
+	*lsn = ((uint64) hi << 32) | lo;
+	return true;
+}
+
+/* Record the WAL position in the response to a heartbeat, if valid */
+static void
+parseWalPosition(PgHaProbe *probe, PGresult *res)
+{
+	PgHaWalPosition pos;
+	int		i;
+
+	if (PQntuples(res) != 1 || PQnfields(res) != 4)
+		return;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (PQgetisnull(res, 0, i))
+			return;
+	}
+
+	if (!parseLSN(PQgetvalue(res, 0, 0), &pos.receive) ||
+		!parseLSN(PQgetvalue(res, 0, 1), &pos.replay))
+		return;
+
+	pos.timeline = (TimeLineID) strtoul(PQgetvalue(res, 0, 2), NULL, 10);
+	pos.replay_rate = strtod(PQgetvalue(res, 0, 3), NULL);
+	pos.updated = GetCurrentTimestamp();
+
+	probe->wal = pos;
+}
+
+/*
+ * Get the WAL position of this server. A master reports its flush position
+ * as both received and replayed.
+ */
+static void
+getMyWalPosition(PgHaWalPosition *pos)
+{
+	memset(pos, 0, sizeof(PgHaWalPosition));
+
+	/* This also sets ThisTimeLineID once recovery has ended */
+	if (!RecoveryInProgress())
+	{
+		pos->receive = pos->replay = GetFlushRecPtr();
+		pos->timeline = ThisTimeLineID;
+	}
+	else
+	{
+		TimeLineID	receive_tli = 0;
+		TimeLineID	replay_tli = 0;
+
+		pos->receive = GetWalRcvWriteRecPtr(NULL, &receive_tli);
+		pos->replay = GetXLogReplayRecPtr(&replay_tli);
+
+		/* WAL may have been restored from the archive without streaming */
+		pos->receive = Max(pos->receive, pos->replay);
+		pos->timeline = Max(receive_tli, replay_tli);
+	}
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	pos->replay_rate = PgHaCtl->replay.rate;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	pos->updated = GetCurrentTimestamp();
+}
+
+/* Return when the current election started, or 0 if not electing */
+static TimestampTz
+electionStart(void)
+{
+	TimestampTz	start = 0;
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	if (PgHaCtl->failover.electing)
+		start = PgHaCtl->failover.detected;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	return start;
+}
+
+/*
+ * Collect the status of the active walsenders into the given array, which
+ * must have room for max_wal_senders entries. Returns the number of them.
+ */
+static int
+collectWalSenders(PgHaWalSndInfo *walsnds)
+{
+	int		n_walsnds = 0;
+	int		n_backends;
+	int		i;
+
+	if (max_wal_senders == 0)
+		return 0;
+
+	for (i = 0; i < max_wal_senders; i++)
+	{
+		WalSnd *walsnd = &WalSndCtl->walsnds[i];
+		PgHaWalSndInfo *info = &walsnds[n_walsnds];
+
+		SpinLockAcquire(&walsnd->mutex);
+		if (walsnd->pid == 0)
+		{
+			SpinLockRelease(&walsnd->mutex);
+			continue;
+		}
+		info->pid = walsnd->pid;
+		info->state = walsnd->state;
+		info->sent = walsnd->sentPtr;
+		info->write = walsnd->write;
+		info->flush = walsnd->flush;
+		info->apply = walsnd->apply;
+		info->write_lag = walsnd->writeLag;
+		info->flush_lag = walsnd->flushLag;
+		info->apply_lag = walsnd->applyLag;
+		info->sync_priority = walsnd->sync_standby_priority;
+		SpinLockRelease(&walsnd->mutex);
+
+		info->appname[0] = '\0';
+		n_walsnds++;
+	}
+
+	if (n_walsnds == 0)
+		return 0;
+
+	/* Look up application_name of each walsender */
+	pgstat_clear_snapshot();
+	n_backends = pgstat_fetch_stat_numbackends();
+
+	for (i = 1; i <= n_backends; i++)
+	{
+		PgBackendStatus *beentry = pgstat_fetch_stat_beentry(i);
+		int		j;
+
+		if (beentry == NULL || beentry->st_backendType != B_WAL_SENDER)
+			continue;
+
+		for (j = 0; j < n_walsnds; j++)
+		{
+			if (walsnds[j].pid == beentry->st_procpid)
+			{
+				strlcpy(walsnds[j].appname, beentry->st_appname, NAMEDATALEN);
+				break;
+			}
+		}
+	}
+
+	return n_walsnds;
+}
+
+/*
+ * Record the replication status of a node from its walsender, or that it
+ * has none if info is NULL. If check_alive, returns true if the walsender
+ * proves that the standby is alive, in which case we needn't send it a
+ * heartbeat.
+ *
+ * A walsender survives its standby until wal_sender_timeout, so existence
+ * alone is not enough. We regard the standby alive if it has flushed all
+ * WAL sent to it, or if its flush position advanced since the last round.
+ * A dead standby only matters when commits wait for it, and then it is
+ * behind without progressing, so we fall back to a regular heartbeat.
+ * interval is the one the node is going to be checked at next, in ms.
+ */
+static bool
+updateNodeFromWalSender(PgHaNode *copy, PgHaWalSndInfo *info, int interval,
+						bool check_alive)
+{
+	PgHaNode *node;
+	TimestampTz now = GetCurrentTimestamp();
+	bool	alive = false;
+	bool	sample = false;
+
+	if (check_alive && info != NULL)
+		sample = getNodePhi(copy, now) < pgha_phi_threshold;
+
+	if ((node = acquireNode(copy)) != NULL)
+	{
+		PgHaReplStatus *repl = &node->repl;
+
+		if (info == NULL)
+			repl->streaming = false;
+		else
+		{
+			bool	progressed = repl->streaming && info->flush > repl->flush;
+
+			repl->streaming = (info->state == WALSNDSTATE_STREAMING);
+			alive = check_alive && repl->streaming &&
+				(info->flush >= info->sent || progressed);
+
+			repl->sent = info->sent;
+			repl->write = info->write;
+			repl->flush = info->flush;
+			repl->apply = info->apply;
+			repl->write_lag = info->write_lag;
+			repl->flush_lag = info->flush_lag;
+			repl->apply_lag = info->apply_lag;
+			repl->sync_priority = info->sync_priority;
+		}
+		repl->updated = now;
+
+		if (alive)
+		{
+			node->retry_count = 0;
+			recordArrival(node, now, sample, interval);
+			node->stats.n_walsender_checks++;
+			node->stats.last_success = now;
+		}
+
+		releaseNode(node);
+	}
+
+	return alive;
+}
+
+/*
+ * Record a successful heartbeat of the node, the next one of which is
+ * scheduled interval ms later. The caller must hold its mutex.
+ *
+ * How late it arrived after the interval scheduled at the previous one is
+ * sampled only if the caller found that the node was not suspected, so
+ * that an outage doesn't distort the distribution of normal delays. phi is
+ * computed by the caller before taking the mutex.
+ */
+static void
+recordArrival(PgHaNode *node, TimestampTz now, bool sample, int interval)
+{
+	PgHaArrivalWindow *arrivals = &node->arrivals;
+
+	if (sample && arrivals->last_arrival != 0)
+	{
+		arrivals->delays[arrivals->next] =
+			now - arrivals->last_arrival - arrivals->expected;
+		arrivals->next = (arrivals->next + 1) % PGHA_PHI_WINDOW;
+		if (arrivals->n_delays < PGHA_PHI_WINDOW)
+			arrivals->n_delays++;
+	}
+
+	arrivals->last_arrival = now;
+	arrivals->expected = (int64) interval * 1000;
+}
+
+/*
+ * Compute the suspicion level phi of a node, that is -log10 of the
+ * probability that a heartbeat arrives later than now given the recent
+ * delays, which we regard as normally distributed. See Hayashibara et al.,
+ * "The phi accrual failure detector".
+ */
+static double
+computePhi(PgHaArrivalWindow *arrivals, TimestampTz now)
+{
+	double	mean;
+	double	stddev;
+	TimestampTz since = arrivalDistribution(arrivals, &mean, &stddev);
+
+	return phiOfDeviation(((double) (now - since) - mean) / stddev);
+}
+
+/*
+ * Estimate when the next heartbeat of a node arrives, as the mean and the
+ * standard deviation in microseconds after the returned time.
+ *
+ * The next heartbeat is expected the scheduled interval after the last one
+ * plus the mean delay, so that the interval can change without making the
+ * history useless. Until there is a history, a quarter of the interval is
+ * assumed as the deviation, and until the node is first heard from,
+ * pgha.keepalives_time after it was registered.
+ */
+static TimestampTz
+arrivalDistribution(PgHaArrivalWindow *arrivals, double *mean, double *stddev)
+{
+	double	min_stddev = pgha_phi_min_std_deviation * 1000.0;
+	TimestampTz since;
+	int		i;
+
+	if (arrivals->last_arrival == 0)
+	{
+		since = arrivals->monitored;
+		*mean = PGHA_KEEPALIVES_MS * 1000.0;
+		*stddev = *mean / 4;
+	}
+	else if (arrivals->n_delays == 0)
+	{
+		since = arrivals->last_arrival;
+		*mean = (double) arrivals->expected;
+		*stddev = *mean / 4;
+	}
+	else
+	{
+		double	sum = 0;
+		double	sum_sq = 0;
+		double	mean_delay;
+
+		for (i = 0; i < arrivals->n_delays; i++)
+		{
+			double	delay = (double) arrivals->delays[i];
+
+			sum += delay;
+			sum_sq += delay * delay;
+		}
+		mean_delay = sum / arrivals->n_delays;
+
+		since = arrivals->last_arrival;
+		*mean = arrivals->expected + mean_delay;
+		*stddev = sqrt(Max(sum_sq / arrivals->n_delays - mean_delay * mean_delay,
+						   0.0));
+	}
+
+	*stddev = Max(*stddev, min_stddev);
+	return since;
+}
+
+/*
+ * Phi of a heartbeat y standard deviations late, using the logistic
+ * approximation of the cumulative normal distribution.
+ */
+static double
+phiOfDeviation(double y)
+{
+	double	e = exp(-y * (1.5976 + 0.070566 * y * y));
+
+	if (y > 0)
+		return -log10(e / (1.0 + e));
+	else
+		return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+/*
+ * Return when the phi of a node reaches pgha.phi_threshold unless a
+ * heartbeat arrives before. phi grows with the deviation, so it is found
+ * by bisection.
+ */
+static TimestampTz
+suspicionTime(PgHaArrivalWindow *arrivals)
+{
+	double	mean;
+	double	stddev;
+	TimestampTz since = arrivalDistribution(arrivals, &mean, &stddev);
+	double	lo = -10.0;
+	double	hi = 40.0;
+	int		i;
+
+	for (i = 0; i < 32; i++)
+	{
+		double	mid = (lo + hi) / 2;
+
+		if (phiOfDeviation(mid) >= pgha_phi_threshold)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	return since + (int64) ceil(mean + hi * stddev);
+}
+
+/*
+ * Return the current phi of a node we took a snapshot of. The window is
+ * copied out so that the math runs without the node mutex.
+ */
+static double
+getNodePhi(PgHaNode *copy, TimestampTz now)
+{
+	PgHaNode *node;
+	PgHaArrivalWindow arrivals;
+
+	if ((node = acquireNode(copy)) == NULL)
+		return 0.0;
+
+	arrivals = node->arrivals;
+	releaseNode(node);
+
+	return computePhi(&arrivals, now);
+}
+
+static void
+histAdd(PgHaLatencyHist *hist, int64 usecs)
+{
+	int		bucket = 0;
+
+	while (usecs > 1 && bucket < PGHA_HIST_BUCKETS - 1)
+	{
+		usecs >>= 1;
+		bucket++;
+	}
+
+	hist->buckets[bucket]++;
+	hist->count++;
+}
+
+/*
+ * Estimate the given percentile, in milliseconds, interpolating linearly
+ * within the bucket.
+ */
+static double
+histPercentile(PgHaLatencyHist *hist, double fraction)
+{
+	double	target = fraction * hist->count;
+	uint64	cumulative = 0;
+	int		i;
+
+	for (i = 0; i < PGHA_HIST_BUCKETS; i++)
+	{
+		uint64	n = hist->buckets[i];
+
+		if (n > 0 && cumulative + n >= target)
+		{
+			double	lower = (i == 0) ? 0 : (double) ((uint64) 1 << i);
+			double	upper = (double) ((uint64) 1 << (i + 1));
+
+			return (lower + (upper - lower) * (target - cumulative) / n) / 1000.0;
+		}
+		cumulative += n;
+	}
+
+	return (double) ((uint64) 1 << PGHA_HIST_BUCKETS) / 1000.0;
+}
+
+static void
+debug_show(void)
+{
+	PgHaNode *nodes;
+	int n_nodes;
+	int i;
+
+	nodes = snapshotNodes(&n_nodes, NULL);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		PgHaNode *n = &nodes[i];
+
+		elog(WARNING, "[%d] name = \"%s\", conn = \"%s\", type = \'%c\'",
+			 n->slotno, n->name, n->conninfo, n->type);
+	}
+
+	pfree(nodes);
+}
+
+Datum
+add_node(PG_FUNCTION_ARGS)
+{
+	text *name = PG_GETARG_TEXT_P(0);
+	text *conninfo = PG_GETARG_TEXT_P(1);
+	bool ret;
+
+	ret = addNode(text_to_cstring(name), text_to_cstring(conninfo), 's',
+				  false, false);
+
+	PG_RETURN_BOOL(ret);
+}
+
+Datum
+del_node(PG_FUNCTION_ARGS)
+{
+	text *name = PG_GETARG_TEXT_P(0);
+	bool ret;
+
+	ret = delNode(text_to_cstring(name), false);
+
+	PG_RETURN_BOOL(ret);
+}
+
+Datum
+join_node(PG_FUNCTION_ARGS)
+{
+#define RETURN_COLS 4
+
+	text *name = PG_GETARG_TEXT_P(0);
+	text *conninfo = PG_GETARG_TEXT_P(1);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	PgHaNode *nodes;
+	uint64 epoch;
+	int n_nodes;
+	int i;
+
+	if (!am_master())
+		ereport(ERROR, (errmsg("join_node can be executed only on master node")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	/*
+	 * Aadd a given node. Since re-started node might try to join again
+	 * this adding node ignore a duplication.
+	 */
+	addNode(text_to_cstring(name), text_to_cstring(conninfo), 's', false,
+			true);
+
+	nodes = snapshotNodes(&n_nodes, &epoch);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		PgHaNode *node = &nodes[i];
+		Datum		values[RETURN_COLS];
+		bool		nulls[RETURN_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(node->name);
+		values[1] = CStringGetTextDatum(node->conninfo);
+		values[2] = CharGetDatum(node->type);
+		values[3] = Int64GetDatum((int64) epoch);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(nodes);
+	tuplestore_donestoring(tupstore);
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return heartbeat statistics of all nodes. Latencies are in milliseconds.
+ */
+Datum
+node_stats(PG_FUNCTION_ARGS)
+{
+#define NODE_STATS_COLS 25
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	PgHaNode *nodes;
+	TimestampTz now = GetCurrentTimestamp();
+	int n_nodes;
+	int i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	nodes = snapshotNodes(&n_nodes, NULL);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		PgHaNode   *node = &nodes[i];
+		PgHaNodeStats stats = node->stats;
+		PgHaReplStatus repl = node->repl;
+		double		phi = computePhi(&node->arrivals, now);
+		int			retry_count = node->retry_count;
+		Datum		values[NODE_STATS_COLS];
+		bool		nulls[NODE_STATS_COLS];
+		int			j = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = CStringGetTextDatum(nodes[i].name);
+		values[j++] = Int32GetDatum(retry_count);
+		values[j++] = Int64GetDatum(stats.n_probes);
+		values[j++] = Int64GetDatum(stats.n_failures);
+
+		if (stats.last_success != 0)
+			values[j++] = TimestampTzGetDatum(stats.last_success);
+		else
+			nulls[j++] = true;
+
+		if (stats.last_connect_us >= 0)
+			values[j++] = Float8GetDatum(stats.last_connect_us / 1000.0);
+		else
+			nulls[j++] = true;
+
+		if (stats.connect_hist.count > 0)
+		{
+			values[j++] = Float8GetDatum(histPercentile(&stats.connect_hist, 0.50));
+			values[j++] = Float8GetDatum(histPercentile(&stats.connect_hist, 0.95));
+			values[j++] = Float8GetDatum(histPercentile(&stats.connect_hist, 0.99));
+		}
+		else
+		{
+			nulls[j++] = true;
+			nulls[j++] = true;
+			nulls[j++] = true;
+		}
+
+		if (stats.last_rtt_us >= 0)
+			values[j++] = Float8GetDatum(stats.last_rtt_us / 1000.0);
+		else
+			nulls[j++] = true;
+
+		if (stats.rtt_hist.count > 0)
+		{
+			values[j++] = Float8GetDatum(histPercentile(&stats.rtt_hist, 0.50));
+			values[j++] = Float8GetDatum(histPercentile(&stats.rtt_hist, 0.95));
+			values[j++] = Float8GetDatum(histPercentile(&stats.rtt_hist, 0.99));
+		}
+		else
+		{
+			nulls[j++] = true;
+			nulls[j++] = true;
+			nulls[j++] = true;
+		}
+
+		values[j++] = Int64GetDatum(stats.n_walsender_checks);
+		values[j++] = BoolGetDatum(repl.streaming);
+
+		if (repl.updated != 0 && repl.sent != InvalidXLogRecPtr)
+		{
+			values[j++] = LSNGetDatum(repl.sent);
+			values[j++] = LSNGetDatum(repl.write);
+			values[j++] = LSNGetDatum(repl.flush);
+			values[j++] = LSNGetDatum(repl.apply);
+			values[j++] = Int32GetDatum(repl.sync_priority);
+		}
+		else
+		{
+			nulls[j++] = true;
+			nulls[j++] = true;
+			nulls[j++] = true;
+			nulls[j++] = true;
+			nulls[j++] = true;
+		}
+
+		if (repl.write_lag >= 0 && repl.updated != 0)
+			values[j++] = Float8GetDatum(repl.write_lag / 1000.0);
+		else
+			nulls[j++] = true;
+
+		if (repl.flush_lag >= 0 && repl.updated != 0)
+			values[j++] = Float8GetDatum(repl.flush_lag / 1000.0);
+		else
+			nulls[j++] = true;
+
+		if (repl.apply_lag >= 0 && repl.updated != 0)
+			values[j++] = Float8GetDatum(repl.apply_lag / 1000.0);
+		else
+			nulls[j++] = true;
+
+		if (!nodes[i].myself)
+			values[j++] = Float8GetDatum(phi);
+		else
+			nulls[j++] = true;
+
+		values[j++] = BoolGetDatum(nodes[i].is_sync);
+
+		Assert(j == NODE_STATS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(nodes);
+	tuplestore_donestoring(tupstore);
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the membership changes made after the given epoch, each with the
+ * epoch it was made at. If they are no longer available, a row with op 'r'
+ * is returned first, meaning that the caller must replace its node list
+ * with the following rows.
+ */
+Datum
+membership_since(PG_FUNCTION_ARGS)
+{
+#define MEMBERSHIP_COLS 5
+
+	uint64		since = (uint64) PG_GETARG_INT64(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	PgHaNode	*nodes;
+	PgHaMembershipChange *changes;
+	Datum		values[MEMBERSHIP_COLS];
+	bool		nulls[MEMBERSHIP_COLS];
+	uint64		epoch;
+	int			n_nodes;
+	int			n_changes;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	changes = (PgHaMembershipChange *)
+		palloc(sizeof(PgHaMembershipChange) * PGHA_MEMBERSHIP_LOG_SIZE);
+
+	if (snapshotMembershipSince(since, &epoch, &nodes, &n_nodes,
+								changes, &n_changes))
+	{
+		memset(nulls, true, sizeof(nulls));
+		values[0] = Int64GetDatum((int64) epoch);
+		values[1] = CharGetDatum('r');
+		nulls[0] = nulls[1] = false;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		for (i = 0; i < n_nodes; i++)
+		{
+			memset(nulls, 0, sizeof(nulls));
+			values[0] = Int64GetDatum((int64) epoch);
+			values[1] = CharGetDatum('a');
+			values[2] = CStringGetTextDatum(nodes[i].name);
+			values[3] = CStringGetTextDatum(nodes[i].conninfo);
+			values[4] = CharGetDatum(nodes[i].type);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+	else
+	{
+		for (i = 0; i < n_changes; i++)
+		{
+			PgHaMembershipChange *change = &changes[i];
+
+			memset(nulls, 0, sizeof(nulls));
+			values[0] = Int64GetDatum((int64) change->epoch);
+			values[1] = CharGetDatum(change->op);
+			values[2] = CStringGetTextDatum(change->name);
+			values[3] = CStringGetTextDatum(change->conninfo);
+			values[4] = CharGetDatum(change->type);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	pfree(changes);
+	if (nodes != NULL)
+		pfree(nodes);
+	tuplestore_donestoring(tupstore);
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/* Return the current membership epoch */
+Datum
+membership_epoch(PG_FUNCTION_ARGS)
+{
+	uint64	epoch;
+
+	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+	epoch = PgHaCtl->epoch;
+	LWLockRelease(PgHaCtl->lock);
+
+	PG_RETURN_INT64((int64) epoch);
+}
+
+/*
+ * Return the time line of the last failover this node performed, and the
+ * duration of each phase in milliseconds.
+ */
+Datum
+failover_status(PG_FUNCTION_ARGS)
+{
+#define FAILOVER_STATUS_COLS 15
+
+	TupleDesc	tupdesc;
+	PgHaFailoverStatus status;
+	TimestampTz	*phases[7];
+	Datum		values[FAILOVER_STATUS_COLS];
+	bool		nulls[FAILOVER_STATUS_COLS];
+	int			i;
+	int			j = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	status = PgHaCtl->failover;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	if (status.failed_node[0] != '\0')
+		values[j++] = CStringGetTextDatum(status.failed_node);
+	else
+		nulls[j++] = true;
+
+	phases[0] = &status.last_contact;
+	phases[1] = &status.detected;
+	phases[2] = &status.decided;
+	phases[3] = &status.promote_requested;
+	phases[4] = &status.promoted;
+	phases[5] = &status.first_write;
+	phases[6] = &status.after_command_done;
+
+	for (i = 0; i < lengthof(phases); i++)
+	{
+		if (*phases[i] != 0)
+			values[j++] = TimestampTzGetDatum(*phases[i]);
+		else
+			nulls[j++] = true;
+	}
+
+	if (status.after_command_status >= 0)
+		values[j++] = Int32GetDatum(status.after_command_status);
+	else
+		nulls[j++] = true;
+
+	/*
+	 * Durations of the detect, decide, promote and first write phases, and
+	 * the total from the last contact to the first write.
+	 */
+	for (i = 0; i < 5; i++)
+	{
+		static const int from[] = {0, 1, 2, 4, 0};
+		static const int to[] = {1, 2, 4, 5, 5};
+		TimestampTz	start = *phases[from[i]];
+		TimestampTz	end = *phases[to[i]];
+
+		if (start != 0 && end != 0)
+			values[j++] = Float8GetDatum((end - start) / 1000.0);
+		else
+			nulls[j++] = true;
+	}
+
+	if (status.elected_node[0] != '\0')
+		values[j++] = CStringGetTextDatum(status.elected_node);
+	else
+		nulls[j++] = true;
+
+	Assert(j == FAILOVER_STATUS_COLS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Return the routing table last published by the main worker, for a pooler
+ * to balance reads among standbys.
+ */
+Datum
+routing_table(PG_FUNCTION_ARGS)
+{
+#define ROUTING_COLS 8
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	PgHaRoute  *routes;
+	uint64		generation;
+	int			n_routes;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	/* Copy the table not to hold the lock while building tuples */
+	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+	n_routes = PgHaCtl->n_routes;
+	generation = PgHaCtl->routes_generation;
+	routes = (PgHaRoute *) palloc(sizeof(PgHaRoute) * Max(n_routes, 1));
+	if (n_routes > 0)
+		memcpy(routes, dsa_get_address(getArea(), PgHaCtl->routes),
+			   sizeof(PgHaRoute) * n_routes);
+	LWLockRelease(PgHaCtl->lock);
+
+	for (i = 0; i < n_routes; i++)
+	{
+		PgHaRoute  *route = &routes[i];
+		Datum		values[ROUTING_COLS];
+		bool		nulls[ROUTING_COLS];
+		int			j = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = CStringGetTextDatum(route->name);
+		values[j++] = CStringGetTextDatum(route->conninfo);
+		values[j++] = CharGetDatum(route->type);
+		values[j++] = BoolGetDatum(route->healthy);
+
+		if (route->lag_bytes >= 0)
+			values[j++] = Int64GetDatum(route->lag_bytes);
+		else
+			nulls[j++] = true;
+
+		if (route->lag_us >= 0)
+			values[j++] = Float8GetDatum(route->lag_us / 1000.0);
+		else
+			nulls[j++] = true;
+
+		values[j++] = Int32GetDatum(route->weight);
+		values[j++] = Int64GetDatum((int64) generation);
+
+		Assert(j == ROUTING_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(routes);
+	tuplestore_donestoring(tupstore);
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the WAL position of this server, which is what a heartbeat asks
+ * for. Standbys compare them to elect the one to promote.
+ */
+Datum
+wal_position(PG_FUNCTION_ARGS)
+{
+#define WAL_POSITION_COLS 4
+
+	TupleDesc	tupdesc;
+	PgHaWalPosition pos;
+	Datum		values[WAL_POSITION_COLS];
+	bool		nulls[WAL_POSITION_COLS];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	getMyWalPosition(&pos);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = LSNGetDatum(pos.receive);
+	values[1] = LSNGetDatum(pos.replay);
+	values[2] = Int32GetDatum((int32) pos.timeline);
+	values[3] = Float8GetDatum(pos.replay_rate);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Return the time line of the last degradation to asynchronous replication,
+ * and how long commits were stalled, in milliseconds.
+ */
+Datum
+degrade_status(PG_FUNCTION_ARGS)
+{
+#define DEGRADE_STATUS_COLS 11
+
+	TupleDesc	tupdesc;
+	PgHaDegradeStatus status;
+	TimestampTz	*phases[4];
+	Datum		values[DEGRADE_STATUS_COLS];
+	bool		nulls[DEGRADE_STATUS_COLS];
+	int			i;
+	int			j = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	status = PgHaCtl->degrade;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	if (status.failed_node[0] != '\0')
+		values[j++] = CStringGetTextDatum(status.failed_node);
+	else
+		nulls[j++] = true;
+
+	phases[0] = &status.last_contact;
+	phases[1] = &status.detected;
+	phases[2] = &status.released;
+	phases[3] = &status.persisted;
+
+	for (i = 0; i < lengthof(phases); i++)
+	{
+		if (*phases[i] != 0)
+			values[j++] = TimestampTzGetDatum(*phases[i]);
+		else
+			nulls[j++] = true;
+	}
+
+	values[j++] = Int32GetDatum(status.n_released);
+	values[j++] = Int64GetDatum(status.n_degradations);
+
+	/*
+	 * Durations of the detect, release and persist phases, and the stall
+	 * from the last contact to the release.
+	 */
+	for (i = 0; i < 4; i++)
+	{
+		static const int from[] = {0, 1, 2, 0};
+		static const int to[] = {1, 2, 3, 2};
+		TimestampTz	start = *phases[from[i]];
+		TimestampTz	end = *phases[to[i]];
+
+		if (start != 0 && end != 0)
+			values[j++] = Float8GetDatum((end - start) / 1000.0);
+		else
+			nulls[j++] = true;
+	}
+
+	Assert(j == DEGRADE_STATUS_COLS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Return the heartbeat overhead of each worker: rounds, probes, connection
+ * attempts, and the round and CPU times in milliseconds.
+ */
+Datum
+worker_stats(PG_FUNCTION_ARGS)
+{
+#define WORKER_STATS_COLS 13
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	for (i = 0; i <= pgha_heartbeat_workers; i++)
+	{
+		PgHaWorkerStats stats;
+		Datum		values[WORKER_STATS_COLS];
+		bool		nulls[WORKER_STATS_COLS];
+		int			j = 0;
+
+		SpinLockAcquire(&PgHaCtl->mutex);
+		stats = PgHaCtl->workers[i];
+		SpinLockRelease(&PgHaCtl->mutex);
+
+		if (stats.pid == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = PointerGetDatum(workerName(i));
+		values[j++] = Int32GetDatum(stats.pid);
+		values[j++] = TimestampTzGetDatum(stats.started);
+		values[j++] = Int64GetDatum(stats.n_rounds);
+		values[j++] = Int64GetDatum(stats.n_probes);
+		values[j++] = Int64GetDatum(stats.n_probe_failures);
+		values[j++] = Int64GetDatum(stats.n_walsender_checks);
+		values[j++] = Int64GetDatum(stats.n_connects);
+
+		if (stats.n_rounds > 0)
+		{
+			values[j++] = Float8GetDatum(stats.last_round_us / 1000.0);
+			values[j++] = Float8GetDatum(stats.total_round_us / 1000.0 /
+										 stats.n_rounds);
+			values[j++] = Float8GetDatum(stats.max_round_us / 1000.0);
+		}
+		else
+		{
+			nulls[j++] = true;
+			nulls[j++] = true;
+			nulls[j++] = true;
+		}
+
+		values[j++] = Float8GetDatum(stats.user_cpu_us / 1000.0);
+		values[j++] = Float8GetDatum(stats.system_cpu_us / 1000.0);
+
+		Assert(j == WORKER_STATS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the time each worker has spent in each phase, in milliseconds,
+ * including the time in its current phase so far.
+ */
+Datum
+worker_phases(PG_FUNCTION_ARGS)
+{
+#define WORKER_PHASES_COLS 6
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	TimestampTz	now = GetCurrentTimestamp();
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	for (i = 0; i <= pgha_heartbeat_workers; i++)
+	{
+		PgHaWorkerStats stats;
+		text	   *name;
+		int			phase;
+
+		SpinLockAcquire(&PgHaCtl->mutex);
+		stats = PgHaCtl->workers[i];
+		SpinLockRelease(&PgHaCtl->mutex);
+
+		if (stats.pid == 0)
+			continue;
+
+		name = workerName(i);
+
+		for (phase = 0; phase < PGHA_NUM_PHASES; phase++)
+		{
+			Datum		values[WORKER_PHASES_COLS];
+			bool		nulls[WORKER_PHASES_COLS];
+			int64		usecs = stats.phase_us[phase];
+			int			j = 0;
+
+			if (phase == stats.phase)
+				usecs += now - stats.phase_start;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[j++] = PointerGetDatum(name);
+			values[j++] = Int32GetDatum(stats.pid);
+			values[j++] = CStringGetTextDatum(PgHaPhaseNames[phase]);
+			values[j++] = BoolGetDatum(phase == stats.phase);
+			values[j++] = Int64GetDatum(stats.phase_count[phase]);
+			values[j++] = Float8GetDatum(usecs / 1000.0);
+
+			Assert(j == WORKER_PHASES_COLS);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	tuplestore_donestoring(tupstore);
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the status of the last run of each action, with its duration in
+ * milliseconds.
+ */
+Datum
+action_status(PG_FUNCTION_ARGS)
+{
+#define ACTION_STATUS_COLS 9
+
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	TimestampTz	now = GetCurrentTimestamp();
+	int			kind;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) ||
+		rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Build tuplestore to hold the result rows */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	for (kind = 0; kind < PGHA_NUM_ACTIONS; kind++)
+	{
+		PgHaActionStatus action;
+		Datum		values[ACTION_STATUS_COLS];
+		bool		nulls[ACTION_STATUS_COLS];
+		int			j = 0;
+
+		SpinLockAcquire(&PgHaCtl->mutex);
+		action = PgHaCtl->actions[kind];
+		SpinLockRelease(&PgHaCtl->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = CStringGetTextDatum(PgHaActionNames[kind]);
+		values[j++] = BoolGetDatum(action.pid != 0);
+
+		if (action.pid != 0)
+			values[j++] = Int32GetDatum(action.pid);
+		else
+			nulls[j++] = true;
+
+		if (action.started != 0)
+			values[j++] = TimestampTzGetDatum(action.started);
+		else
+			nulls[j++] = true;
+
+		if (action.finished != 0)
+			values[j++] = TimestampTzGetDatum(action.finished);
+		else
+			nulls[j++] = true;
+
+		/* Duration so far if still running */
+		if (action.started != 0)
+			values[j++] = Float8GetDatum(((action.finished != 0 ?
+										   action.finished : now) -
+										  action.started) / 1000.0);
+		else
+			nulls[j++] = true;
+
+		if (action.exit_status >= 0)
+			values[j++] = Int32GetDatum(action.exit_status);
+		else
+			nulls[j++] = true;
+
+		values[j++] = BoolGetDatum(action.timed_out);
+		values[j++] = Int64GetDatum(action.n_runs);
+
+		Assert(j == ACTION_STATUS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/* Return the name of the given worker as shown by the SQL functions */
+static text *
+workerName(int workerno)
+{
+	if (workerno < pgha_heartbeat_workers)
+		return cstring_to_text(psprintf("heartbeat %d", workerno));
+
+	return cstring_to_text("main");
+}
+
+static
+bool PgHaMasterLoop(void)
+{
+	ereport(LOG, (errmsg("pgha : entered master mode")));
+
+	/* We no longer follow the old master, if we were a standby */
+	if (MasterConn != NULL)
+	{
+		PQfinish(MasterConn);
+		MasterConn = NULL;
+	}
+
+	while (!got_sigterm)
+	{
+		PgHaNode failed;
+		int		rc;
+		int		n_nodes;
+
+		setPhase(PGHA_PHASE_IDLE);
+
+		/*
+		 * Background workers mustn't call usleep() or any direct equivalent:
+		 * instead, they may wait on their process latch, which sleeps as
+		 * necessary, but is awakened if postmaster dies.  That way the
+		 * background process goes away immediately in an emergency.
+		 */
+		if (pgha_heartbeat_workers > 0)
+			next_heartbeat = nextSuspicion();
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   actionTimeout(heartbeatTimeout()), PG_WAIT_EXTENSION);
+		ResetLatch(&MyProc->procLatch);
+
+		/* Reap or time out the action processes */
+		superviseActions();
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			return false;
+
+		/* If got SIGHUP, reload the configuration file */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			setPhase(PGHA_PHASE_RELOAD);
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/*
+		 * Until the degradation is persisted, a reload of the old setting
+		 * may make commits wait again, so keep releasing them.
+		 */
+		if (degrade_pending)
+		{
+			setPhase(PGHA_PHASE_RECONFIGURE);
+			releaseSyncRepWaiters();
+			finishDegrade();
+		}
+
+		/*
+		 * Once we have degraded, commits don't wait any more even before
+		 * we reload the configuration.
+		 */
+		in_syncrep = SyncStandbysDefined() &&
+			((volatile WalSndCtlData *) WalSndCtl)->sync_standbys_defined;
+
+		/* get number of registered nodes. Always more than 1. */
+		n_nodes = get_hanode_count();
+
+		if (n_nodes > 1)
+		{
+			/* heartbeat to all nodes, unless heartbeat workers do it */
+			if (pgha_heartbeat_workers == 0)
+				doHeartbeat(0, 1);
+
+			/*
+			 * Check current cluster status if any of nodes is suspected
+			 * to have failed.
+			 */
+			setPhase(PGHA_PHASE_CHECK);
+
+			if (pgha_sync_quorum > 0)
+				manageSyncQuorum();
+			else if (in_syncrep && !checkClusterStatus(&failed))
+				changeToAsync(&failed);
+		}
+
+		publishRoutingTable();
+	}
+
+	return true;
+}
+
+/*
+ * Publish the routing table built from our view of the cluster in shared
+ * memory and in PGHA_ROUTING_FILE.
+ */
+static void
+publishRoutingTable(void)
+{
+	PgHaNode   *nodes;
+	PgHaRoute  *routes;
+	dsa_area   *area = getArea();
+	dsa_pointer	dp = InvalidDsaPointer;
+	dsa_pointer	old;
+	uint64		generation;
+	int			n_nodes;
+
+	setPhase(PGHA_PHASE_ROUTE);
+
+	nodes = snapshotNodes(&n_nodes, NULL);
+	routes = buildRoutes(nodes, n_nodes);
+
+	if (n_nodes > 0)
+	{
+		dp = dsa_allocate_extended(area, sizeof(PgHaRoute) * n_nodes,
+								   DSA_ALLOC_NO_OOM);
+		if (!DsaPointerIsValid(dp))
+		{
+			ereport(WARNING,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of dynamic shared memory"),
+					 errdetail("Failed to publish the routing table.")));
+			pfree(routes);
+			pfree(nodes);
+			return;
+		}
+		memcpy(dsa_get_address(area, dp), routes,
+			   sizeof(PgHaRoute) * n_nodes);
+	}
+
+	LWLockAcquire(PgHaCtl->lock, LW_EXCLUSIVE);
+	old = PgHaCtl->routes;
+	PgHaCtl->routes = dp;
+	PgHaCtl->n_routes = n_nodes;
+	generation = ++PgHaCtl->routes_generation;
+	LWLockRelease(PgHaCtl->lock);
+
+	/* Readers copy the table under the lock, so nobody sees the old one */
+	if (DsaPointerIsValid(old))
+		dsa_free(area, old);
+
+	writeRoutingFile(routes, n_nodes, generation);
+
+	pfree(routes);
+	pfree(nodes);
+}
+
+/*
+ * Build the routing table from a snapshot of the nodes.
+ *
+ * The replay lag of a standby is measured against the newest WAL position
+ * we know of: our own on the master, or the one the master reported to us
+ * on a standby. The master also learns it in time from the walsender.
+ *
+ * A standby is weighted linearly from 100 with no lag down to 1 at
+ * pgha.routing_max_lag. It gets no reads if suspected to have failed, or
+ * if its lag is unknown or beyond the limit. Neither does the master, as
+ * the table is for offloading reads from it.
+ */
+static PgHaRoute *
+buildRoutes(PgHaNode *nodes, int n_nodes)
+{
+	PgHaRoute  *routes;
+	PgHaWalPosition mine;
+	TimestampTz	now = GetCurrentTimestamp();
+	XLogRecPtr	newest;
+	int64		max_lag = (int64) pgha_routing_max_lag * 1024;
+	int			i;
+
+	routes = (PgHaRoute *) palloc0(sizeof(PgHaRoute) * Max(n_nodes, 1));
+
+	getMyWalPosition(&mine);
+	newest = mine.receive;
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		if (!nodes[i].myself && nodes[i].type == 'm' &&
+			nodes[i].wal.updated != 0)
+			newest = Max(newest, nodes[i].wal.receive);
+	}
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		PgHaNode   *node = &nodes[i];
+		PgHaRoute  *route = &routes[i];
+		XLogRecPtr	replay = InvalidXLogRecPtr;
+
+		strlcpy(route->name, node->name, NAMEDATALEN);
+		strlcpy(route->conninfo, node->conninfo, MAXPGPATH);
+		route->type = node->type;
+		route->healthy = node->myself ||
+			computePhi(&node->arrivals, now) < pgha_phi_threshold;
+		route->lag_bytes = -1;
+		route->lag_us = -1;
+
+		if (node->type == 'm')
+		{
+			route->lag_bytes = 0;
+			route->lag_us = 0;
+			continue;
+		}
+
+		if (node->myself)
+			replay = mine.replay;
+		else if (am_master() && node->repl.streaming)
+		{
+			replay = node->repl.apply;
+			route->lag_us = node->repl.apply_lag;
+		}
+		else if (node->wal.updated != 0)
+			replay = node->wal.replay;
+
+		if (replay != InvalidXLogRecPtr)
+			route->lag_bytes = (newest > replay) ? newest - replay : 0;
+
+		if (route->healthy && route->lag_bytes >= 0 &&
+			route->lag_bytes <= max_lag)
+			route->weight = 1 + (int32) (99 * (max_lag - route->lag_bytes) /
+										 max_lag);
+	}
+
+	return routes;
+}
+
+/* Write the routing table to PGHA_ROUTING_FILE */
+static void
+writeRoutingFile(PgHaRoute *routes, int n_routes, uint64 generation)
+{
+	PgHaRoutingHeader *hdr;
+	pg_crc32c	crc;
+	char	   *buf;
+	Size		len;
+
+	len = sizeof(PgHaRoutingHeader) + sizeof(PgHaRoute) * n_routes;
+	buf = palloc0(len);
+	hdr = (PgHaRoutingHeader *) buf;
+
+	hdr->magic = PGHA_ROUTING_MAGIC;
+	hdr->version = PGHA_ROUTING_VERSION;
+	hdr->entry_size = sizeof(PgHaRoute);
+	hdr->n_entries = n_routes;
+	hdr->generation = generation;
+	hdr->updated = GetCurrentTimestamp();
+	if (n_routes > 0)
+		memcpy(buf + sizeof(PgHaRoutingHeader), routes,
+			   sizeof(PgHaRoute) * n_routes);
+
+	/* Compute the CRC while hdr->crc is still zero */
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, buf, len);
+	FIN_CRC32C(crc);
+	hdr->crc = crc;
+
+	/* The table is rebuilt every round, so it needn't survive a crash */
+	writeFileAtomic(PGHA_ROUTING_FILE, buf, len, false);
+
+	pfree(buf);
+}
+
+/*
+ * Main loop of a standby. Join the cluster, monitor the master, and promote
+ * myself when it has failed.
+ */
+static bool
+PgHaStandbyLoop(void)
+{
+	bool	joined;
+	bool	suspected = false;
+	TimestampTz	detected = 0;
+
+	ereport(LOG, (errmsg("pgha : entered standby mode")));
+
+	/*
+	 * If we restored other nodes from the registry file, the master knows
+	 * us already. The first sync catches up with the changes made since.
+	 */
+	joined = (get_hanode_count() > 1);
+
+	while (!got_sigterm)
+	{
+		int		rc;
+		PgHaNode *nodes;
+		PgHaNode *master;
+		int		n_nodes;
+		double	phi;
+		PgHaNode *elected;
+		bool	changed;
+
+		setPhase(PGHA_PHASE_IDLE);
+
+		/* The heartbeat workers wake us up if a node stops answering */
+		if (pgha_heartbeat_workers > 0)
+			next_heartbeat = nextSuspicion();
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   actionTimeout(heartbeatTimeout()), PG_WAIT_EXTENSION);
+		ResetLatch(&MyProc->procLatch);
+
+		/* Reap or time out the action processes */
+		superviseActions();
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			return false;
+
+		/* If got SIGHUP, reload the configuration file */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			setPhase(PGHA_PHASE_RELOAD);
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/* Promoted by someone else, e.g. by pg_ctl promote */
+		if (am_master())
+		{
+			SpinLockAcquire(&PgHaCtl->mutex);
+			PgHaCtl->failover.electing = false;
+			SpinLockRelease(&PgHaCtl->mutex);
+
+			updateNode(pgha_node_name, NULL, 'm');
+			return PgHaMasterLoop();
+		}
+
+		if (!joined && !(joined = joinCluster()))
+			continue;
+
+		if (pgha_heartbeat_workers == 0)
+			doHeartbeat(0, 1);
+
+		measureReplayRate();
+		publishRoutingTable();
+
+		setPhase(PGHA_PHASE_CHECK);
+
+		nodes = snapshotNodes(&n_nodes, NULL);
+
+		master = getMasterNode(nodes, n_nodes);
+		if (master == NULL)
+		{
+			pfree(nodes);
+			continue;
+		}
+
+		phi = getNodePhi(master, GetCurrentTimestamp());
+
+		if (phi < pgha_phi_threshold)
+		{
+			if (suspected)
+			{
+				SpinLockAcquire(&PgHaCtl->mutex);
+				PgHaCtl->failover.electing = false;
+				SpinLockRelease(&PgHaCtl->mutex);
+				suspected = false;
+			}
+			pfree(nodes);
+
+			/* Catch up with membership changes made on the master */
+			if (!syncMembership())
+				joined = false;
+			continue;
+		}
+
+		/* Start a new failover time line when we first suspect the master */
+		if (!suspected)
+		{
+			detected = GetCurrentTimestamp();
+
+			SpinLockAcquire(&PgHaCtl->mutex);
+			memset(&PgHaCtl->failover, 0, sizeof(PgHaFailoverStatus));
+			strlcpy(PgHaCtl->failover.failed_node, master->name, NAMEDATALEN);
+			PgHaCtl->failover.last_contact = master->arrivals.last_arrival;
+			PgHaCtl->failover.detected = detected;
+			PgHaCtl->failover.after_command_status = -1;
+			PgHaCtl->failover.electing = true;
+			SpinLockRelease(&PgHaCtl->mutex);
+
+			ereport(LOG,
+					(errmsg("pgha: master \"%s\" is suspected to have failed (phi = %.2f)",
+							master->name, phi)));
+			suspected = true;
+
+			/* Have the other standbys report their WAL positions */
+			wakeWorkers();
+		}
+
+		if (!decideFailover(master))
+		{
+			pfree(nodes);
+			continue;
+		}
+
+		/* Only the most advanced standby promotes */
+		if ((elected = electStandby(nodes, n_nodes, detected)) == NULL)
+		{
+			pfree(nodes);
+			continue;
+		}
+
+		SpinLockAcquire(&PgHaCtl->mutex);
+		changed = (strcmp(PgHaCtl->failover.elected_node, elected->name) != 0);
+		strlcpy(PgHaCtl->failover.elected_node, elected->name, NAMEDATALEN);
+		SpinLockRelease(&PgHaCtl->mutex);
+
+		if (changed)
+			ereport(LOG,
+					(errmsg("pgha: standby \"%s\" is elected to replace master \"%s\"",
+							elected->name, master->name),
+					 errdetail("Timeline %u, received up to %X/%X, replay rate %.0f bytes/s.",
+							   elected->wal.timeline,
+							   (uint32) (elected->wal.receive >> 32),
+							   (uint32) elected->wal.receive,
+							   elected->wal.replay_rate)));
+
+		if (elected->myself)
+		{
+			recordFailoverPhase(&PgHaCtl->failover.decided);
+
+			if (promoteMyself(master))
+			{
+				SpinLockAcquire(&PgHaCtl->mutex);
+				PgHaCtl->failover.electing = false;
+				SpinLockRelease(&PgHaCtl->mutex);
+
+				pfree(nodes);
+				return PgHaMasterLoop();
+			}
+		}
+
+		pfree(nodes);
+	}
+
+	return true;
+}
+
+/*
+ * Register myself on the master, and learn the other nodes from it.
+ */
+static bool
+joinCluster(void)
+{
+	PGconn		*conn;
+	PGresult	*res;
+	const char	*params[2];
+	int			i;
+
+	setPhase(PGHA_PHASE_SYNC);
+
+	if ((conn = connectMaster()) == NULL)
+		return false;
+
+	params[0] = pgha_node_name;
+	params[1] = pgha_my_conninfo;
+	res = execMaster(conn,
+					 "SELECT name, conninfo, type, epoch FROM pgha.join_node($1, $2)",
+					 2, params);
+
+	if (res == NULL)
+	{
+		PQfinish(conn);
+		return false;
+	}
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		ereport(LOG,
+				(errmsg("could not join the cluster : %s",
+						PQerrorMessage(conn))));
+		PQclear(res);
+		PQfinish(conn);
+		return false;
+	}
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		char	*name = PQgetvalue(res, i, 0);
+
+		membership_epoch = strtoull(PQgetvalue(res, i, 3), NULL, 10);
+
+		if (strcmp(name, pgha_node_name) == 0)
+			continue;
+
+		addNode(name, PQgetvalue(res, i, 1), PQgetvalue(res, i, 2)[0],
+				false, true);
+	}
+
+	PQclear(res);
+
+	/* Keep the connection to sync membership changes later */
+	MasterConn = conn;
+
+	ereport(LOG, (errmsg("pgha: joined the cluster")));
+
+	return true;
+}
+
+/*
+ * Connect to the master. The connection attempt is bounded by
+ * pgha.heartbeat_timeout, though libpq doesn't wait less than 2 seconds.
+ *
+ * The connection is kept between the queries, so TCP keepalives are sent
+ * over it to notice a master that went away while it was idle, and the
+ * master gives up the queries we have stopped waiting for, see
+ * execMaster().
+ */
+static PGconn *
+connectMaster(void)
+{
+	const char *keywords[8];
+	const char *values[8];
+	char		timeout[16];
+	char		idle[16];
+	char		count[16];
+	char		options[64];
+	PGconn		*conn;
+
+	snprintf(timeout, sizeof(timeout), "%d",
+			 Max((pgha_heartbeat_timeout + 999) / 1000, 2));
+	snprintf(idle, sizeof(idle), "%d", pgha_keepalives_time);
+	snprintf(count, sizeof(count), "%d", Max(pgha_retry_count, 1));
+	snprintf(options, sizeof(options), "-c statement_timeout=%d",
+			 pgha_heartbeat_timeout);
+
+	keywords[0] = "dbname";
+	values[0] = pgha_master_conninfo;
+	keywords[1] = "connect_timeout";
+	values[1] = timeout;
+	keywords[2] = "keepalives";
+	values[2] = "1";
+	keywords[3] = "keepalives_idle";
+	values[3] = idle;
+	keywords[4] = "keepalives_interval";
+	values[4] = "1";
+	keywords[5] = "keepalives_count";
+	values[5] = count;
+	keywords[6] = "options";
+	values[6] = options;
+	keywords[7] = NULL;
+	values[7] = NULL;
+
+	conn = PQconnectdbParams(keywords, values, true);
+
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		ereport(LOG,
+				(errmsg("could not connect to master : %s",
+						PQerrorMessage(conn))));
+		PQfinish(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/*
+ * Run a query on the master, waiting for the result no longer than
+ * pgha.heartbeat_timeout as doHeartbeat() does, so that an unresponsive
+ * master doesn't hold up failure detection. Returns the last result, or
+ * NULL if the query couldn't be sent or timed out, after which the
+ * connection must be closed.
+ */
+static PGresult *
+execMaster(PGconn *conn, const char *query, int n_params,
+		   const char *const *params)
+{
+	TimestampTz	deadline;
+	PGresult	*res = NULL;
+	PGresult	*next;
+	bool		latch_set = false;
+
+	if (!PQsendQueryParams(conn, query, n_params, NULL, params, NULL, NULL, 0))
+	{
+		ereport(LOG,
+				(errmsg("could not send query to master : %s",
+						PQerrorMessage(conn))));
+		return NULL;
+	}
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										   pgha_heartbeat_timeout);
+
+	for (;;)
+	{
+		TimestampTz	now = GetCurrentTimestamp();
+		int			flush = PQflush(conn);
+		long		secs;
+		int			usecs;
+		int			rc;
+
+		if (flush == 0 && !PQisBusy(conn))
+		{
+			next = PQgetResult(conn);
+			if (next == NULL)
+				break;
+			PQclear(res);
+			res = next;
+			continue;
+		}
+
+		if (flush < 0 || now >= deadline || got_sigterm)
+		{
+			if (flush < 0)
+				ereport(LOG,
+						(errmsg("could not send query to master : %s",
+								PQerrorMessage(conn))));
+			else if (now >= deadline)
+				ereport(LOG,
+						(errmsg("query to master timed out")));
+			PQclear(res);
+			res = NULL;
+			break;
+		}
+
+		TimestampDifference(now, deadline, &secs, &usecs);
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   WL_LATCH_SET | WL_POSTMASTER_DEATH |
+							   WL_TIMEOUT | WL_SOCKET_READABLE |
+							   (flush > 0 ? WL_SOCKET_WRITEABLE : 0),
+							   PQsocket(conn),
+							   secs * 1000L + usecs / 1000 + 1,
+							   PG_WAIT_EXTENSION);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (rc & WL_LATCH_SET)
+		{
+			ResetLatch(&MyProc->procLatch);
+			latch_set = true;
+		}
+
+		if ((rc & WL_SOCKET_READABLE) && !PQconsumeInput(conn))
+		{
+			ereport(LOG,
+					(errmsg("could not receive result from master : %s",
+							PQerrorMessage(conn))));
+			PQclear(res);
+			res = NULL;
+			break;
+		}
+	}
+
+	/* Let the main loop see what woke us up meanwhile */
+	if (latch_set)
+		SetLatch(&MyProc->procLatch);
+
+	return res;
+}
+
+/*
+ * Apply the membership changes made on the master since the epoch we last
+ * synced to. This normally costs a query returning no rows.
+ *
+ * Returns false if the master turns out not to know us, so that we join
+ * again.
+ */
+static bool
+syncMembership(void)
+{
+	PGresult	*res;
+	const char	*params[1];
+	char		since[32];
+	List		*reset_names = NIL;
+	bool		reset = false;
+	bool		known = true;
+	int			i;
+
+	setPhase(PGHA_PHASE_SYNC);
+
+	if (MasterConn != NULL && PQstatus(MasterConn) != CONNECTION_OK)
+	{
+		PQfinish(MasterConn);
+		MasterConn = NULL;
+	}
+
+	if (MasterConn == NULL && (MasterConn = connectMaster()) == NULL)
+		return true;
+
+	snprintf(since, sizeof(since), UINT64_FORMAT, membership_epoch);
+	params[0] = since;
+	res = execMaster(MasterConn,
+					 "SELECT epoch, op, name, conninfo, type FROM pgha.membership_since($1)",
+					 1, params);
+
+	if (res == NULL)
+	{
+		PQfinish(MasterConn);
+		MasterConn = NULL;
+		return true;
+	}
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		ereport(LOG,
+				(errmsg("could not get membership changes from master : %s",
+						PQerrorMessage(MasterConn))));
+		PQclear(res);
+		PQfinish(MasterConn);
+		MasterConn = NULL;
+		return true;
+	}
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		char	op = PQgetvalue(res, i, 1)[0];
+		char	*name = PQgetvalue(res, i, 2);
+
+		membership_epoch = strtoull(PQgetvalue(res, i, 0), NULL, 10);
+
+		if (op == 'r')
+		{
+			reset = true;
+			known = false;
+			continue;
+		}
+
+		if (strcmp(name, pgha_node_name) == 0)
+		{
+			known = (op == 'a');
+			continue;
+		}
+
+		if (op == 'a')
+		{
+			char	*conninfo = PQgetvalue(res, i, 3);
+			char	type = PQgetvalue(res, i, 4)[0];
+
+			if (!updateNode(name, conninfo, type))
+				addNode(name, conninfo, type, false, true);
+
+			if (reset)
+				reset_names = lappend(reset_names, pstrdup(name));
+		}
+		else if (op == 'd')
+			delNode(name, true);
+	}
+
+	PQclear(res);
+
+	/* On reset, forget the nodes that the master no longer knows */
+	if (reset)
+	{
+		PgHaNode *nodes;
+		int		n_nodes;
+
+		nodes = snapshotNodes(&n_nodes, NULL);
+
+		for (i = 0; i < n_nodes; i++)
+		{
+			ListCell *lc;
+			bool	found = false;
+
+			if (nodes[i].myself)
+				continue;
+
+			foreach(lc, reset_names)
+			{
+				if (strcmp((char *) lfirst(lc), nodes[i].name) == 0)
+				{
+					found = true;
+					break;
+				}
+			}
+
+			if (!found)
+				delNode(nodes[i].name, true);
+		}
+
+		pfree(nodes);
+		list_free_deep(reset_names);
+	}
+
+	return known;
+}
+
+/* Return the master node in the given snapshot, or NULL if none */
+static PgHaNode *
+getMasterNode(PgHaNode *nodes, int n_nodes)
+{
+	int		i;
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		if (!nodes[i].myself && nodes[i].type == 'm')
+			return &nodes[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Decide whether to promote after the master was suspected. It must have
+ * missed pgha.retry_count heartbeats in a row, and our walreceiver must not
+ * have heard from it since its last successful heartbeat: if WAL is still
+ * streaming, only the heartbeat path is broken and promoting would lead to
+ * split brain.
+ */
+static bool
+decideFailover(PgHaNode *master)
+{
+	PgHaNode *node;
+	WalRcvData *walrcv = WalRcv;
+	TimestampTz	last_arrival;
+	TimestampTz	last_msg;
+	int		retry_count;
+	bool	streaming;
+
+	/* The master has been removed meanwhile */
+	if ((node = acquireNode(master)) == NULL)
+		return false;
+	retry_count = node->retry_count;
+	last_arrival = node->arrivals.last_arrival;
+	releaseNode(node);
+
+	if (retry_count < pgha_retry_count)
+		return false;
+
+	SpinLockAcquire(&walrcv->mutex);
+	streaming = (walrcv->walRcvState == WALRCV_STREAMING);
+	last_msg = walrcv->lastMsgReceiptTime;
+	SpinLockRelease(&walrcv->mutex);
+
+	if (streaming && last_msg > last_arrival)
+	{
+		ereport(LOG,
+				(errmsg("pgha: master \"%s\" doesn't respond to heartbeats but WAL is still streaming from it",
+						master->name)));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Sample the replay rate of this standby. Only intervals throughout which
+ * WAL was waiting to be replayed are sampled, since a standby that has
+ * caught up replays only as fast as WAL arrives, which says nothing about
+ * how fast it would finish recovery after a failover.
+ */
+static void
+measureReplayRate(void)
+{
+	PgHaReplayRate *replay = &PgHaCtl->replay;
+	TimestampTz	now = GetCurrentTimestamp();
+	XLogRecPtr	received = GetWalRcvWriteRecPtr(NULL, NULL);
+	XLogRecPtr	replayed = GetXLogReplayRecPtr(NULL);
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+
+	if (replay->last_sample != 0 &&
+		now - replay->last_sample < USECS_PER_SEC)
+	{
+		/* Too short to measure */
+		SpinLockRelease(&PgHaCtl->mutex);
+		return;
+	}
+
+	if (replay->last_sample != 0 &&
+		replay->last_receive > replay->last_replay &&
+		received > replayed && replayed >= replay->last_replay)
+	{
+		double	secs = (now - replay->last_sample) / (double) USECS_PER_SEC;
+		double	rate = (replayed - replay->last_replay) / secs;
+
+		if (replay->rate == 0)
+			replay->rate = rate;
+		else
+			replay->rate += PGHA_REPLAY_RATE_WEIGHT * (rate - replay->rate);
+	}
+
+	replay->last_sample = now;
+	replay->last_receive = received;
+	replay->last_replay = replayed;
+
+	SpinLockRelease(&PgHaCtl->mutex);
+}
+
+/*
+ * Elect the standby to replace the failed master among the surviving ones.
+ * See compareWalPositions() for the order. Our own position is taken now,
+ * and those of the others are the latest reported in heartbeats.
+ *
+ * Returns NULL while a surviving standby hasn't reported its position since
+ * the election started at the given time, since it may have received more
+ * WAL before the master failed. That is waited for only until
+ * PGHA_ELECTION_WAIT_ROUNDS heartbeats should have got an answer, after
+ * which the standbys that haven't reported can't be elected. Standbys
+ * that answer heartbeats without their WAL position, e.g. as they lack
+ * the extension, can't be elected either.
+ */
+static PgHaNode *
+electStandby(PgHaNode *nodes, int n_nodes, TimestampTz since)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+	TimestampTz	deadline;
+	PgHaNode   *elected = NULL;
+	int			i;
+
+	deadline = TimestampTzPlusMilliseconds(since,
+										   pgha_heartbeat_timeout +
+										   PGHA_ELECTION_WAIT_ROUNDS *
+										   pgha_min_keepalives_time);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		PgHaNode   *node = &nodes[i];
+
+		if (node->type != 's')
+			continue;
+
+		if (node->myself)
+			getMyWalPosition(&node->wal);
+		else
+		{
+			/* Failed standbys can't take over */
+			if (computePhi(&node->arrivals, now) >= pgha_phi_threshold)
+				continue;
+
+			if (node->wal.unavailable)
+				continue;
+
+			if (node->wal.updated < since)
+			{
+				if (now < deadline)
+					return NULL;
+				continue;
+			}
+		}
+
+		if (elected == NULL || compareWalPositions(node, elected) > 0)
+			elected = node;
+	}
+
+	return elected;
+}
+
+/*
+ * Return positive if standby a is more suitable to promote than b. The one
+ * on the latest timeline that has received the most WAL loses the fewest
+ * transactions. Among equals, the one replaying the fastest finishes
+ * recovery and accepts writes the soonest. The name breaks the remaining
+ * ties so that every standby elects the same one.
+ */
+static int
+compareWalPositions(PgHaNode *a, PgHaNode *b)
+{
+	double	rate_a = a->wal.replay_rate;
+	double	rate_b = b->wal.replay_rate;
+
+	if (a->wal.timeline != b->wal.timeline)
+		return (a->wal.timeline > b->wal.timeline) ? 1 : -1;
+
+	if (a->wal.receive != b->wal.receive)
+		return (a->wal.receive > b->wal.receive) ? 1 : -1;
+
+	if (fabs(rate_a - rate_b) >
+		PGHA_REPLAY_RATE_TOLERANCE * Max(rate_a, rate_b))
+		return (rate_a > rate_b) ? 1 : -1;
+
+	return strcmp(b->name, a->name);
+}
+
+/*
+ * Promote myself and wait until it can accept writes, then run
+ * pgha.after_command. Each phase is recorded in PgHaCtl->failover.
+ */
+static bool
+promoteMyself(PgHaNode *master)
+{
+	PgHaFailoverStatus status;
+	FILE	*fd;
+
+	setPhase(PGHA_PHASE_PROMOTE);
+
+	ereport(LOG,
+			(errmsg("pgha: promoting to replace master \"%s\"", master->name)));
+
+	/* Same as what pg_ctl promote does */
+	if ((fd = AllocateFile(PGHA_PROMOTE_SIGNAL_FILE, "w")) == NULL ||
+		FreeFile(fd) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m",
+						PGHA_PROMOTE_SIGNAL_FILE)));
+		return false;
+	}
+
+	if (kill(PostmasterPid, SIGUSR1) != 0)
+	{
+		ereport(LOG, (errmsg("pgha: failed to send SIGUSR1 to postmaster")));
+		return false;
+	}
+
+	recordFailoverPhase(&PgHaCtl->failover.promote_requested);
+
+	/* Wait for the end of recovery */
+	while (RecoveryInProgress())
+	{
+		int		rc;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   10L, PG_WAIT_EXTENSION);
+		ResetLatch(&MyProc->procLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sigterm)
+			return false;
+	}
+
+	recordFailoverPhase(&PgHaCtl->failover.promoted);
+
+	/*
+	 * Confirm that a write is accepted. Don't wait for a synchronous
+	 * standby, which we might not have yet.
+	 */
+	SetConfigOption("synchronous_commit", "local", PGC_SUSET, PGC_S_OVERRIDE);
+	StartTransactionCommand();
+	(void) GetTopTransactionId();
+	CommitTransactionCommand();
+
+	recordFailoverPhase(&PgHaCtl->failover.first_write);
+
+	updateNode(master->name, NULL, 's');
+	updateNode(pgha_node_name, NULL, 'm');
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	status = PgHaCtl->failover;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	ereport(LOG,
+			(errmsg("pgha: promoted, detect %.3f ms, decide %.3f ms, promote %.3f ms, first write %.3f ms",
+					(status.detected - status.last_contact) / 1000.0,
+					(status.decided - status.detected) / 1000.0,
+					(status.promoted - status.decided) / 1000.0,
+					(status.first_write - status.promoted) / 1000.0)));
+
+	/* Don't let monitoring wait for the client cutover, nor vice versa */
+	startAction(PGHA_ACTION_PROMOTE, pgha_after_command);
+
+	return true;
+}
+
+/* Record the current time as the given phase of PgHaCtl->failover */
+static void
+recordFailoverPhase(TimestampTz *phase)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	*phase = now;
+	SpinLockRelease(&PgHaCtl->mutex);
+}
+
+/*
+ * Run the command of the given action in a child process, without waiting
+ * for it; superviseActions() reaps it. The child gets its own process
+ * group so that a timeout also kills whatever the command has started.
+ */
+static void
+startAction(PgHaActionKind kind, const char *command)
+{
+	PgHaActionStatus *action = &PgHaCtl->actions[kind];
+	TimestampTz	now;
+	pid_t		pid;
+
+	if (command == NULL || command[0] == '\0')
+		return;
+
+	if (action_pids[kind] != 0)
+	{
+		ereport(LOG,
+				(errmsg("pgha: %s command is still running, not starting it again",
+						PgHaActionNames[kind])));
+		return;
+	}
+
+	ereport(LOG,
+			(errmsg("pgha: executing %s command \"%s\"",
+					PgHaActionNames[kind], command)));
+
+	if ((pid = fork_process()) == 0)
+	{
+		/* in child */
+		(void) setsid();
+		pqsignal(SIGPIPE, SIG_DFL);
+		PG_SETMASK(&UnBlockSig);
+
+		execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+		_exit(127);
+	}
+
+	if (pid < 0)
+	{
+		ereport(LOG,
+				(errmsg("pgha: could not fork %s command: %m",
+						PgHaActionNames[kind])));
+		return;
+	}
+
+	now = GetCurrentTimestamp();
+
+	action_pids[kind] = pid;
+	action_killed[kind] = false;
+	action_deadlines[kind] = (pgha_action_timeout > 0) ?
+		TimestampTzPlusMilliseconds(now, pgha_action_timeout * 1000L) : 0;
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	action->pid = pid;
+	action->started = now;
+	action->finished = 0;
+	action->exit_status = -1;
+	action->timed_out = false;
+	action->n_runs++;
+	SpinLockRelease(&PgHaCtl->mutex);
+}
+
+/*
+ * Reap the action processes that have exited, and kill the ones running
+ * past pgha.action_timeout. Called by the main loops, which SIGCHLD wakes.
+ */
+static void
+superviseActions(void)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+	int			kind;
+
+	for (kind = 0; kind < PGHA_NUM_ACTIONS; kind++)
+	{
+		pid_t	pid = action_pids[kind];
+		pid_t	rc;
+		int		status;
+
+		if (pid == 0)
+			continue;
+
+		rc = waitpid(pid, &status, WNOHANG);
+		if (rc == pid)
+		{
+			finishAction(kind, status, now);
+			continue;
+		}
+		else if (rc < 0 && errno != EINTR)
+		{
+			ereport(LOG,
+					(errmsg("pgha: could not wait for %s command: %m",
+							PgHaActionNames[kind])));
+			finishAction(kind, -1, now);
+			continue;
+		}
+
+		if (!action_killed[kind] && action_deadlines[kind] != 0 &&
+			now >= action_deadlines[kind])
+		{
+			ereport(LOG,
+					(errmsg("pgha: %s command timed out, killing it",
+							PgHaActionNames[kind])));
+
+			(void) kill(-pid, SIGKILL);
+			action_killed[kind] = true;
+
+			SpinLockAcquire(&PgHaCtl->mutex);
+			PgHaCtl->actions[kind].timed_out = true;
+			SpinLockRelease(&PgHaCtl->mutex);
+		}
+	}
+}
+
+/* Record the wait status of an action process, or -1 if unknown */
+static void
+finishAction(PgHaActionKind kind, int status, TimestampTz now)
+{
+	PgHaActionStatus *action = &PgHaCtl->actions[kind];
+	int		exit_status;
+
+	if (status == -1)
+		exit_status = 127;
+	else if (WIFEXITED(status))
+		exit_status = WEXITSTATUS(status);
+	else
+		exit_status = 128 + WTERMSIG(status);
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	action->pid = 0;
+	action->finished = now;
+	action->exit_status = exit_status;
+	if (kind == PGHA_ACTION_PROMOTE)
+	{
+		PgHaCtl->failover.after_command_status = exit_status;
+		PgHaCtl->failover.after_command_done = now;
+	}
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	ereport(exit_status == 0 ? LOG : WARNING,
+			(errmsg("pgha: %s command finished with status %d in %.3f ms",
+					PgHaActionNames[kind], exit_status,
+					(now - action->started) / 1000.0)));
+
+	action_pids[kind] = 0;
+}
+
+/*
+ * Shorten the given sleep time in milliseconds so that we wake up at the
+ * timeout of a running action.
+ */
+static long
+actionTimeout(long timeout)
+{
+	TimestampTz	now = 0;
+	int			kind;
+
+	for (kind = 0; kind < PGHA_NUM_ACTIONS; kind++)
+	{
+		long	secs;
+		int		usecs;
+
+		if (action_pids[kind] == 0 || action_killed[kind] ||
+			action_deadlines[kind] == 0)
+			continue;
+
+		if (now == 0)
+			now = GetCurrentTimestamp();
+
+		TimestampDifference(now, action_deadlines[kind], &secs, &usecs);
+		timeout = Min(timeout, secs * 1000L + usecs / 1000 + 1);
+	}
+
+	return timeout;
+}
+
+/*
+ * Send a heartbeat to the nodes that are due.
+ *
+ * Probes to all due nodes are started at once and multiplexed on a single
+ * WaitEventSet, so a round takes about one round trip regardless of the
+ * number of nodes, and an unresponsive node costs no more than
+ * pgha.heartbeat_timeout. No lock is held during the I/O.
+ *
+ * Each node has its own interval, see scheduleNextProbe(), and the nodes
+ * are kept in a heap by their next due time. The time the next node is due
+ * is left in next_heartbeat for the caller to sleep until.
+ *
+ * With heartbeat workers, only the nodes of the given shard are probed.
+ */
+static void
+doHeartbeat(int shard, int n_shards)
+{
+	PgHaNode	*nodes;
+	PgHaProbe	*probes;
+	PgHaConn	**due;
+	PgHaWalSndInfo *walsnds;
+	TimestampTz	start = GetCurrentTimestamp();
+	TimestampTz	now;
+	TimestampTz	election;
+	uint64		epoch;
+	int			n_nodes;
+	int			n_walsnds;
+	int			n_due = 0;
+	int			n_checked = 0;
+	int			n_done = 0;
+	int			n_failures = 0;
+	int			n_slow = 0;
+	int			i;
+
+	round_connects = 0;
+
+	setPhase(PGHA_PHASE_COLLECT);
+
+	/* Work on a private copy so as not to block membership changes */
+	nodes = snapshotNodes(&n_nodes, &epoch);
+	probes = (PgHaProbe *) palloc0(sizeof(PgHaProbe) * Max(n_nodes, 1));
+	due = (PgHaConn **) palloc(sizeof(PgHaConn *) * Max(n_nodes, 1));
+	walsnds = (PgHaWalSndInfo *)
+		palloc(sizeof(PgHaWalSndInfo) * Max(max_wal_senders, 1));
+
+	if (PgHaSchedule == NULL || epoch != schedule_epoch ||
+		am_master() != schedule_as_master)
+		rebuildSchedule(nodes, n_nodes, epoch, shard, n_shards);
+
+	/*
+	 * When an election starts, ask the other standbys for their WAL
+	 * positions at once rather than when they are next due.
+	 */
+	election = electionStart();
+	if (election != 0 && election != schedule_election)
+	{
+		for (i = 0; i < PgHaSchedule->bh_size; i++)
+		{
+			PgHaConn *pconn = (PgHaConn *)
+				DatumGetPointer(PgHaSchedule->bh_nodes[i]);
+
+			if (nodes[pconn->snap_index].type == 's')
+				pconn->next_due = Min(pconn->next_due, start);
+		}
+		binaryheap_build(PgHaSchedule);
+	}
+	schedule_election = election;
+	round_electing = (election != 0);
+
+	/*
+	 * Standbys streaming from us can be checked without any connection,
+	 * but not during an election, which needs their own WAL positions.
+	 * Their replication status is refreshed either way, so that it is
+	 * cleared once their walsender has gone.
+	 */
+	n_walsnds = collectWalSenders(walsnds);
+
+	/* Take the nodes that are due */
+	while (!binaryheap_empty(PgHaSchedule))
+	{
+		PgHaConn *pconn = (PgHaConn *) DatumGetPointer(binaryheap_first(PgHaSchedule));
+
+		if (pconn->next_due > start)
+			break;
+
+		(void) binaryheap_remove_first(PgHaSchedule);
+		due[n_due++] = pconn;
+	}
+
+	for (i = 0; i < n_due; i++)
+	{
+		PgHaConn *pconn = due[i];
+		PgHaNode *node = &nodes[pconn->snap_index];
+		PgHaProbe *probe = &probes[i];
+
+		PgHaWalSndInfo *info = NULL;
+		int			j;
+
+		for (j = 0; j < n_walsnds; j++)
+		{
+			if (strcmp(walsnds[j].appname, node->name) == 0)
+			{
+				info = &walsnds[j];
+				break;
+			}
+		}
+
+		/* Counts as a prompt answer if the walsender proves it alive */
+		probe->node = node;
+		probe->ok = true;
+		if (updateNodeFromWalSender(node, info, nextProbeInterval(pconn, probe),
+									!round_electing))
+		{
+			probe->skipped = true;
+			probe->state = PGHA_PROBE_DONE;
+			n_checked++;
+			continue;
+		}
+
+		startProbe(probe, node, pconn);
+	}
+
+	waitForProbes(probes, n_due);
+
+	setPhase(PGHA_PHASE_RECORD);
+
+	now = GetCurrentTimestamp();
+
+	for (i = 0; i < n_due; i++)
+	{
+		PgHaProbe *probe = &probes[i];
+
+		/* The arrival is recorded with the interval to the next heartbeat */
+		scheduleNextProbe(due[i], probe, now);
+		binaryheap_add(PgHaSchedule, PointerGetDatum(due[i]));
+
+		if (probe->pconn != NULL && !probe->skipped)
+		{
+			updateNodeHealth(probe);
+
+			n_done++;
+			if (!probe->ok)
+				n_failures++;
+			else if (isSlowProbe(probe))
+				n_slow++;
+		}
+	}
+
+	/*
+	 * The main worker sleeps until a node would become suspected, see
+	 * nextSuspicion(). Have it look at the nodes now if one might be
+	 * failing, as it can't tell from the arrivals before then.
+	 */
+	if (pgha_heartbeat_workers > 0 && (n_failures > 0 || n_slow > 0))
+		wakeMainWorker();
+
+	if (binaryheap_empty(PgHaSchedule))
+		next_heartbeat = 0;
+	else
+		next_heartbeat = ((PgHaConn *)
+						  DatumGetPointer(binaryheap_first(PgHaSchedule)))->next_due;
+
+	reportWorkerStats(start, n_done, n_failures, n_checked);
+
+	pfree(walsnds);
+	pfree(due);
+	pfree(probes);
+	pfree(nodes);
+}
+
+/*
+ * Return true if this worker sends heartbeats to the given node. Standbys
+ * watch each other as well as the master, to know which of them is the
+ * most advanced when the master fails.
+ */
+static bool
+isMonitoredNode(PgHaNode *node, int shard, int n_shards)
+{
+	/* I'm master server, so ingnore myself */
+	if (node->myself)
+		return false;
+
+	/* Leave the node to the heartbeat worker in charge of it */
+	if (n_shards > 1 && nodeShard(node->name, n_shards) != shard)
+		return false;
+
+	return true;
+}
+
+/*
+ * Rebuild the schedule from a snapshot of a new membership epoch. Nodes
+ * already scheduled keep their interval and due time, and new ones are due
+ * at once. The index of each node in the snapshot is remembered, which
+ * stays valid as long as the epoch doesn't change.
+ */
+static void
+rebuildSchedule(PgHaNode *nodes, int n_nodes, uint64 epoch, int shard,
+				int n_shards)
+{
+	int		i;
+
+	/* The membership may have grown beyond the heap */
+	if (PgHaSchedule == NULL || PgHaSchedule->bh_space < n_nodes)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		if (PgHaSchedule != NULL)
+			binaryheap_free(PgHaSchedule);
+		PgHaSchedule = binaryheap_allocate(Max(n_nodes, PGHA_CHUNK_NODES),
+										   compareNextDue, NULL);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	binaryheap_reset(PgHaSchedule);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		PgHaConn *pconn;
+
+		if (!isMonitoredNode(&nodes[i], shard, n_shards))
+			continue;
+
+		pconn = getPooledConn(&nodes[i]);
+		pconn->snap_index = i;
+		binaryheap_add_unordered(PgHaSchedule, PointerGetDatum(pconn));
+	}
+
+	binaryheap_build(PgHaSchedule);
+
+	/* Close connections to the nodes that have been removed */
+	cleanupConnPool();
+
+	schedule_epoch = epoch;
+	schedule_as_master = am_master();
+}
+
+/* binaryheap comparator putting the earliest due node first */
+static int
+compareNextDue(Datum a, Datum b, void *arg)
+{
+	PgHaConn *ca = (PgHaConn *) DatumGetPointer(a);
+	PgHaConn *cb = (PgHaConn *) DatumGetPointer(b);
+
+	if (ca->next_due < cb->next_due)
+		return 1;
+	if (ca->next_due > cb->next_due)
+		return -1;
+	return 0;
+}
+
+/*
+ * Decide when to send the next heartbeat to a node we have just probed.
+ *
+ * A node answering promptly is probed less and less often, doubling the
+ * interval from pgha.keepalives_time up to pgha.max_keepalives_time. Once
+ * a heartbeat is missed, or took more than half of pgha.heartbeat_timeout,
+ * the node is probed every pgha.min_keepalives_time until it answers
+ * promptly again, so that the suspicion is either confirmed or cleared
+ * quickly. A node backing off from reconnecting isn't probed before it may
+ * reconnect.
+ */
+static void
+scheduleNextProbe(PgHaConn *pconn, PgHaProbe *probe, TimestampTz now)
+{
+	pconn->interval = nextProbeInterval(pconn, probe);
+	pconn->next_due = TimestampTzPlusMilliseconds(now, pconn->interval);
+	pconn->next_due = Max(pconn->next_due, pconn->next_connect);
+}
+
+/* Interval in ms after the given probe, see scheduleNextProbe() */
+static int
+nextProbeInterval(PgHaConn *pconn, PgHaProbe *probe)
+{
+	int64	interval;
+
+	/* Keep the WAL positions of the other standbys fresh while electing */
+	if (!probe->ok || isSlowProbe(probe) ||
+		(round_electing && probe->node->type == 's'))
+		return pgha_min_keepalives_time;
+
+	if (pconn->interval < PGHA_KEEPALIVES_MS)
+		return PGHA_KEEPALIVES_MS;
+
+	interval = (int64) pconn->interval * 2;
+	interval = Min(interval, Max(pgha_max_keepalives_time,
+								 PGHA_KEEPALIVES_MS));
+	return (int) interval;
+}
+
+/* Did the node take more than half of pgha.heartbeat_timeout to answer? */
+static bool
+isSlowProbe(PgHaProbe *probe)
+{
+	int64	elapsed_us = 0;
+
+	if (probe->connect_us > 0)
+		elapsed_us += probe->connect_us;
+	if (probe->rtt_us > 0)
+		elapsed_us += probe->rtt_us;
+	return elapsed_us > (int64) pgha_heartbeat_timeout * 1000 / 2;
+}
+
+/*
+ * Time to sleep in milliseconds until the next heartbeat is due, but not
+ * longer than pgha.keepalives_time so that the cluster status is still
+ * checked regularly.
+ */
+static long
+heartbeatTimeout(void)
+{
+	TimestampTz	now;
+	long		secs;
+	int			usecs;
+	long		timeout;
+
+	if (next_heartbeat == 0)
+		return PGHA_KEEPALIVES_MS;
+
+	/*
+	 * Wake up at once for a node that is due, but only once unless
+	 * doHeartbeat() sets it again; the caller might not send heartbeats
+	 * now, e.g. until it joins the cluster.
+	 */
+	now = GetCurrentTimestamp();
+	if (next_heartbeat <= now)
+	{
+		next_heartbeat = 0;
+		return 0;
+	}
+
+	TimestampDifference(now, next_heartbeat, &secs, &usecs);
+	timeout = secs * 1000L + usecs / 1000 + 1;
+
+	return Min(timeout, (long) PGHA_KEEPALIVES_MS);
+}
+
+/*
+ * Start accounting the overhead of this worker, and publish its latch so
+ * that it can be woken up.
+ */
+static void
+initWorkerStats(int workerno)
+{
+	MyWorkerStats = &PgHaCtl->workers[workerno];
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	memset(MyWorkerStats, 0, sizeof(PgHaWorkerStats));
+	MyWorkerStats->pid = MyProcPid;
+	MyWorkerStats->latch = MyLatch;
+	MyWorkerStats->started = GetCurrentTimestamp();
+	MyWorkerStats->phase = PGHA_PHASE_IDLE;
+	MyWorkerStats->phase_start = MyWorkerStats->started;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	on_shmem_exit(clearWorkerStats, Int32GetDatum(workerno));
+}
+
+/*
+ * Enter the given phase: account the time spent in the previous one, and
+ * report the new one in pg_stat_activity and the ps display.
+ */
+static void
+setPhase(PgHaPhase phase)
+{
+	TimestampTz	now;
+
+	/* Only the worker itself changes its phase, so no lock is needed here */
+	if (MyWorkerStats == NULL || MyWorkerStats->phase == phase)
+		return;
+
+	now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	MyWorkerStats->phase_us[MyWorkerStats->phase] +=
+		now - MyWorkerStats->phase_start;
+	MyWorkerStats->phase_count[phase]++;
+	MyWorkerStats->phase = phase;
+	MyWorkerStats->phase_start = now;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	pgstat_report_activity(phase == PGHA_PHASE_IDLE ? STATE_IDLE : STATE_RUNNING,
+						   PgHaPhaseNames[phase]);
+	set_ps_display(PgHaPhaseNames[phase], false);
+}
+
+/* Unpublish the latch of an exiting worker */
+static void
+clearWorkerStats(int code, Datum arg)
+{
+	int		workerno = DatumGetInt32(arg);
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	PgHaCtl->workers[workerno].pid = 0;
+	PgHaCtl->workers[workerno].latch = NULL;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	MyWorkerStats = NULL;
+}
+
+/*
+ * Wake up all workers but myself for an out-of-band round, e.g. because
+ * the membership has changed or a walsender has exited. The workers then
+ * don't wait for the next pgha.keepalives_time tick.
+ */
+static void
+wakeWorkers(void)
+{
+	int		i;
+
+	for (i = 0; i <= pgha_heartbeat_workers; i++)
+	{
+		Latch	*latch;
+
+		SpinLockAcquire(&PgHaCtl->mutex);
+		latch = PgHaCtl->workers[i].latch;
+		SpinLockRelease(&PgHaCtl->mutex);
+
+		if (latch != NULL && latch != MyLatch)
+			SetLatch(latch);
+	}
+}
+
+/* Wake up the main worker to check the cluster status at once */
+static void
+wakeMainWorker(void)
+{
+	Latch	*latch;
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	latch = PgHaCtl->workers[pgha_heartbeat_workers].latch;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	if (latch != NULL && latch != MyLatch)
+		SetLatch(latch);
+}
+
+/*
+ * Return when the first of the nodes that aren't suspected yet would be
+ * unless a heartbeat arrives before, or 0 if there is none. With heartbeat
+ * workers, the main worker sleeps until then rather than until the next
+ * heartbeat, which it doesn't send.
+ */
+static TimestampTz
+nextSuspicion(void)
+{
+	PgHaNode	*nodes;
+	TimestampTz	now = GetCurrentTimestamp();
+	TimestampTz	next = 0;
+	int			n_nodes;
+	int			i;
+
+	nodes = snapshotNodes(&n_nodes, NULL);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		TimestampTz	suspected;
+
+		if (nodes[i].myself)
+			continue;
+
+		suspected = suspicionTime(&nodes[i].arrivals);
+		if (suspected > now && (next == 0 || suspected < next))
+			next = suspected;
+	}
+
+	pfree(nodes);
+	return next;
+}
+
+/*
+ * Arrange that a walsender wakes the workers up when it exits. This is
+ * called in every backend, and walsenders are known by now.
+ */
+static void
+pgha_client_auth(Port *port, int status)
+{
+	if (prev_client_auth_hook)
+		prev_client_auth_hook(port, status);
+
+	if (am_walsender && status == STATUS_OK && PgHaCtl != NULL)
+		before_shmem_exit(pgha_walsender_exit, (Datum) 0);
+}
+
+/*
+ * A walsender is exiting, most likely because its standby has gone away.
+ * Let the workers check it now, rather than up to a full interval later.
+ */
+static void
+pgha_walsender_exit(int code, Datum arg)
+{
+	wakeWorkers();
+}
+
+/* Account a heartbeat round started at the given time */
+static void
+reportWorkerStats(TimestampTz start, int n_probes, int n_failures,
+				  int n_walsender_checks)
+{
+	struct rusage ru;
+	int64	round_us = GetCurrentTimestamp() - start;
+
+	if (MyWorkerStats == NULL)
+		return;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	MyWorkerStats->n_rounds++;
+	MyWorkerStats->n_probes += n_probes;
+	MyWorkerStats->n_probe_failures += n_failures;
+	MyWorkerStats->n_walsender_checks += n_walsender_checks;
+	MyWorkerStats->n_connects += round_connects;
+	MyWorkerStats->last_round_us = round_us;
+	MyWorkerStats->total_round_us += round_us;
+	MyWorkerStats->max_round_us = Max(MyWorkerStats->max_round_us, round_us);
+	MyWorkerStats->user_cpu_us =
+		(int64) ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+	MyWorkerStats->system_cpu_us =
+		(int64) ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+	SpinLockRelease(&PgHaCtl->mutex);
+}
+
+/* Return the heartbeat worker in charge of the given node */
+static int
+nodeShard(const char *name, int n_shards)
+{
+	uint32	hash;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) name,
+								   strlen(name)));
+
+	return hash % n_shards;
+}
+
+/*
+ * Return the pool entry for the given node, creating it if necessary.
+ */
+static PgHaConn *
+getPooledConn(PgHaNode *node)
+{
+	PgHaConn	*pconn;
+	bool		found;
+
+	if (PgHaConnPool == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = NAMEDATALEN;
+		ctl.entrysize = sizeof(PgHaConn);
+		PgHaConnPool = hash_create("pgha connection pool", 16, &ctl,
+								   HASH_ELEM);
+	}
+
+	pconn = (PgHaConn *) hash_search(PgHaConnPool, node->name, HASH_ENTER,
+									 &found);
+
+	if (!found)
+	{
+		strlcpy(pconn->conninfo, node->conninfo, MAXPGPATH);
+		pconn->conn = NULL;
+		pconn->no_wal_position = false;
+		pconn->n_failures = 0;
+		pconn->next_connect = 0;
+		/* A new node is due at once */
+		pconn->interval = PGHA_KEEPALIVES_MS;
+		pconn->next_due = 0;
+	}
+	else if (strcmp(pconn->conninfo, node->conninfo) != 0)
+	{
+		/* The node has been re-registered with a different conninfo */
+		closePooledConn(pconn);
+		strlcpy(pconn->conninfo, node->conninfo, MAXPGPATH);
+		pconn->n_failures = 0;
+		pconn->next_connect = 0;
+	}
+
+	pconn->seen = true;
+
+	return pconn;
+}
+
+static void
+closePooledConn(PgHaConn *pconn)
+{
+	if (pconn->conn != NULL)
+		PQfinish(pconn->conn);
+	pconn->conn = NULL;
+	/* A new session may find pgha.wal_position(), e.g. once it's created */
+	pconn->no_wal_position = false;
+}
+
+/* Forget the connections to nodes that are no longer scheduled */
+static void
+cleanupConnPool(void)
+{
+	HASH_SEQ_STATUS	status;
+	PgHaConn		*pconn;
+
+	if (PgHaConnPool == NULL)
+		return;
+
+	hash_seq_init(&status, PgHaConnPool);
+	while ((pconn = (PgHaConn *) hash_seq_search(&status)) != NULL)
+	{
+		if (pconn->seen)
+		{
+			pconn->seen = false;
+			continue;
+		}
+
+		closePooledConn(pconn);
+		hash_search(PgHaConnPool, pconn->name, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Start a probe to the given node without blocking.
+ *
+ * The pooled connection is reused if it is still healthy. Otherwise we
+ * start a new connection, unless the node is backing off after repeated
+ * reconnection failures.
+ */
+static void
+startProbe(PgHaProbe *probe, PgHaNode *node, PgHaConn *pconn)
+{
+	PGconn		*conn = pconn->conn;
+	TimestampTz	now = GetCurrentTimestamp();
+
+	probe->node = node;
+	probe->pconn = pconn;
+	probe->ok = false;
+	probe->skipped = false;
+	probe->reconnecting = false;
+	probe->connect_us = -1;
+	probe->rtt_us = -1;
+	memset(&probe->wal, 0, sizeof(PgHaWalPosition));
+	probe->deadline = TimestampTzPlusMilliseconds(now, pgha_heartbeat_timeout);
+
+	/* Discard the connection if the server has closed it meanwhile */
+	if (conn != NULL &&
+		(PQstatus(conn) != CONNECTION_OK || !PQconsumeInput(conn) ||
+		 PQstatus(conn) != CONNECTION_OK))
+	{
+		ereport(LOG,
+				(errmsg("connection to server \"%s\" has been lost : %s",
+						node->name, PQerrorMessage(conn))));
+		closePooledConn(pconn);
+		conn = NULL;
+	}
+
+	if (conn != NULL)
+	{
+		if (PQsendQuery(conn, probeQuery(pconn)))
+		{
+			probe->query_start = now;
+			probe->state = PGHA_PROBE_SENDING;
+			return;
+		}
+
+		closePooledConn(pconn);
+	}
+
+	if (now < pconn->next_connect)
+	{
+		probe->skipped = true;
+		probe->state = PGHA_PROBE_DONE;
+		return;
+	}
+
+	connectProbe(probe);
+}
+
+/* Start establishing a new pooled connection for the probe */
+static void
+connectProbe(PgHaProbe *probe)
+{
+	PgHaConn	*pconn = probe->pconn;
+
+	probe->reconnecting = true;
+	probe->connect_start = GetCurrentTimestamp();
+	probe->state = PGHA_PROBE_CONNECTING;
+	/* Before the first PQconnectPoll we must wait for the socket writable */
+	probe->poll = PGRES_POLLING_WRITING;
+
+	pconn->conn = PQconnectStart(pconn->conninfo);
+	round_connects++;
+
+	if (pconn->conn == NULL || PQstatus(pconn->conn) == CONNECTION_BAD)
+	{
+		ereport(LOG,
+				(errmsg("could not establish connection to server \"%s\" : %s",
+						probe->node->name,
+						pconn->conn ? PQerrorMessage(pconn->conn) : "out of memory")));
+		finishProbe(probe, false);
+	}
+}
+
+/*
+ * Advance the probe as far as possible without blocking. Called when its
+ * socket became ready.
+ */
+static void
+advanceProbe(PgHaProbe *probe)
+{
+	PGconn	*conn = probe->pconn->conn;
+
+	switch (probe->state)
+	{
+		case PGHA_PROBE_CONNECTING:
+			probe->poll = PQconnectPoll(conn);
+
+			if (probe->poll == PGRES_POLLING_FAILED)
+			{
+				ereport(LOG,
+						(errmsg("could not establish connection to server \"%s\" : %s",
+								probe->node->name, PQerrorMessage(conn))));
+				failProbe(probe);
+				return;
+			}
+
+			/* Still in progress */
+			if (probe->poll != PGRES_POLLING_OK)
+				return;
+
+			probe->query_start = GetCurrentTimestamp();
+			probe->connect_us = probe->query_start - probe->connect_start;
+
+			if (PQsetnonblocking(conn, 1) != 0 ||
+				!PQsendQuery(conn, probeQuery(probe->pconn)))
+			{
+				ereport(LOG,
+						(errmsg("could not send heartbeat to server \"%s\" : %s",
+								probe->node->name, PQerrorMessage(conn))));
+				failProbe(probe);
+				return;
+			}
+
+			probe->state = PGHA_PROBE_SENDING;
+			/* FALLTHROUGH */
+
+		case PGHA_PROBE_SENDING:
+			switch (PQflush(conn))
+			{
+				case 0:
+					probe->state = PGHA_PROBE_READING;
+					break;
+				case 1:
+					/* Wait for the socket to be writable again */
+					break;
+				default:
+					ereport(LOG,
+							(errmsg("could not send heartbeat to server \"%s\" : %s",
+									probe->node->name, PQerrorMessage(conn))));
+					failProbe(probe);
+					break;
+			}
+			return;
+
+		case PGHA_PROBE_READING:
+			if (!PQconsumeInput(conn))
+			{
+				ereport(LOG,
+						(errmsg("could not get tuple from server \"%s\" : %s",
+								probe->node->name, PQerrorMessage(conn))));
+				failProbe(probe);
+				return;
+			}
+
+			while (!PQisBusy(conn))
+			{
+				PGresult	*res = PQgetResult(conn);
+
+				/* All results have been consumed */
+				if (res == NULL)
+				{
+					if (probe->ok)
+					{
+						probe->rtt_us = GetCurrentTimestamp() - probe->query_start;
+						finishProbe(probe, true);
+					}
+					else
+						failProbe(probe);
+					return;
+				}
+
+				if (PQresultStatus(res) == PGRES_TUPLES_OK)
+				{
+					probe->ok = true;
+					parseWalPosition(probe, res);
+				}
+				else if (probe->ok)
+				{
+					/* The node is alive but can't tell its WAL position */
+					if (!probe->pconn->no_wal_position)
+						ereport(LOG,
+								(errmsg("could not get WAL position from server \"%s\" : %s",
+										probe->node->name,
+										PQresultErrorMessage(res))));
+					probe->pconn->no_wal_position = true;
+				}
+				else
+					ereport(LOG,
+							(errmsg("could not get tuple from server \"%s\" : %s",
+									probe->node->name, PQerrorMessage(conn))));
+				PQclear(res);
+			}
+			return;
+
+		case PGHA_PROBE_DONE:
+			return;
+	}
+}
+
+/*
+ * The probe failed. A failure on a reused connection may just mean that
+ * the session went away, e.g. because the remote server restarted, so we
+ * try a fresh connection within the same round. Only a failure to
+ * (re)connect is charged against the node.
+ */
+static void
+failProbe(PgHaProbe *probe)
+{
+	closePooledConn(probe->pconn);
+
+	if (!probe->reconnecting && GetCurrentTimestamp() < probe->deadline)
+		connectProbe(probe);
+	else
+		finishProbe(probe, false);
+}
+
+/*
+ * Finish the probe. On success the connection is kept in the pool for the
+ * next round. A failed reconnect schedules the next attempt: while the node
+ * has not reached pgha.retry_count we retry every round so as not to delay
+ * failure detection, and then back off exponentially up to
+ * pgha.max_reconnect_interval.
+ */
+static void
+finishProbe(PgHaProbe *probe, bool ok)
+{
+	PgHaConn	*pconn = probe->pconn;
+
+	probe->ok = ok;
+	probe->state = PGHA_PROBE_DONE;
+
+	if (ok)
+	{
+		pconn->n_failures = 0;
+		pconn->next_connect = 0;
+		return;
+	}
+
+	closePooledConn(pconn);
+
+	if (probe->reconnecting)
+	{
+		int		excess;
+		int64	delay_ms;
+
+		pconn->n_failures++;
+		excess = pconn->n_failures - pgha_retry_count;
+
+		if (excess > 0)
+		{
+			delay_ms = (int64) PGHA_KEEPALIVES_MS << Min(excess, 16);
+			delay_ms = Min(delay_ms, (int64) pgha_max_reconnect_interval * 1000);
+			pconn->next_connect =
+				TimestampTzPlusMilliseconds(GetCurrentTimestamp(), delay_ms);
+		}
+		else
+			pconn->next_connect = 0;
+	}
+}
+
+/* Return the socket events the probe is waiting for */
+static uint32
+probeWaitEvents(PgHaProbe *probe)
+{
+	switch (probe->state)
+	{
+		case PGHA_PROBE_CONNECTING:
+			return probe->poll == PGRES_POLLING_READING ?
+				WL_SOCKET_READABLE : WL_SOCKET_WRITEABLE;
+		case PGHA_PROBE_SENDING:
+			return WL_SOCKET_WRITEABLE;
+		case PGHA_PROBE_READING:
+			return WL_SOCKET_READABLE;
+		case PGHA_PROBE_DONE:
+			break;
+	}
+
+	return 0;
+}
+
+/* Return the phase of a probe not done yet */
+static PgHaPhase
+probePhase(PgHaProbe *probe)
+{
+	switch (probe->state)
+	{
+		case PGHA_PROBE_CONNECTING:
+			if (PQstatus(probe->pconn->conn) == CONNECTION_SSL_STARTUP)
+				return PGHA_PHASE_TLS;
+			return PGHA_PHASE_CONNECT;
+		case PGHA_PROBE_SENDING:
+			return PGHA_PHASE_SEND;
+		case PGHA_PROBE_READING:
+		case PGHA_PROBE_DONE:
+			break;
+	}
+
+	return PGHA_PHASE_QUERY;
+}
+
+/*
+ * Drive all probes until every one of them has finished or passed its
+ * deadline.
+ *
+ * libpq can switch to another socket while connecting when the host has
+ * several addresses, so the WaitEventSet is rebuilt on every iteration.
+ */
+static void
+waitForProbes(PgHaProbe *probes, int n_probes)
+{
+	WaitEvent	*events;
+	int			i;
+
+	events = (WaitEvent *) palloc(sizeof(WaitEvent) * (n_probes + 2));
+
+	while (!got_sigterm)
+	{
+		WaitEventSet *set;
+		TimestampTz	now = GetCurrentTimestamp();
+		TimestampTz	next_deadline = 0;
+		PgHaPhase	phase = PGHA_PHASE_QUERY;
+		long		secs;
+		int			usecs;
+		int			n_waiting = 0;
+		int			nevents;
+
+		/* Give up the probes that are past their deadline */
+		for (i = 0; i < n_probes; i++)
+		{
+			PgHaProbe *probe = &probes[i];
+
+			if (probe->state == PGHA_PROBE_DONE)
+				continue;
+
+			if (now >= probe->deadline)
+			{
+				ereport(LOG,
+						(errmsg("heartbeat to server \"%s\" timed out",
+								probe->node->name)));
+				finishProbe(probe, false);
+				continue;
+			}
+
+			if (next_deadline == 0 || probe->deadline < next_deadline)
+				next_deadline = probe->deadline;
+			n_waiting++;
+
+			/* We are waiting for the least advanced probe */
+			phase = Min(phase, probePhase(probe));
+		}
+
+		if (n_waiting == 0)
+			break;
+
+		set = CreateWaitEventSet(CurrentMemoryContext, n_waiting + 2);
+		AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET,
+						  &MyProc->procLatch, NULL);
+		AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET,
+						  NULL, NULL);
+
+		for (i = 0; i < n_probes; i++)
+		{
+			PgHaProbe *probe = &probes[i];
+
+			if (probe->state == PGHA_PROBE_DONE)
+				continue;
+
+			AddWaitEventToSet(set, probeWaitEvents(probe),
+							  PQsocket(probe->pconn->conn), NULL, probe);
+		}
+
+		setPhase(phase);
+
+		TimestampDifference(now, next_deadline, &secs, &usecs);
+		nevents = WaitEventSetWait(set, secs * 1000L + usecs / 1000 + 1,
+								   events, n_waiting + 2, PG_WAIT_EXTENSION);
+		FreeWaitEventSet(set);
+
+		for (i = 0; i < nevents; i++)
+		{
+			WaitEvent *event = &events[i];
+
+			/* Emergency bailout if postmaster has died */
+			if (event->events & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			if (event->events & WL_LATCH_SET)
+			{
+				ResetLatch(&MyProc->procLatch);
+				continue;
+			}
+
+			advanceProbe((PgHaProbe *) event->user_data);
+		}
+	}
+
+	/* We got SIGTERM in the middle of the round */
+	for (i = 0; i < n_probes; i++)
+	{
+		if (probes[i].state != PGHA_PROBE_DONE)
+			finishProbe(&probes[i], false);
+	}
+
+	/* Let the main loop see a SIGHUP we consumed the latch for */
+	if (got_sighup)
+		SetLatch(&MyProc->procLatch);
+
+	pfree(events);
+}
+
+/*
+ * Degrade to asynchronous replication because the given node has failed.
+ *
+ * Commits waiting for the failed standby are released right here, as the
+ * checkpointer does when synchronous_standby_names becomes empty, rather
+ * than after every process has reloaded the configuration. Only then is
+ * the change persisted, which no longer stalls commits, see
+ * finishDegrade().
+ */
+static void
+changeToAsync(PgHaNode *failed)
+{
+	PgHaDegradeStatus *degrade = &PgHaCtl->degrade;
+	TimestampTz	detected = GetCurrentTimestamp();
+	TimestampTz	released;
+	int			n_released;
+
+	setPhase(PGHA_PHASE_RECONFIGURE);
+
+	ereport(LOG, (errmsg("pgha: changes replication mode to asynchronous replication")));
+
+	n_released = releaseSyncRepWaiters();
+	released = GetCurrentTimestamp();
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	strlcpy(degrade->failed_node, failed->name, NAMEDATALEN);
+	degrade->last_contact = failed->arrivals.last_arrival;
+	degrade->detected = detected;
+	degrade->released = released;
+	degrade->persisted = 0;
+	degrade->n_released = n_released;
+	degrade->n_degradations++;
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	ereport(LOG,
+			(errmsg("pgha: released %d waiting commits %.3f ms after detecting failure of node \"%s\"",
+					n_released, (released - detected) / 1000.0, failed->name)));
+
+	degrade_pending = true;
+	finishDegrade();
+}
+
+/*
+ * Persist synchronous_standby_names = '' after degrading. If that fails,
+ * the main loop retries it every round, and keeps the commits released
+ * meanwhile.
+ */
+static void
+finishDegrade(void)
+{
+	PgHaDegradeStatus *degrade = &PgHaCtl->degrade;
+
+	if (!persistSyncStandbyNames(""))
+	{
+		ereport(LOG,
+				(errmsg("pgha: stays degraded to asynchronous replication, will retry persisting it")));
+		return;
+	}
+
+	degrade_pending = false;
+
+	SpinLockAcquire(&PgHaCtl->mutex);
+	degrade->persisted = GetCurrentTimestamp();
+	SpinLockRelease(&PgHaCtl->mutex);
+
+	startAction(PGHA_ACTION_DEGRADE, pgha_after_degrade_command);
+}
+
+/*
+ * Stop waiting for synchronous standbys, and wake up all the backends
+ * waiting for one. Returns the number of backends woken up.
+ */
+static int
+releaseSyncRepWaiters(void)
+{
+	int		n_released = 0;
+	int		mode;
+
+	LWLockAcquire(SyncRepLock, LW_EXCLUSIVE);
+
+	/* New commits don't wait once this is cleared */
+	WalSndCtl->sync_standbys_defined = false;
+
+	for (mode = 0; mode < NUM_SYNC_REP_WAIT_MODE; mode++)
+	{
+		SHM_QUEUE  *queue = &WalSndCtl->SyncRepQueue[mode];
+		PGPROC	   *proc;
+
+		proc = (PGPROC *) SHMQueueNext(queue, queue,
+									   offsetof(PGPROC, syncRepLinks));
+		while (proc)
+		{
+			PGPROC	   *next;
+
+			next = (PGPROC *) SHMQueueNext(queue, &proc->syncRepLinks,
+										   offsetof(PGPROC, syncRepLinks));
+
+			/* Same as SyncRepWakeQueue() */
+			SHMQueueDelete(&proc->syncRepLinks);
+			pg_write_barrier();
+			proc->syncRepState = SYNC_REP_WAIT_COMPLETE;
+			SetLatch(&proc->procLatch);
+
+			n_released++;
+			proc = next;
+		}
+	}
+
+	LWLockRelease(SyncRepLock);
+
+	return n_released;
+}
+
+/*
+ * Run ALTER SYSTEM SET synchronous_standby_names in this process, and let
+ * every process reload the configuration.
+ *
+ * Errors are reported at LOG rather than raised, as this runs in the main
+ * worker, which isn't restarted. Returns false if the setting couldn't be
+ * persisted or the reload couldn't be requested.
+ */
+static bool
+persistSyncStandbyNames(const char *value)
+{
+	AlterSystemStmt *stmt = makeNode(AlterSystemStmt);
+	VariableSetStmt *setstmt = makeNode(VariableSetStmt);
+	A_Const	   *arg = makeNode(A_Const);
+	MemoryContext oldcontext = CurrentMemoryContext;
+	bool		ok = true;
+
+	setPhase(PGHA_PHASE_RECONFIGURE);
+
+	arg->val.type = T_String;
+	arg->val.val.str = pstrdup(value);
+	arg->location = -1;
+
+	setstmt->kind = VAR_SET_VALUE;
+	setstmt->name = "synchronous_standby_names";
+	setstmt->args = list_make1(arg);
+	stmt->setstmt = setstmt;
+
+	PG_TRY();
+	{
+		StartTransactionCommand();
+		AlterSystemSetConfigFile(stmt);
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		AbortCurrentTransaction();
+
+		ereport(LOG,
+				(errmsg("pgha: could not set synchronous_standby_names to '%s' : %s",
+						value, edata->message)));
+		FreeErrorData(edata);
+		ok = false;
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (ok && kill(PostmasterPid, SIGHUP) != 0)
+	{
+		ereport(LOG,
+				(errmsg("pgha: failed to send SIGHUP to postmaster : %m")));
+		ok = false;
+	}
+
+	return ok;
+}
+
+/*
+ * Keep synchronous_standby_names as ANY k of the k fastest healthy
+ * standbys, k being pgha.sync_quorum.
+ *
+ * A synchronous standby that has failed is replaced at once. A faster
+ * standby replaces a synchronous one only after it has been faster by
+ * pgha.sync_quorum_hysteresis for PGHA_QUORUM_STABLE_ROUNDS rounds in a
+ * row, so that the setting doesn't flap on latency noise.
+ */
+static void
+manageSyncQuorum(void)
+{
+	static int	better_rounds = 0;
+	PgHaNode	*nodes;
+	PgHaSyncCandidate *cands;
+	PgHaNode	**sync;
+	TimestampTz	now = GetCurrentTimestamp();
+	double		worst_sync = -1;
+	double		best_other = -1;
+	bool		change = false;
+	char		*names;
+	int			n_nodes;
+	int			n_cands = 0;
+	int			n_sync = 0;
+	int			k;
+	int			i;
+
+	nodes = snapshotNodes(&n_nodes, NULL);
+	cands = (PgHaSyncCandidate *) palloc(sizeof(PgHaSyncCandidate) * n_nodes);
+	sync = (PgHaNode **) palloc(sizeof(PgHaNode *) * n_nodes);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		PgHaNode *node = &nodes[i];
+		double	latency;
+
+		if (node->myself || node->type != 's')
+			continue;
+
+		latency = getSyncLatency(node, now);
+
+		/* A synchronous standby has failed */
+		if (latency < 0)
+		{
+			if (node->is_sync)
+				change = true;
+			continue;
+		}
+
+		cands[n_cands].node = node;
+		cands[n_cands].latency = latency;
+		n_cands++;
+	}
+
+	k = Min(pgha_sync_quorum, n_cands);
+
+	/* No standby to wait for; stop waiting if one has failed */
+	if (k == 0)
+	{
+		PgHaNode failed;
+
+		if (in_syncrep && !checkClusterStatus(&failed))
+			changeToAsync(&failed);
+
+		for (i = 0; i < n_nodes; i++)
+		{
+			if (nodes[i].is_sync)
+				setNodeSync(nodes[i].name, false);
+		}
+
+		goto done;
+	}
+
+	qsort(cands, n_cands, sizeof(PgHaSyncCandidate), compareSyncCandidates);
+
+	for (i = 0; i < n_cands; i++)
+	{
+		if (cands[i].node->is_sync)
+		{
+			sync[n_sync++] = cands[i].node;
+			worst_sync = cands[i].latency;
+		}
+		else if (best_other < 0)
+			best_other = cands[i].latency;
+	}
+
+	/*
+	 * Reselect if the number of synchronous standbys is off, or if the
+	 * setting doesn't match, e.g. after degrading to asynchronous.
+	 */
+	if (!change && n_sync != k)
+		change = true;
+
+	if (!change)
+	{
+		names = buildSyncStandbyNames(sync, n_sync);
+		if (strcmp(names, SyncRepStandbyNames ? SyncRepStandbyNames : "") != 0)
+			change = true;
+		pfree(names);
+	}
+
+	if (!change)
+	{
+		if (best_other >= 0 &&
+			best_other < worst_sync * (1.0 - pgha_sync_quorum_hysteresis))
+		{
+			if (++better_rounds >= PGHA_QUORUM_STABLE_ROUNDS)
+				change = true;
+		}
+		else
+			better_rounds = 0;
+	}
+
+	if (!change)
+		goto done;
+
+	better_rounds = 0;
+
+	/* Take the k fastest */
+	for (i = 0; i < k; i++)
+		sync[i] = cands[i].node;
+	n_sync = k;
+
+	names = buildSyncStandbyNames(sync, n_sync);
+
+	if (strcmp(names, SyncRepStandbyNames ? SyncRepStandbyNames : "") != 0)
+	{
+		ereport(LOG,
+				(errmsg("pgha: changes synchronous_standby_names to '%s'",
+						names)));
+
+		/* Retried in the next round if it fails */
+		if (persistSyncStandbyNames(names))
+		{
+			/* This supersedes a degradation yet to be persisted */
+			degrade_pending = false;
+
+			/* Reload now, not to see the old setting in the next round */
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	pfree(names);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		bool	is_sync = false;
+		int		j;
+
+		for (j = 0; j < n_sync; j++)
+		{
+			if (sync[j] == &nodes[i])
+			{
+				is_sync = true;
+				break;
+			}
+		}
+
+		if (nodes[i].is_sync != is_sync)
+			setNodeSync(nodes[i].name, is_sync);
+	}
+
+done:
+	pfree(sync);
+	pfree(cands);
+	pfree(nodes);
+}
+
+/*
+ * Estimate the ack latency of a standby in milliseconds: the flush lag
+ * reported by its walsender, or the heartbeat round trip time while there
+ * is no WAL traffic to measure the lag. Returns -1 if the standby is not
+ * streaming or is suspected to have failed.
+ */
+static double
+getSyncLatency(PgHaNode *copy, TimestampTz now)
+{
+	PgHaNode *node;
+	PgHaReplStatus repl;
+	PgHaArrivalWindow arrivals;
+	PgHaLatencyHist rtt_hist;
+	double	latency = -1;
+
+	/* Copy out what we need so that no math runs under the mutex */
+	if ((node = acquireNode(copy)) == NULL)
+		return latency;
+	repl = node->repl;
+	arrivals = node->arrivals;
+	rtt_hist = node->stats.rtt_hist;
+	releaseNode(node);
+
+	if (repl.streaming && computePhi(&arrivals, now) < pgha_phi_threshold)
+	{
+		if (repl.flush_lag >= 0 && repl.updated != 0)
+			latency = repl.flush_lag / 1000.0;
+		else if (rtt_hist.count > 0)
+			latency = histPercentile(&rtt_hist, 0.50);
+		else
+			latency = DBL_MAX;
+	}
+
+	return latency;
+}
+
+/* qsort comparator ordering candidates by latency, then by name */
+static int
+compareSyncCandidates(const void *a, const void *b)
+{
+	const PgHaSyncCandidate *ca = (const PgHaSyncCandidate *) a;
+	const PgHaSyncCandidate *cb = (const PgHaSyncCandidate *) b;
+
+	if (ca->latency != cb->latency)
+		return (ca->latency < cb->latency) ? -1 : 1;
+
+	return strcmp(ca->node->name, cb->node->name);
+}
+
+/* qsort comparator ordering nodes by name */
+static int
+compareNodeNames(const void *a, const void *b)
+{
+	return strcmp((*(PgHaNode *const *) a)->name,
+				  (*(PgHaNode *const *) b)->name);
+}
+
+/*
+ * Build the value of synchronous_standby_names for the given standbys.
+ * Names are sorted so that the same set always gives the same value.
+ */
+static char *
+buildSyncStandbyNames(PgHaNode **sync, int n_sync)
+{
+	StringInfoData buf;
+	PgHaNode	**sorted;
+	int			i;
+
+	if (n_sync == 0)
+		return pstrdup("");
+
+	sorted = (PgHaNode **) palloc(sizeof(PgHaNode *) * n_sync);
+	memcpy(sorted, sync, sizeof(PgHaNode *) * n_sync);
+	qsort(sorted, n_sync, sizeof(PgHaNode *), compareNodeNames);
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "ANY %d (", n_sync);
+
+	for (i = 0; i < n_sync; i++)
+	{
+		const char *p;
+
+		if (i > 0)
+			appendStringInfoString(&buf, ", ");
+
+		appendStringInfoChar(&buf, '"');
+		for (p = sorted[i]->name; *p; p++)
+		{
+			if (*p == '"')
+				appendStringInfoChar(&buf, '"');
+			appendStringInfoChar(&buf, *p);
+		}
+		appendStringInfoChar(&buf, '"');
+	}
+
+	appendStringInfoChar(&buf, ')');
+
+	pfree(sorted);
+
+	return buf.data;
+}
+
+/* Mark the given node as a synchronous standby or not, if registered */
+static void
+setNodeSync(const char *name, bool is_sync)
+{
+	int		slotno;
+
+	LWLockAcquire(PgHaCtl->lock, LW_SHARED);
+
+	slotno = indexLookup(name, NULL);
+	if (slotno >= 0)
+	{
+		PgHaNode *node = getSlot(slotno);
+
+		SpinLockAcquire(&node->mutex);
+		node->is_sync = is_sync;
+		SpinLockRelease(&node->mutex);
+	}
+
+	LWLockRelease(PgHaCtl->lock);
+}
+
+/*
+ * Return false if any other node is suspected to have failed, that is, its
+ * phi has reached pgha.phi_threshold. The first such node is copied to
+ * *failed.
+ */
+static bool
+checkClusterStatus(PgHaNode *failed)
+{
+	PgHaNode *nodes;
+	TimestampTz now = GetCurrentTimestamp();
+	bool	healthy = true;
+	int		n_nodes;
+	int		i;
+
+	nodes = snapshotNodes(&n_nodes, NULL);
+
+	for (i = 0; i < n_nodes; i++)
+	{
+		double	phi;
+
+		if (nodes[i].myself)
+			continue;
+
+		phi = getNodePhi(&nodes[i], now);
+		if (phi >= pgha_phi_threshold)
+		{
+			ereport(LOG,
+					(errmsg("pgha: node \"%s\" is suspected to have failed (phi = %.2f)",
+							nodes[i].name, phi)));
+			if (healthy)
+				memcpy(failed, &nodes[i], sizeof(PgHaNode));
+			healthy = false;
+		}
+	}
+
+	pfree(nodes);
+
+	return healthy;
+}
+
+static int
+get_hanode_count(void)
+{
+	/* An int is read atomically, so we don't need the lock */
+	return *((volatile int *) &PgHaCtl->n_nodes);
 }
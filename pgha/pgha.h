@@ -9,20 +9,111 @@
 
 /* These are always necessary for a bgworker */
 #include "access/xlog.h"
+#include "datatype/timestamp.h"
 #include "miscadmin.h"
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
+#include "utils/dsa.h"
 
 #include "tcop/utility.h"
 #include "libpq-int.h"
 
+/*
+ * Log-scale latency histogram. Bucket i counts samples in
+ * [2^i, 2^(i+1)) microseconds, the first one also counting smaller ones.
+ */
+#define PGHA_HIST_BUCKETS	32
+
+typedef struct PgHaLatencyHist
+{
+	uint64	count;
+	uint64	buckets[PGHA_HIST_BUCKETS];
+} PgHaLatencyHist;
+
+/* Heartbeat statistics of a node */
+typedef struct PgHaNodeStats
+{
+	int64		n_probes;
+	int64		n_failures;
+	int64		n_walsender_checks;	/* proven alive by its walsender */
+	TimestampTz	last_success;
+	int64		last_connect_us;	/* -1 if never connected */
+	int64		last_rtt_us;		/* -1 if never succeeded */
+	PgHaLatencyHist connect_hist;
+	PgHaLatencyHist rtt_hist;
+} PgHaNodeStats;
+
+/*
+ * Recent arrivals of successful heartbeats of a node, used by the phi
+ * accrual failure detector. As the heartbeat interval adapts, what is
+ * sampled is how late each heartbeat arrived after the interval it was
+ * scheduled at, rather than the raw inter-arrival time.
+ */
+#define PGHA_PHI_WINDOW		64
+
+typedef struct PgHaArrivalWindow
+{
+	TimestampTz	monitored;			/* registered at */
+	TimestampTz	last_arrival;		/* 0 until the first heartbeat */
+	int64		expected;			/* scheduled interval after it, in us */
+	int			n_delays;
+	int			next;				/* next position to overwrite */
+	int64		delays[PGHA_PHI_WINDOW];	/* in microseconds */
+} PgHaArrivalWindow;
+
+/*
+ * Replication status of a standby, taken from the walsender serving it.
+ * The walsender is identified by application_name, which must be set to
+ * the node name in the standby's primary_conninfo.
+ */
+typedef struct PgHaReplStatus
+{
+	bool		streaming;
+	XLogRecPtr	sent;
+	XLogRecPtr	write;
+	XLogRecPtr	flush;
+	XLogRecPtr	apply;
+	TimeOffset	write_lag;			/* -1 if unknown */
+	TimeOffset	flush_lag;
+	TimeOffset	apply_lag;
+	int			sync_priority;
+	TimestampTz	updated;
+} PgHaReplStatus;
+
+/*
+ * WAL position of a node as reported by pgha.wal_position() in response to
+ * heartbeats, to elect the standby to promote.
+ */
+typedef struct PgHaWalPosition
+{
+	XLogRecPtr	receive;		/* received, or replayed if larger */
+	XLogRecPtr	replay;
+	TimeLineID	timeline;
+	double		replay_rate;	/* bytes per second, 0 if unknown */
+	TimestampTz	updated;		/* 0 if never reported */
+	bool		unavailable;	/* answers without pgha.wal_position() */
+} PgHaWalPosition;
+
+/*
+ * Membership fields (name, conninfo, type, in_use, myself, node_id,
+ * live_index and next_free) are changed only under PgHaCtl->lock in
+ * exclusive mode; the health fields are protected by mutex. A slot never
+ * moves while its chunk exists, so slotno stays the same for the whole life
+ * time.
+ */
 typedef struct PgHaNode
 {
 	slock_t	mutex;
+	int		slotno;
+	uint64	node_id;
+	int		live_index;		/* position in PgHaCtl->live_slots */
+	int		next_free;		/* next free slot, if not in use */
 	char	name[NAMEDATALEN];
 	char	conninfo[MAXPGPATH];
 	char	type;
@@ -30,14 +121,252 @@ typedef struct PgHaNode
 	bool	myself;
 	bool	live;
 	bool	is_sync;
-	int		retry_count;
+	int		retry_count;		/* consecutive failed heartbeats */
+	PgHaArrivalWindow arrivals;
+	PgHaNodeStats stats;
+	PgHaReplStatus repl;
+	PgHaWalPosition wal;
 } PgHaNode;
 
+/*
+ * Log of recent membership changes, from which standbys catch up
+ * incrementally. The change of epoch e is kept at
+ * changes[e % PGHA_MEMBERSHIP_LOG_SIZE] until it is overwritten.
+ */
+#define PGHA_MEMBERSHIP_LOG_SIZE	256
+
+typedef struct PgHaMembershipChange
+{
+	uint64	epoch;
+	char	op;				/* 'a' for added or updated, 'd' for deleted */
+	char	type;
+	char	name[NAMEDATALEN];
+	char	conninfo[MAXPGPATH];
+} PgHaMembershipChange;
+
+/*
+ * Time line of the last failover performed by this node, to measure the
+ * recovery time objective phase by phase. Protected by PgHaCtl->mutex.
+ */
+typedef struct PgHaFailoverStatus
+{
+	char		failed_node[NAMEDATALEN];
+	TimestampTz	last_contact;		/* last successful heartbeat */
+	TimestampTz	detected;			/* suspected to have failed */
+	TimestampTz	decided;			/* decided to promote */
+	TimestampTz	promote_requested;
+	TimestampTz	promoted;			/* recovery has ended */
+	TimestampTz	first_write;		/* the first write has been accepted */
+	TimestampTz	after_command_done;
+	int			after_command_status;
+	bool		electing;			/* electing the standby to promote */
+	char		elected_node[NAMEDATALEN];
+} PgHaFailoverStatus;
+
+/*
+ * Replay rate of this server, sampled by the main worker while there is WAL
+ * to replay. Protected by PgHaCtl->mutex.
+ */
+typedef struct PgHaReplayRate
+{
+	XLogRecPtr	last_replay;
+	XLogRecPtr	last_receive;
+	TimestampTz	last_sample;
+	double		rate;			/* bytes per second, 0 if unknown */
+} PgHaReplayRate;
+
+/*
+ * Time line of the last degradation from synchronous to asynchronous
+ * replication, to measure how long commits were stalled. Protected by
+ * PgHaCtl->mutex.
+ */
+typedef struct PgHaDegradeStatus
+{
+	char		failed_node[NAMEDATALEN];
+	TimestampTz	last_contact;		/* last successful heartbeat */
+	TimestampTz	detected;			/* suspected to have failed */
+	TimestampTz	released;			/* waiting commits have been released */
+	TimestampTz	persisted;			/* the config change has been persisted */
+	int			n_released;			/* number of commits released */
+	int64		n_degradations;
+} PgHaDegradeStatus;
+
+/*
+ * Actions run in a child process after a state change of this node. See
+ * pgha.after_command and pgha.after_degrade_command.
+ */
+typedef enum PgHaActionKind
+{
+	PGHA_ACTION_PROMOTE,		/* after promoted */
+	PGHA_ACTION_DEGRADE			/* after degraded to async replication */
+} PgHaActionKind;
+
+#define PGHA_NUM_ACTIONS	(PGHA_ACTION_DEGRADE + 1)
+
+/* Status of the last run of an action, protected by PgHaCtl->mutex */
+typedef struct PgHaActionStatus
+{
+	int			pid;				/* 0 if not running */
+	TimestampTz	started;
+	TimestampTz	finished;
+	int			exit_status;		/* -1 until finished */
+	bool		timed_out;			/* killed by pgha.action_timeout */
+	int64		n_runs;
+} PgHaActionStatus;
+
+/*
+ * Phases of a worker, reported in pg_stat_activity and the ps display, and
+ * timed cumulatively in PgHaWorkerStats.
+ */
+typedef enum PgHaPhase
+{
+	PGHA_PHASE_IDLE,			/* waiting for the next round */
+	PGHA_PHASE_RELOAD,			/* reloading the configuration */
+	PGHA_PHASE_COLLECT,			/* taking a snapshot, scanning walsenders */
+	PGHA_PHASE_CONNECT,			/* connecting to nodes */
+	PGHA_PHASE_TLS,				/* TLS handshake with nodes */
+	PGHA_PHASE_SEND,			/* sending heartbeat queries */
+	PGHA_PHASE_QUERY,			/* waiting for heartbeat results */
+	PGHA_PHASE_RECORD,			/* recording the results */
+	PGHA_PHASE_CHECK,			/* judging the cluster status */
+	PGHA_PHASE_SYNC,			/* syncing membership with the master */
+	PGHA_PHASE_RECONFIGURE,		/* changing synchronous replication */
+	PGHA_PHASE_PROMOTE,			/* promoting myself */
+	PGHA_PHASE_ROUTE			/* publishing the routing table */
+} PgHaPhase;
+
+#define PGHA_NUM_PHASES		(PGHA_PHASE_ROUTE + 1)
+
+/*
+ * Overhead of a worker sending heartbeats, to compare performance changes
+ * run to run, and the latch to wake it up. Written only by the worker
+ * itself, under PgHaCtl->mutex.
+ */
+typedef struct PgHaWorkerStats
+{
+	int			pid;				/* 0 if not running */
+	Latch		*latch;				/* NULL if not running */
+	TimestampTz	started;
+	int64		n_rounds;
+	int64		n_probes;
+	int64		n_probe_failures;
+	int64		n_walsender_checks;
+	int64		n_connects;			/* connection attempts */
+	int64		last_round_us;
+	int64		total_round_us;
+	int64		max_round_us;
+	int64		user_cpu_us;
+	int64		system_cpu_us;
+	PgHaPhase	phase;				/* current phase */
+	TimestampTz	phase_start;
+	int64		phase_count[PGHA_NUM_PHASES];
+	int64		phase_us[PGHA_NUM_PHASES];	/* excluding the current one */
+} PgHaWorkerStats;
+
+/*
+ * Node slots live in a dynamic shared area, allocated in chunks of
+ * PGHA_CHUNK_NODES as the membership grows and freed from the end as it
+ * shrinks. Slot n is the (n % PGHA_CHUNK_NODES)-th of chunk
+ * n / PGHA_CHUNK_NODES.
+ */
+#define PGHA_CHUNK_NODES	32
+#define PGHA_MAX_CHUNKS		1024
+
+/*
+ * Everything about the node list, including the chunks, live_slots and the
+ * name index, is protected by lock. Readers copy the list in shared mode
+ * and do network I/O on the copy.
+ */
 typedef struct PgHaCtlData
 {
 	LWLock	*lock;
+	LWLock	*file_lock;		/* serializes writers of the registry file */
+	uint64	next_node_id;
+	uint64	epoch;			/* incremented by every membership change */
+	uint64	first_epoch;	/* epoch at startup */
+	bool	registry_loaded;	/* heartbeats wait for this */
+	PgHaMembershipChange *changes;
 	int	n_nodes;
-	PgHaNode	nodes[FLEXIBLE_ARRAY_MEMBER];
+	int	free_head;		/* first free slot, or -1 */
+	int	n_chunks;
+	int	live_capacity;	/* number of entries live_slots has room for */
+	int	index_size;		/* number of buckets of index, a power of 2 */
+	dsa_pointer live_slots;	/* int[]: slot numbers of the nodes in use */
+	dsa_pointer index;		/* int[]: open addressing name index, or -1 */
+	dsa_pointer chunks[PGHA_MAX_CHUNKS];
+	dsa_pointer routes;		/* PgHaRoute[]: the routing table */
+	int	n_routes;
+	uint64	routes_generation;	/* incremented every publication */
+	int	area_tranche;	/* tranche id of the area's lock */
+	char	*area;			/* in-place part of the area */
+	slock_t	mutex;		/* protects failover, replay, degrade, actions and
+						 * workers */
+	PgHaFailoverStatus failover;
+	PgHaReplayRate replay;
+	PgHaDegradeStatus degrade;
+	PgHaActionStatus actions[PGHA_NUM_ACTIONS];
+	PgHaWorkerStats *workers;	/* heartbeat workers, then the main one */
 } PgHaCtlData;
 
+/*
+ * The node registry is saved to PGHA_REGISTRY_FILE in the data directory
+ * on every membership change, and reloaded at startup so that monitoring
+ * resumes without rejoining. The file is a header followed by n_entries
+ * fixed-size entries, and the CRC covers both, computed with crc zeroed.
+ */
+#define PGHA_REGISTRY_FILE		"pgha.registry"
+#define PGHA_REGISTRY_MAGIC		0x50474841	/* "PGHA" */
+#define PGHA_REGISTRY_VERSION	1
+
+typedef struct PgHaRegistryHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		entry_size;		/* sizeof(PgHaRegistryEntry) */
+	uint32		n_entries;
+	pg_crc32c	crc;
+} PgHaRegistryHeader;
+
+typedef struct PgHaRegistryEntry
+{
+	char	name[NAMEDATALEN];
+	char	conninfo[MAXPGPATH];
+	char	type;
+} PgHaRegistryEntry;
+
+/*
+ * The main worker publishes a routing table for read load balancing every
+ * round, both in shared memory and in PGHA_ROUTING_FILE in the data
+ * directory. The file is a header followed by n_entries entries, the CRC
+ * computed as for the registry. It is replaced by rename() and never
+ * modified in place, so a pooler can map it and reopen it when it wants a
+ * newer generation.
+ */
+#define PGHA_ROUTING_FILE		"pgha.routing"
+#define PGHA_ROUTING_MAGIC		0x50474852	/* "PGHR" */
+#define PGHA_ROUTING_VERSION	1
+
+typedef struct PgHaRoutingHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		entry_size;		/* sizeof(PgHaRoute) */
+	uint32		n_entries;
+	uint64		generation;		/* incremented every publication */
+	TimestampTz	updated;
+	pg_crc32c	crc;
+} PgHaRoutingHeader;
+
+typedef struct PgHaRoute
+{
+	char	name[NAMEDATALEN];
+	char	conninfo[MAXPGPATH];
+	char	type;
+	bool	healthy;
+	int32	weight;			/* 1 to 100, or 0 not to route reads to it */
+	int64	lag_bytes;		/* replay lag, -1 if unknown */
+	int64	lag_us;			/* replay lag in time, -1 if unknown */
+} PgHaRoute;
+
 extern void PgHaMain(Datum main_arg);
+extern void PgHaHeartbeatMain(Datum main_arg);
@@ -0,0 +1,113 @@
+# Heartbeat overhead of a healthy cluster, and of one on a slow network.
+#
+# PGHA_BENCH_WINDOW sets the seconds each scenario is measured over, 10 by
+# default, and PGHA_BENCH_DELAY the one-way delay in milliseconds of the
+# slow network, 200 by default.
+use strict;
+use warnings;
+use FindBin;
+use lib $FindBin::RealBin;
+use PgHaCluster;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 5;
+use Time::HiRes qw(time sleep);
+
+my $window = $ENV{PGHA_BENCH_WINDOW} // 10;
+my $delay  = $ENV{PGHA_BENCH_DELAY}  // 200;
+
+my $cluster = PgHaCluster->new;
+$cluster->wait_healthy;
+
+# Measure what the workers of every node spend over the window, and record
+# it as the given scenario. Returns the totals over all nodes.
+sub measure
+{
+	my ($scenario, %extra) = @_;
+	my (%workers, %links, %nodes, %sum);
+
+	foreach my $node ($cluster->nodes)
+	{
+		$workers{ $node->name } = $cluster->worker_totals($node);
+		$links{ $node->name }   = $cluster->link_stats($node->name);
+	}
+
+	my $start = time();
+	sleep($window);
+	my $elapsed = time() - $start;
+
+	foreach my $node ($cluster->nodes)
+	{
+		my $name   = $node->name;
+		my $before = $workers{$name};
+		my $after  = $cluster->worker_totals($node);
+		my $link   = $cluster->link_stats($name);
+
+		$nodes{$name} = {
+			rounds_per_sec =>
+			  ($after->{rounds} - $before->{rounds}) / $elapsed,
+			probes_per_sec =>
+			  ($after->{probes} - $before->{probes}) / $elapsed,
+			probe_failures =>
+			  $after->{probe_failures} - $before->{probe_failures},
+			walsender_checks =>
+			  $after->{walsender_checks} - $before->{walsender_checks},
+			connects => $after->{connects} - $before->{connects},
+			cpu_ms_per_sec =>
+			  ($after->{cpu_time} - $before->{cpu_time}) / $elapsed,
+			mean_round_time     => $after->{mean_round_time},
+			max_round_time      => $after->{max_round_time},
+			inbound_connections => $link->{connections} -
+			  $links{$name}->{connections},
+			inbound_bytes_per_sec => (
+				$link->{bytes_in} + $link->{bytes_out} -
+				  $links{$name}->{bytes_in} - $links{$name}->{bytes_out}
+			) / $elapsed,
+		};
+
+		$sum{$_} += $nodes{$name}->{$_}
+		  foreach qw(probe_failures connects cpu_ms_per_sec);
+	}
+
+	$cluster->record(
+		scenario => $scenario,
+		window   => $elapsed,
+		nodes    => \%nodes,
+		%extra);
+	return \%sum;
+}
+
+# Heartbeats from standby1 to the master, which it can't check through a
+# walsender
+sub master_probes
+{
+	return $cluster->node('standby1')->safe_psql('postgres',
+		"SELECT probes FROM pgha.node_stats() WHERE name = 'master'");
+}
+
+my $probes = master_probes();
+my $steady = measure('steady');
+my $probe_rate = (master_probes() - $probes) / $window;
+note "heartbeat CPU time of the cluster: $steady->{cpu_ms_per_sec} ms/s";
+note "heartbeats from standby1 to the master: $probe_rate per second";
+cmp_ok(
+	$probe_rate * $cluster->node('standby1')->safe_psql(
+		'postgres',
+		"SELECT extract(epoch FROM current_setting('pgha.keepalives_time')::interval)"
+	),
+	'<', 0.75,
+	'heartbeats to a healthy node back off from pgha.keepalives_time');
+is($steady->{connects}, 0, 'heartbeats reuse their connections');
+is($steady->{probe_failures}, 0, 'no heartbeat fails in a healthy cluster');
+
+# Each way, so a round trip to standby1 takes twice the delay
+$cluster->fault('standby1', 'delay', $delay);
+my $slow = measure('delay', delay => $delay);
+my $rtt  = $cluster->query_hash($cluster->node('master'),
+	"SELECT last_rtt, phi FROM pgha.node_stats() WHERE name = 'standby1'");
+$cluster->heal('standby1');
+
+note "round trip to standby1 through a ${delay}ms delay: $rtt->{last_rtt} ms";
+cmp_ok($rtt->{last_rtt}, '>=', 2 * $delay,
+	'heartbeats go through the delayed proxy');
+is($slow->{connects}, 0, 'a slow network causes no reconnects');
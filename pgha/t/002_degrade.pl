@@ -0,0 +1,100 @@
+# Failure of the synchronous standby: how long it takes the master to
+# detect it and to release the commits waiting for it, and how long a
+# commit issued right after the failure stalls.
+#
+# PGHA_BENCH_FAULTS lists the faults to inject, "drop blackhole" by default.
+use strict;
+use warnings;
+use FindBin;
+use lib $FindBin::RealBin;
+use IPC::Run;
+use PgHaCluster;
+use PostgresNode;
+use TestLib;
+use Test::More;
+use Time::HiRes qw(time);
+
+my @faults = split(' ', $ENV{PGHA_BENCH_FAULTS} // 'drop blackhole');
+
+plan tests => 5 * scalar(@faults);
+
+my $cluster = PgHaCluster->new(sync => 1);
+my $master  = $cluster->node('master');
+
+$master->safe_psql('postgres', 'CREATE TABLE t (i int)');
+$cluster->wait_healthy;
+
+foreach my $fault (@faults)
+{
+	my $degradations = $master->safe_psql('postgres',
+		'SELECT degradations FROM pgha.degrade_status()');
+
+	is( $master->safe_psql(
+			'postgres',
+			"SELECT sync_state FROM pg_stat_replication WHERE application_name = 'standby1'"
+		),
+		'sync',
+		"standby1 is synchronous before $fault");
+
+	my $injected = $cluster->fault('standby1', $fault);
+
+	# This commit waits for standby1 until pgha gives up on it
+	my ($stdout, $stderr);
+	my $commit = IPC::Run::start(
+		[
+			'psql', '-X', '-A', '-t', '-d', $master->connstr('postgres'),
+			'-c', 'INSERT INTO t VALUES (1)'
+		],
+		'>', \$stdout, '2>', \$stderr, IPC::Run::timeout(180));
+	my $completed = eval { $commit->finish; };
+	my $stall = time() - $injected;
+	$commit->kill_kill unless defined $completed;
+
+	ok($completed, "the commit completes after $fault")
+	  or diag $@ || $stderr;
+
+	ok( $master->poll_query_until(
+			'postgres',
+			"SELECT degradations > $degradations AND persisted IS NOT NULL FROM pgha.degrade_status()"
+		),
+		"replication degrades to asynchronous after $fault");
+
+	my $status = $cluster->query_hash($master, <<'EOQ');
+SELECT *, extract(epoch FROM detected) AS detected_at,
+       extract(epoch FROM released) AS released_at
+FROM pgha.degrade_status()
+EOQ
+	is($status->{failed_node}, 'standby1', "standby1 is the failed node");
+
+	# pgha measures from the last contact, which may precede the fault
+	my $detected = ($status->{detected_at} - $injected) * 1000;
+	my $released = ($status->{released_at} - $injected) * 1000;
+
+	note sprintf(
+		"%s: detected %.1f ms and released %.1f ms after the fault, commit stall %.1f ms",
+		$fault, $detected, $released, $stall * 1000);
+
+	$cluster->record(
+		scenario         => 'degrade',
+		fault            => $fault,
+		detected         => $detected,
+		released         => $released,
+		commit_stall     => $stall * 1000,
+		detect_time      => $status->{detect_time},
+		release_time     => $status->{release_time},
+		persist_time     => $status->{persist_time},
+		stall_time       => $status->{stall_time},
+		released_commits => $status->{released_commits});
+
+	# Bring standby1 back as the synchronous standby for the next fault
+	$cluster->heal('standby1');
+	$cluster->wait_healthy;
+	$master->safe_psql('postgres',
+		"ALTER SYSTEM SET synchronous_standby_names = 'standby1'");
+	$master->safe_psql('postgres', 'SELECT pg_reload_conf()');
+	ok( $master->poll_query_until(
+			'postgres',
+			"SELECT sync_state = 'sync' FROM pg_stat_replication WHERE application_name = 'standby1'"
+		),
+		"standby1 is synchronous again after $fault");
+}
@@ -0,0 +1,89 @@
+# Failure of the master: how long it takes the standbys to detect it, to
+# elect the one to promote, and until the new master accepts writes.
+#
+# PGHA_BENCH_FAULT is the fault to inject, "blackhole" by default. The old
+# master keeps running behind it, as it would on the other side of a
+# network partition.
+use strict;
+use warnings;
+use FindBin;
+use lib $FindBin::RealBin;
+use PgHaCluster;
+use PostgresNode;
+use TestLib;
+use Test::More;
+use Time::HiRes qw(time sleep);
+
+my $fault = $ENV{PGHA_BENCH_FAULT} // 'blackhole';
+
+my $cluster = PgHaCluster->new;
+my @standbys = $cluster->standbys;
+
+if (@standbys)
+{
+	plan tests => 4;
+}
+else
+{
+	plan skip_all => 'failover needs at least one standby';
+}
+
+$cluster->node('master')->safe_psql('postgres', 'CREATE TABLE t (i int)');
+$cluster->wait_healthy;
+
+my $injected = $cluster->fault('master', $fault);
+
+# Wait for a standby to be promoted
+my @promoted;
+my $deadline = time() + 180;
+while (time() < $deadline)
+{
+	@promoted = grep {
+		$_->safe_psql('postgres', 'SELECT pg_is_in_recovery()') eq 'f'
+	} @standbys;
+	last if @promoted;
+	sleep(0.05);
+}
+my $observed = time() - $injected;
+
+is(scalar(@promoted), 1, "one standby is promoted after $fault of the master");
+
+SKIP:
+{
+	skip 'no standby was promoted', 3 unless @promoted;
+
+	my $new_master = $promoted[0];
+	my $status     = $cluster->query_hash($new_master, <<'EOQ');
+SELECT *, extract(epoch FROM detected) AS detected_at,
+       extract(epoch FROM first_write) AS first_write_at
+FROM pgha.failover_status()
+EOQ
+
+	is($status->{failed_node}, 'master', 'the master is the failed node');
+	is($status->{elected_node}, $new_master->name,
+		'the promoted standby is the elected one');
+
+	$new_master->safe_psql('postgres', 'INSERT INTO t VALUES (1)');
+	pass('the new master accepts writes');
+
+	# pgha measures from the last contact, which may precede the fault
+	my $detected    = ($status->{detected_at} - $injected) * 1000;
+	my $first_write = ($status->{first_write_at} - $injected) * 1000;
+
+	note sprintf(
+		"%s: detected %.1f ms, first write %.1f ms after the fault, %s elected",
+		$fault, $detected, $first_write, $status->{elected_node});
+
+	$cluster->record(
+		scenario         => 'failover',
+		fault            => $fault,
+		detected         => $detected,
+		first_write      => $first_write,
+		observed         => $observed * 1000,
+		detect_time      => $status->{detect_time},
+		decide_time      => $status->{decide_time},
+		promote_time     => $status->{promote_time},
+		first_write_time => $status->{first_write_time},
+		total_time       => $status->{total_time},
+		elected_node     => $status->{elected_node});
+}
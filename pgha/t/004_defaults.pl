@@ -0,0 +1,68 @@
+# A healthy cluster with the default pgha settings: nothing may be taken
+# for a failure, neither degrading the synchronous standby nor promoting a
+# standby, however long the heartbeats back off for.
+#
+# PGHA_BENCH_IDLE sets the seconds the cluster is left alone, 60 by default,
+# long enough for the heartbeats to back off to pgha.max_keepalives_time.
+use strict;
+use warnings;
+use FindBin;
+use lib $FindBin::RealBin;
+use PgHaCluster;
+use PostgresNode;
+use TestLib;
+use Test::More;
+
+my $idle = $ENV{PGHA_BENCH_IDLE} // 60;
+
+my $cluster = PgHaCluster->new(sync => 1, defaults => 1);
+my $master  = $cluster->node('master');
+my @standbys = $cluster->standbys;
+
+if (@standbys)
+{
+	plan tests => 3 + 2 * scalar(@standbys);
+}
+else
+{
+	plan skip_all => 'a healthy cluster needs at least one standby';
+}
+
+$master->safe_psql('postgres', 'CREATE TABLE t (i int)');
+$cluster->wait_healthy;
+
+# Keep committing meanwhile, so that a degradation would be noticed
+my $deadline = time() + $idle;
+while (time() < $deadline)
+{
+	$master->safe_psql('postgres', 'INSERT INTO t VALUES (1)');
+	sleep(1);
+}
+
+my $status = $cluster->query_hash($master, 'SELECT * FROM pgha.degrade_status()');
+is($status->{degradations}, 0, 'the master has not degraded');
+is( $master->safe_psql(
+		'postgres',
+		"SELECT sync_state FROM pg_stat_replication WHERE application_name = 'standby1'"
+	),
+	'sync',
+	'standby1 is still synchronous');
+is($master->safe_psql('postgres', 'SELECT pg_is_in_recovery()'),
+	'f', 'the master is still the master');
+
+foreach my $standby (@standbys)
+{
+	my $name = $standby->name;
+
+	is($standby->safe_psql('postgres', 'SELECT pg_is_in_recovery()'),
+		't', "$name is still a standby");
+	is( $standby->safe_psql(
+			'postgres', 'SELECT failed_node IS NULL FROM pgha.failover_status()'),
+		't',
+		"$name has not started a failover");
+}
+
+$cluster->record(
+	scenario     => 'defaults',
+	idle         => $idle,
+	degradations => $status->{degradations});
@@ -0,0 +1,446 @@
+
+=pod
+
+=head1 NAME
+
+PgHaCluster - a pgha cluster of a master and standbys on the localhost
+
+=head1 SYNOPSIS
+
+  use PgHaCluster;
+
+  my $cluster = PgHaCluster->new(sync => 1);
+  $cluster->wait_healthy;
+
+  my $injected = $cluster->fault('standby1', 'blackhole');
+  ...
+  $cluster->heal('standby1');
+
+  $cluster->record(scenario => 'degrade', stall => 1.234);
+
+=head1 DESCRIPTION
+
+The master is named "master" and the standbys "standby1" to "standbyN".
+Every connection to a node goes through a PgHaProxy of the node, and the
+replication connection of each standby goes through one of its own, so that
+a fault of a node can be injected by faulting all the proxies it talks
+through. pgha regards a standby streaming WAL as alive, and doesn't promote
+while WAL streams from the master, so faulting only the heartbeats would
+not do.
+
+These environment variables tune a run:
+
+=over
+
+=item PGHA_BENCH_STANDBYS
+
+Number of standbys, 2 by default.
+
+=item PGHA_BENCH_WORKERS
+
+pgha.heartbeat_workers, 0 by default.
+
+=item PGHA_BENCH_CONF
+
+Lines appended to postgresql.conf of every node, after the settings below.
+
+=item PGHA_BENCH_RESULTS
+
+File the results are appended to as JSON lines, pgha_bench.json in the
+tmp_check directory by default.
+
+=back
+
+=cut
+
+package PgHaCluster;
+
+use strict;
+use warnings;
+
+use Carp;
+use File::Basename;
+use JSON::PP;
+use PgHaProxy;
+use PostgresNode;
+use TestLib ();
+use Time::HiRes qw(time);
+
+# The replication timeouts bound how long a walsender or walreceiver keeps
+# a black-holed connection.
+my $base_conf = <<'EOF';
+shared_preload_libraries = 'pgha'
+hot_standby = on
+wal_sender_timeout = 5s
+wal_receiver_timeout = 5s
+wal_receiver_status_interval = 1s
+EOF
+
+# Detect failures within seconds rather than the default tens of seconds.
+# The interval to a healthy node still backs off, as it does by default.
+my $fast_conf = <<'EOF';
+pgha.keepalives_time = 1s
+pgha.min_keepalives_time = 200ms
+pgha.max_keepalives_time = 4s
+pgha.heartbeat_timeout = 1s
+pgha.retry_count = 3
+EOF
+
+=pod
+
+=head1 METHODS
+
+=over
+
+=item PgHaCluster->new(%params)
+
+Set up and start the cluster. Parameters:
+
+=over
+
+=item standbys => N
+
+Number of standbys, overriding PGHA_BENCH_STANDBYS.
+
+=item sync => 1
+
+Make standby1 the synchronous standby.
+
+=item conf => string
+
+Lines appended to postgresql.conf of every node.
+
+=item defaults => 1
+
+Leave the pgha settings at their defaults rather than detect failures
+within seconds.
+
+=back
+
+=cut
+
+sub new
+{
+	my ($class, %params) = @_;
+	my $n_standbys = $params{standbys} // $ENV{PGHA_BENCH_STANDBYS} // 2;
+	my $workers = $ENV{PGHA_BENCH_WORKERS} // 0;
+
+	my $self = bless {
+		nodes   => [],
+		links   => {},
+		inbound => {},
+		sync    => $params{sync} ? 1 : 0,
+	}, $class;
+
+	my $conf = $base_conf;
+	$conf .= $fast_conf unless $params{defaults};
+	$conf .= "pgha.heartbeat_workers = $workers\n";
+	$conf .= "$params{conf}\n" if defined $params{conf};
+	$conf .= "$ENV{PGHA_BENCH_CONF}\n" if defined $ENV{PGHA_BENCH_CONF};
+
+	my $master = get_new_node('master');
+	$self->_add_inbound($master);
+
+	$master->init(allows_streaming => 1);
+	$master->append_conf('postgresql.conf', $conf);
+	$master->append_conf('postgresql.conf',
+		"synchronous_standby_names = 'standby1'\n")
+	  if $self->{sync};
+	$self->_append_pgha_conf($master);
+	$master->start;
+	$master->safe_psql('postgres', 'CREATE EXTENSION pgha');
+	$master->backup('pgha_backup');
+	push @{ $self->{nodes} }, $master;
+
+	for my $i (1 .. $n_standbys)
+	{
+		my $standby = get_new_node("standby$i");
+		my $name    = $standby->name;
+
+		$self->_add_inbound($standby);
+
+		# The replication connection of the standby to the master
+		my $repl = PgHaProxy->new("repl_$name", $master->host, $master->port);
+		push @{ $self->{links}->{$name} },  $repl;
+		push @{ $self->{links}->{master} }, $repl;
+
+		$standby->init_from_backup($master, 'pgha_backup');
+
+		# Join the cluster afresh rather than restore the master's view
+		unlink($standby->data_dir . '/pgha.registry',
+			$standby->data_dir . '/pgha.routing');
+
+		$standby->append_conf('recovery.conf', <<"EOF");
+standby_mode = on
+recovery_target_timeline = 'latest'
+primary_conninfo = 'host=127.0.0.1 port=@{[ $repl->port ]} application_name=$name'
+EOF
+		$standby->append_conf('postgresql.conf',
+			"synchronous_standby_names = ''\n");
+		$self->_append_pgha_conf($standby);
+		$standby->append_conf('postgresql.conf',
+			"pgha.master_conninfo = '" . $self->conninfo('master') . "'\n");
+		$standby->start;
+		push @{ $self->{nodes} }, $standby;
+	}
+
+	return $self;
+}
+
+=pod
+
+=item $cluster->nodes()
+
+All the nodes, the master first.
+
+=cut
+
+sub nodes
+{
+	my ($self) = @_;
+	return @{ $self->{nodes} };
+}
+
+=pod
+
+=item $cluster->node(name)
+
+The node of the given name.
+
+=cut
+
+sub node
+{
+	my ($self, $name) = @_;
+	my ($node) = grep { $_->name eq $name } $self->nodes;
+
+	croak "no node \"$name\"" unless $node;
+	return $node;
+}
+
+=pod
+
+=item $cluster->standbys()
+
+The nodes started as standbys.
+
+=cut
+
+sub standbys
+{
+	my ($self) = @_;
+	my @nodes = $self->nodes;
+	return @nodes[ 1 .. $#nodes ];
+}
+
+=pod
+
+=item $cluster->conninfo(name)
+
+The pgha.my_conninfo of the node, through its proxy.
+
+=cut
+
+sub conninfo
+{
+	my ($self, $name) = @_;
+	return
+	  "host=127.0.0.1 port=" . $self->{inbound}->{$name}->port . " dbname=postgres";
+}
+
+=pod
+
+=item $cluster->wait_healthy()
+
+Wait until every node has heard from every other, none of them is
+suspected, and the master streams WAL to every standby.
+
+=cut
+
+sub wait_healthy
+{
+	my ($self) = @_;
+	my $n_nodes    = scalar($self->nodes);
+	my $n_standbys = $n_nodes - 1;
+
+	foreach my $node ($self->nodes)
+	{
+		$node->poll_query_until('postgres', <<"EOQ")
+SELECT count(*) = $n_nodes AND
+       bool_and(phi IS NULL OR
+                (last_success IS NOT NULL AND
+                 phi < current_setting('pgha.phi_threshold')::float8))
+FROM pgha.node_stats()
+EOQ
+		  or croak "pgha on " . $node->name . " did not see a healthy cluster";
+	}
+
+	$self->node('master')->poll_query_until('postgres', <<"EOQ")
+SELECT count(*) = $n_standbys FROM pg_stat_replication WHERE state = 'streaming'
+EOQ
+	  or croak "not all standbys are streaming";
+	return;
+}
+
+=pod
+
+=item $cluster->fault(name, mode[, ms])
+
+Inject a fault of the given PgHaProxy mode into every connection of the
+node, and return the time it was injected.
+
+=cut
+
+sub fault
+{
+	my ($self, $name, $mode, $arg) = @_;
+
+	croak "no links of node \"$name\"" unless $self->{links}->{$name};
+	$_->set_fault($mode, $arg) foreach @{ $self->{links}->{$name} };
+	return time();
+}
+
+=pod
+
+=item $cluster->heal(name)
+
+Let the connections of the node through again.
+
+=cut
+
+sub heal
+{
+	my ($self, $name) = @_;
+
+	$self->fault($name, 'pass');
+	return;
+}
+
+=pod
+
+=item $cluster->link_stats(name)
+
+Connections accepted and bytes forwarded by the proxy in front of the node.
+
+=cut
+
+sub link_stats
+{
+	my ($self, $name) = @_;
+	return $self->{inbound}->{$name}->stats;
+}
+
+=pod
+
+=item $cluster->worker_totals(node)
+
+Sum of pgha.worker_stats() over the workers of the node, as a hash.
+
+=cut
+
+sub worker_totals
+{
+	my ($self, $node) = @_;
+	my $row = $node->safe_psql('postgres', <<'EOQ');
+SELECT sum(rounds), sum(probes), sum(probe_failures), sum(walsender_checks),
+       sum(connects), sum(user_cpu_time + system_cpu_time),
+       max(max_round_time),
+       sum(mean_round_time * rounds) / nullif(sum(rounds), 0)
+FROM pgha.worker_stats()
+EOQ
+	my %totals;
+
+	@totals{
+		qw(rounds probes probe_failures walsender_checks connects cpu_time
+		  max_round_time mean_round_time)
+	} = map { $_ eq '' ? undef : $_ + 0 } split(/\|/, $row, -1);
+	return \%totals;
+}
+
+=pod
+
+=item $cluster->query_hash(node, query)
+
+Run a query returning one row, and return it as a hash by column name.
+NULLs are undef.
+
+=cut
+
+sub query_hash
+{
+	my ($self, $node, $query) = @_;
+	my $json = $node->safe_psql('postgres',
+		"SELECT row_to_json(q) FROM ($query) q");
+
+	croak "query returned no row: $query" if $json eq '';
+	return decode_json($json);
+}
+
+=pod
+
+=item $cluster->record(%result)
+
+Append a result to the results file as a JSON line, along with the test,
+the size of the cluster and the pgha settings, so that runs can be
+compared.
+
+=cut
+
+sub record
+{
+	my ($self, %result) = @_;
+	my $file = $ENV{PGHA_BENCH_RESULTS}
+	  // "$TestLib::tmp_check/pgha_bench.json";
+
+	if (!$self->{settings})
+	{
+		my $settings = $self->node('master')->safe_psql('postgres', <<'EOQ');
+SELECT json_object_agg(name, setting) FROM pg_settings WHERE name LIKE 'pgha.%'
+EOQ
+		$self->{settings} = decode_json($settings);
+	}
+
+	my %record = (
+		test     => basename($0, '.pl'),
+		time     => time(),
+		standbys => scalar($self->standbys),
+		settings => $self->{settings},
+		%result);
+
+	open(my $fh, '>>', $file) or croak "could not open $file: $!";
+	print $fh JSON::PP->new->canonical->encode(\%record), "\n";
+	close($fh);
+	return;
+}
+
+=pod
+
+=back
+
+=cut
+
+# Start the proxy for the connections to the node
+sub _add_inbound
+{
+	my ($self, $node) = @_;
+	my $name  = $node->name;
+	my $proxy = PgHaProxy->new($name, $node->host, $node->port);
+
+	$self->{inbound}->{$name} = $proxy;
+	push @{ $self->{links}->{$name} }, $proxy;
+	return $proxy;
+}
+
+sub _append_pgha_conf
+{
+	my ($self, $node) = @_;
+	my $name = $node->name;
+
+	$node->append_conf('postgresql.conf', <<"EOF");
+pgha.node_name = '$name'
+pgha.my_conninfo = '@{[ $self->conninfo($name) ]}'
+EOF
+	return;
+}
+
+1;
@@ -0,0 +1,507 @@
+
+=pod
+
+=head1 NAME
+
+PgHaProxy - fault-injecting TCP proxy for the pgha TAP tests
+
+=head1 SYNOPSIS
+
+  use PgHaProxy;
+
+  # Forward 127.0.0.1:$proxy->port to a node
+  my $proxy = PgHaProxy->new('master', $node->host, $node->port);
+
+  # Inject a fault, and go back to forwarding
+  $proxy->set_fault('delay', 200);
+  $proxy->set_fault('blackhole');
+  $proxy->set_fault('pass');
+
+  my $stats = $proxy->stats;
+  $proxy->stop;
+
+=head1 DESCRIPTION
+
+Every connection to a node in the tests goes through a proxy process of its
+own, so that the faults of a network between nodes can be injected on the
+localhost. A proxy is in one of these modes:
+
+=over
+
+=item pass
+
+Forward in both directions.
+
+=item delay I<ms>
+
+Forward every chunk of data I<ms> milliseconds after it arrived.
+
+=item drop
+
+Reset every connection, existing and new, as a crashed host or a rejecting
+firewall would.
+
+=item blackhole
+
+Keep the connections, but silently discard everything sent over them, as a
+partitioned network would. The proxy can't hold back the handshake, so new
+connections are established but never answered. The connections that lost
+data are reset when the proxy leaves the mode.
+
+=back
+
+The mode is passed to the proxy process through a control file, and
+set_fault() returns only once the proxy has applied it, so that the time it
+returns can be taken as the time the fault was injected.
+
+=cut
+
+package PgHaProxy;
+
+use strict;
+use warnings;
+
+use Carp;
+use IO::Select;
+use IO::Socket::INET;
+use IO::Socket::UNIX;
+use POSIX ();
+use Socket qw(SOL_SOCKET SO_LINGER);
+use Time::HiRes qw(time);
+use TestLib ();
+
+# Longest a proxy sleeps before it checks the control file again
+my $poll_interval = 0.005;
+
+my @all_proxies;
+
+=pod
+
+=head1 METHODS
+
+=over
+
+=item PgHaProxy->new(name, host, port)
+
+Start a proxy to the given node on a free port of 127.0.0.1. A host that
+is an absolute path is the directory of the node's Unix socket.
+
+=cut
+
+sub new
+{
+	my ($class, $name, $host, $port) = @_;
+
+	my $listener = IO::Socket::INET->new(
+		LocalAddr => '127.0.0.1',
+		LocalPort => 0,
+		Proto     => 'tcp',
+		Listen    => 64,
+		ReuseAddr => 1) or croak "could not listen for proxy $name: $!";
+
+	my $self = bless {
+		name     => $name,
+		host     => $host,
+		port     => $port,
+		listen   => $listener->sockport,
+		control  => "$TestLib::tmp_check/proxy_$name.control",
+		ack      => "$TestLib::tmp_check/proxy_$name.ack",
+		gen      => 0,
+		parent   => $$,
+	}, $class;
+
+	unlink $self->{ack};
+	$self->_write_control('pass');
+
+	my $pid = fork();
+	croak "could not fork proxy $name: $!" unless defined $pid;
+	if ($pid == 0)
+	{
+		$self->_run($listener);
+		POSIX::_exit(0);
+	}
+
+	close($listener);
+	$self->{pid} = $pid;
+	$self->_wait_ack;
+	push @all_proxies, $self;
+
+	return $self;
+}
+
+=pod
+
+=item $proxy->port()
+
+Port the proxy listens on.
+
+=cut
+
+sub port
+{
+	my ($self) = @_;
+	return $self->{listen};
+}
+
+=pod
+
+=item $proxy->set_fault(mode[, ms])
+
+Switch the proxy to the given mode, see above, and wait until it has been
+applied.
+
+=cut
+
+sub set_fault
+{
+	my ($self, $mode, $arg) = @_;
+
+	croak "unknown proxy mode \"$mode\""
+	  unless $mode =~ /^(pass|delay|drop|blackhole)$/;
+	croak "delay needs a number of milliseconds"
+	  if $mode eq 'delay' && !defined $arg;
+
+	$self->_write_control($mode, $arg);
+	$self->_wait_ack;
+	return;
+}
+
+=pod
+
+=item $proxy->stats()
+
+Return a hash of the connections accepted and the bytes forwarded to and
+from the node since the proxy started.
+
+=cut
+
+sub stats
+{
+	my ($self) = @_;
+
+	# Ask for a fresh acknowledgement without changing the mode
+	$self->_write_control(@{ $self->{mode} });
+	my %stats;
+	@stats{qw(connections bytes_in bytes_out)} = @{ $self->_wait_ack };
+	return \%stats;
+}
+
+=pod
+
+=item $proxy->stop()
+
+Stop the proxy, closing all its connections.
+
+=cut
+
+sub stop
+{
+	my ($self) = @_;
+
+	return unless defined $self->{pid} && $self->{parent} == $$;
+
+	kill 'TERM', $self->{pid};
+	waitpid($self->{pid}, 0);
+	delete $self->{pid};
+	return;
+}
+
+=pod
+
+=back
+
+=cut
+
+sub _write_control
+{
+	my ($self, $mode, $arg) = @_;
+
+	$self->{gen}++;
+	$self->{mode} = [ $mode, defined $arg ? $arg : () ];
+
+	# Renamed into place, so that the proxy never reads a partial line
+	my $tmp = "$self->{control}.tmp";
+	open(my $fh, '>', $tmp) or croak "could not write $tmp: $!";
+	print $fh join(' ', $self->{gen}, $mode, defined $arg ? $arg : 0), "\n";
+	close($fh);
+	rename($tmp, $self->{control}) or croak "could not rename $tmp: $!";
+	return;
+}
+
+sub _wait_ack
+{
+	my ($self) = @_;
+	my $deadline = time() + 30;
+
+	while (time() < $deadline)
+	{
+		if (open(my $fh, '<', $self->{ack}))
+		{
+			my $line = <$fh>;
+			close($fh);
+			if (defined $line && $line =~ /^(\d+) (\d+) (\d+) (\d+)$/
+				&& $1 == $self->{gen})
+			{
+				return [ $2, $3, $4 ];
+			}
+		}
+		die "proxy $self->{name} has exited"
+		  if waitpid($self->{pid}, POSIX::WNOHANG()) > 0;
+		Time::HiRes::sleep($poll_interval);
+	}
+	croak "proxy $self->{name} did not apply generation $self->{gen}";
+}
+
+# Main loop of the proxy process
+sub _run
+{
+	my ($self, $listener) = @_;
+	my %state = (
+		gen         => 0,
+		mode        => 'pass',
+		delay       => 0,
+		connections => 0,
+		bytes_in    => 0,
+		bytes_out   => 0);
+
+	# A pair is a client connection, and the one to the node if any
+	my @pairs;
+
+	$SIG{TERM} = sub { POSIX::_exit(0); };
+
+	while (1)
+	{
+		# Don't outlive the test script
+		POSIX::_exit(0) if getppid() != $self->{parent};
+
+		$self->_read_control(\%state, \@pairs);
+
+		my $select = IO::Select->new($listener);
+		foreach my $pair (@pairs)
+		{
+			foreach my $side (qw(client server))
+			{
+				$select->add($pair->{$side})
+				  if defined $pair->{$side} && !$pair->{"${side}_eof"};
+			}
+		}
+
+		my $timeout = $poll_interval;
+		my $now     = time();
+		foreach my $pair (@pairs)
+		{
+			foreach my $chunk (@{ $pair->{queue} })
+			{
+				my $wait = $chunk->{due} - $now;
+				$timeout = $wait if $wait < $timeout;
+			}
+		}
+		$timeout = 0 if $timeout < 0;
+
+		foreach my $sock ($select->can_read($timeout))
+		{
+			if ($sock == $listener)
+			{
+				my $client = $listener->accept or next;
+				$state{connections}++;
+				push @pairs, $self->_open_pair(\%state, $client);
+				next;
+			}
+
+			my ($pair) = grep {
+				     (defined $_->{client} && $_->{client} == $sock)
+				  || (defined $_->{server} && $_->{server} == $sock)
+			} @pairs;
+			next unless $pair && !$pair->{closed};
+
+			my $side =
+			  (defined $pair->{client} && $sock == $pair->{client})
+			  ? 'client'
+			  : 'server';
+			my $data;
+			my $n = sysread($sock, $data, 65536);
+
+			if ($state{mode} eq 'blackhole')
+			{
+				# Not even the end of the connection gets through
+				if (!$n)
+				{
+					close($sock);
+					$pair->{$side} = undef;
+				}
+				$pair->{broken} = 1;
+				next;
+			}
+
+			# The end of the connection is delayed like the data
+			push @{ $pair->{queue} },
+			  {
+				due       => time() + $state{delay} / 1000.0,
+				to_server => $side eq 'client',
+				data      => $n ? $data : undef
+			  };
+
+			# Stop reading it until it is closed
+			$pair->{"${side}_eof"} = 1 unless $n;
+		}
+
+		# Forward what is due, in the order it arrived
+		$now = time();
+		foreach my $pair (@pairs)
+		{
+			while (!$pair->{closed} && @{ $pair->{queue} }
+				&& $pair->{queue}->[0]->{due} <= $now)
+			{
+				my $chunk = shift @{ $pair->{queue} };
+				my $sock = $chunk->{to_server} ? $pair->{server} : $pair->{client};
+
+				if (!defined $chunk->{data} || !_write_all($sock, $chunk->{data}))
+				{
+					_close_pair($pair, 0);
+					last;
+				}
+				$state{ $chunk->{to_server} ? 'bytes_in' : 'bytes_out' } +=
+				  length($chunk->{data});
+			}
+		}
+		@pairs = grep { !$_->{closed} } @pairs;
+	}
+}
+
+# Apply a new control file, if any, and acknowledge it
+sub _read_control
+{
+	my ($self, $state, $pairs) = @_;
+
+	open(my $fh, '<', $self->{control}) or return;
+	my $line = <$fh>;
+	close($fh);
+
+	return unless defined $line && $line =~ /^(\d+) (\w+) (\d+)$/;
+	return if $1 == $state->{gen};
+
+	my ($gen, $mode, $arg) = ($1, $2, $3);
+	my $was = $state->{mode};
+
+	$state->{gen}   = $gen;
+	$state->{mode}  = $mode;
+	$state->{delay} = $mode eq 'delay' ? $arg : 0;
+
+	foreach my $pair (@$pairs)
+	{
+		if ($mode eq 'drop')
+		{
+			_close_pair($pair, 1);
+		}
+		elsif ($mode eq 'blackhole')
+		{
+			# What was in flight is lost as well
+			$pair->{broken} = 1 if @{ $pair->{queue} };
+			$pair->{queue} = [];
+		}
+		elsif ($was eq 'blackhole' && ($pair->{broken} || !$pair->{server}))
+		{
+			_close_pair($pair, 1);
+		}
+	}
+	@$pairs = grep { !$_->{closed} } @$pairs;
+
+	my $ack = "$self->{ack}.tmp";
+	open(my $out, '>', $ack) or die "could not write $ack: $!";
+	print $out join(' ',
+		$gen, $state->{connections}, $state->{bytes_in}, $state->{bytes_out}),
+	  "\n";
+	close($out);
+	rename($ack, $self->{ack}) or die "could not rename $ack: $!";
+	return;
+}
+
+# Set up a pair for a new client connection according to the mode
+sub _open_pair
+{
+	my ($self, $state, $client) = @_;
+	my $pair = { client => $client, queue => [] };
+
+	if ($state->{mode} eq 'drop')
+	{
+		_reset($client);
+		return ();
+	}
+
+	# A black hole answers nothing, so it doesn't reach the node either
+	return $pair if $state->{mode} eq 'blackhole';
+
+	if ($self->{host} =~ m!^/!)
+	{
+		$pair->{server} =
+		  IO::Socket::UNIX->new(Peer => "$self->{host}/.s.PGSQL.$self->{port}");
+	}
+	else
+	{
+		$pair->{server} = IO::Socket::INET->new(
+			PeerAddr => $self->{host},
+			PeerPort => $self->{port},
+			Proto    => 'tcp');
+	}
+
+	# The node is down; pass that on
+	if (!$pair->{server})
+	{
+		_reset($client);
+		return ();
+	}
+
+	return $pair;
+}
+
+sub _write_all
+{
+	my ($sock, $data) = @_;
+	my $off = 0;
+
+	while ($off < length($data))
+	{
+		my $n = syswrite($sock, $data, length($data) - $off, $off);
+		return 0 unless defined $n;
+		$off += $n;
+	}
+	return 1;
+}
+
+sub _close_pair
+{
+	my ($pair, $reset) = @_;
+
+	return if $pair->{closed};
+	foreach my $sock (grep { defined } $pair->{client}, $pair->{server})
+	{
+		if ($reset)
+		{
+			_reset($sock);
+		}
+		else
+		{
+			close($sock);
+		}
+	}
+	$pair->{closed} = 1;
+	return;
+}
+
+# Close with a RST rather than a FIN, as a peer that has gone away would
+sub _reset
+{
+	my ($sock) = @_;
+
+	setsockopt($sock, SOL_SOCKET, SO_LINGER, pack('ii', 1, 0));
+	close($sock);
+	return;
+}
+
+END
+{
+	local $?;
+	$_->stop foreach @all_proxies;
+}
+
+1;